@@ -0,0 +1,111 @@
+/*
+ * avr/atomic.h
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+
+/*
+ * There's no atomic read-modify-write instruction on the AVR so we simply
+ * keep interrupts out for the three instructions that it takes.  We put SREG
+ * back as we found it rather than enabling interrupts, so these are safe to
+ * use from within ISRs too.
+ */
+
+/*
+ * atomic_ref_inc()
+ *	Atomically increment a reference count.
+ */
+extern inline void atomic_ref_inc(ref_t *r)
+{
+	u8_t sreg;
+	
+	asm volatile ("in %0, __SREG__\n\t"
+			"cli\n\t"
+			: "=r" (sreg)
+			: /* No input */
+			: "memory");
+	(*r)++;
+	asm volatile ("out __SREG__, %0\n\t"
+			: /* No output */
+			: "r" (sreg)
+			: "memory");
+}
+
+/*
+ * atomic_ref_dec()
+ *	Atomically decrement a reference count and return the new value.
+ */
+extern inline ref_t atomic_ref_dec(ref_t *r)
+{
+	u8_t sreg;
+	ref_t res;
+	
+	asm volatile ("in %0, __SREG__\n\t"
+			"cli\n\t"
+			: "=r" (sreg)
+			: /* No input */
+			: "memory");
+	res = --(*r);
+	asm volatile ("out __SREG__, %0\n\t"
+			: /* No output */
+			: "r" (sreg)
+			: "memory");
+
+	return res;
+}
+
+/*
+ * atomic_ptr_get()
+ *	Atomically read a pointer that may be changed by another thread.
+ */
+extern inline void *atomic_ptr_get(void **p)
+{
+	u8_t sreg;
+	void *res;
+	
+	asm volatile ("in %0, __SREG__\n\t"
+			"cli\n\t"
+			: "=r" (sreg)
+			: /* No input */
+			: "memory");
+	res = *p;
+	asm volatile ("out __SREG__, %0\n\t"
+			: /* No output */
+			: "r" (sreg)
+			: "memory");
+
+	return res;
+}
+
+/*
+ * atomic_ptr_set()
+ *	Atomically write a pointer that may be read by another thread.
+ */
+extern inline void atomic_ptr_set(void **p, void *val)
+{
+	u8_t sreg;
+	
+	asm volatile ("in %0, __SREG__\n\t"
+			"cli\n\t"
+			: "=r" (sreg)
+			: /* No input */
+			: "memory");
+	*p = val;
+	asm volatile ("out __SREG__, %0\n\t"
+			: /* No output */
+			: "r" (sreg)
+			: "memory");
+}
@@ -38,6 +38,41 @@
 	res; \
 })
 
+/*
+ * ROM_DATA
+ *	Attribute used to place constant tables within the ROM space.
+ *
+ * Anything declared with this must be read with rom_read8(), etc.
+ */
+#define ROM_DATA __attribute__ ((progmem))
+
+/*
+ * rom_read8()
+ *	Read a byte from the ROM space.
+ */
+extern inline u8_t rom_read8(const void *addr)
+{
+	return __lpm_macro(addr);
+}
+
+/*
+ * rom_read16()
+ *	Read a 16 bit value from the ROM space.
+ */
+extern inline u16_t rom_read16(const void *addr)
+{
+	return (u16_t)rom_read8(addr) | ((u16_t)rom_read8((const u8_t *)addr + 1) << 8);
+}
+
+/*
+ * rom_read32()
+ *	Read a 32 bit value from the ROM space.
+ */
+extern inline u32_t rom_read32(const void *addr)
+{
+	return (u32_t)rom_read16(addr) | ((u32_t)rom_read16((const u8_t *)addr + 2) << 16);
+}
+
 /*
  * memcpy()
  *	Copy a block of memory from one location to another.
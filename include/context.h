@@ -67,11 +67,12 @@ struct context {
 	struct cpu_context c_cpu;	/* CPU-specific context information - e.g. saved registers */
 	priority_t c_priority;		/* Operating priority */
 	u8_t c_state;			/* Operating state - e.g. running, ready, sleeping, etc */
-	struct context *c_run_queue;	/* Next context on the system run queue after us */
+	struct context *c_run_queue;	/* Next context on our run list after us */
 	struct context *c_sleep_queue;	/* Next context on a queue of sleeping contexts */
 	void *c_stack_memory;		/* Base address of this context's stack - used to detect blown stacks */
 	u16_t c_context_switches;	/* Number of times that this context been switched out */
 	u8_t c_spinlocks_held;		/* Number of spinlocks currently held by this context */
+	u8_t c_run_index;		/* Run list that we're on (while ready or running) */
 };
 
 /*
@@ -96,6 +97,8 @@ extern u8_t run_queue_len;
  * Function declarations
  */
 extern void isr_context_ready(struct context *c);
+extern void isr_context_unready(struct context *c);
+extern void isr_context_preempt(void);
 extern u8_t isr_context_switch(void);
 extern void context_exit(void) __attribute__ ((noreturn));
 extern void isr_context_yield(void);
@@ -0,0 +1,32 @@
+/*
+ * crc.h
+ *	Cyclic redundancy check (CRC) support.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+
+/*
+ * Function prototypes.
+ */
+extern void crc8_init(void);
+extern u8_t crc8_update(u8_t crc, u8_t val);
+extern u8_t crc8_block(u8_t crc, void *buf, addr_t count);
+extern void crc16_init(void);
+extern u16_t crc16_update(u16_t crc, u8_t val);
+extern u16_t crc16_block(u16_t crc, void *buf, addr_t count);
+extern void crc32_init(void);
+extern u32_t crc32_update(u32_t crc, u8_t val);
+extern u32_t crc32_block(u32_t crc, void *buf, addr_t count);
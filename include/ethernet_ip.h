@@ -40,46 +40,54 @@ struct ip_arp_header {
 } __attribute__ ((packed));
 
 /*
- * ip_arp_cache_slot
+ * ARP cache entry.
+ *
+ * An entry is pending from when we first ask for its MAC address until we get
+ * an answer or give up.  While it's pending we hold copies of a few of the
+ * packets that are waiting to be sent to it.
  */
 struct ip_arp_cache_slot {
-	u32_t iacs_ip;
-	u8_t iacs_mac[6];
-	u32_t iacs_age;
+	u32_t iacs_ip;			/* IP address */
+	u8_t iacs_mac[6];		/* MAC address (if resolved) */
+	u8_t iacs_state;		/* State of the entry (see below) */
+	u8_t iacs_requests;		/* Number of requests sent while pending */
+	u32_t iacs_jiffies;		/* When resolved, or when the last request was sent */
+	struct netbuf *iacs_pending;	/* Packets waiting for the MAC address */
+	u8_t iacs_pending_count;	/* Number of packets waiting */
 };
 
 /*
- * Number of ARP cache slots allocated per IP instance.
+ * ARP cache entry states.
  */
-#define ARP_CACHE_SLOTS 8
+#define ARP_SLOT_FREE 0
+#define ARP_SLOT_PENDING 1
+#define ARP_SLOT_RESOLVED 2
 
 /*
- * Route information specific to network routes.
+ * Number of ARP cache slots allocated per IP instance (this must be a power
+ * of 2).  An address is hashed to a slot and may be held in that slot or any
+ * of the next (ARP_CACHE_PROBES - 1) slots.
  */
-struct ip_route_network {
-	u32_t irn_addr;			/* Network number */
-	u32_t irn_netmask;		/* Netmask for the network */
-};
+#if defined(I386)
+#define ARP_CACHE_SLOTS 64
+#define ARP_PENDING_MAX 4
+#else
+#define ARP_CACHE_SLOTS 8
+#define ARP_PENDING_MAX 2
+#endif
 
-/*
- * Route information specific to host routes.
- */
-struct ip_route_host {
-	u32_t irh_addr;
-};
+#define ARP_CACHE_MASK (ARP_CACHE_SLOTS - 1)
+#define ARP_CACHE_PROBES 4
 
 /*
- * Route details.
+ * ARP timing.  Resolved entries expire after ARP_CACHE_TIMEOUT.  Pending
+ * entries have a request sent for them at most every ARP_REQUEST_INTERVAL,
+ * and we give up on them (discarding any packets that are waiting) once
+ * ARP_REQUEST_RETRIES requests have gone unanswered.
  */
-struct ip_route {
-	u8_t ir_network;		/* Is this a route to a network or a host? */
-	union {
-		struct ip_route_network ir_network;
-		struct ip_route_host ir_host;
-	} ir_addr;
-	u32_t ir_gateway;		/* Address of gateway to access this route */
-	struct ip_route *ir_next;
-};
+#define ARP_CACHE_TIMEOUT (300 * TICK_RATE)
+#define ARP_REQUEST_INTERVAL TICK_RATE
+#define ARP_REQUEST_RETRIES 3
 
 /*
  * IP to Ethernet instance.
@@ -91,8 +99,8 @@ struct ip_route {
 struct ethernet_ip_instance {
 	struct ip_datalink_instance eii_idi;
 	struct ip_arp_cache_slot eii_arp_cache[ARP_CACHE_SLOTS];
-	u32_t eii_ip_arp_age;
-	struct ip_route *eii_route_info;
+	struct oneshot *eii_arp_timer;	/* Timer that expires and retries ARP cache entries */
+	u8_t eii_arp_timer_running;	/* Is the ARP timer running? */
 	u16_t eii_pkt_ident;
 	struct ethernet_server *eii_ip_server;
 	struct ethernet_server *eii_arp_server;
@@ -103,4 +111,5 @@ struct ethernet_instance;
 /*
  * Function prototypes.
  */
+extern u8_t ip_arp_request(struct ip_datalink_instance *idi, u32_t ip);
 extern struct ip_datalink_instance *ethernet_ip_instance_alloc(struct ethernet_instance *ei);
@@ -29,18 +29,55 @@
 #define MEMORY_BLOCK_MAGIC 0x4d42
 
 /*
- * Structure used to create a list of memory holes (i.e. free memory blocks).
+ * Segregated free-list configuration.  Free blocks are indexed first by the
+ * power of two of their size (the "first level") and then by a linear split
+ * of that range (the "second level").  HEAP_FL_INDEX_MAX is the log2 of the
+ * largest block size that can be handled, which is simply the width of addr_t.
+ * The 8-bit targets use fewer second level lists to keep the size of the list
+ * head table down.
+ */
+#if defined(I386)
+#define HEAP_SL_INDEX_COUNT_LOG2 4
+#define HEAP_FL_INDEX_MAX 32
+#else
+#define HEAP_SL_INDEX_COUNT_LOG2 2
+#define HEAP_FL_INDEX_MAX 16
+#endif
+
+#define HEAP_ALIGN_LOG2 2
+#define HEAP_ALIGN (1 << HEAP_ALIGN_LOG2)
+#define HEAP_SL_INDEX_COUNT (1 << HEAP_SL_INDEX_COUNT_LOG2)
+#define HEAP_FL_INDEX_SHIFT (HEAP_SL_INDEX_COUNT_LOG2 + HEAP_ALIGN_LOG2)
+#define HEAP_FL_INDEX_COUNT (HEAP_FL_INDEX_MAX - HEAP_FL_INDEX_SHIFT + 1)
+#define HEAP_SMALL_BLOCK_SIZE (1 << HEAP_FL_INDEX_SHIFT)
+
+/*
+ * Flags held in the low bits of a block's size.  All block sizes are a
+ * multiple of HEAP_ALIGN so these bits are otherwise unused.
+ */
+#define HEAP_BLOCK_FREE 0x01		/* This block is a hole */
+#define HEAP_BLOCK_PREV_FREE 0x02	/* The physically preceding block is a hole */
+#define HEAP_BLOCK_FLAGS (HEAP_ALIGN - 1)
+
+/*
+ * Structure used to create the lists of memory holes (i.e. free memory
+ * blocks).
  */
 struct memory_hole {
-	addr_t mh_size;			/* Size of the hole including this structure */
-	struct memory_hole *mh_next;	/* Pointer to the next hole in memory */
+	addr_t mh_size;			/* Size of the hole including this structure, plus flags */
+	struct memory_hole *mh_prev_phys;
+					/* Hole or block physically preceding this one */
+	struct memory_hole *mh_next;	/* Pointer to the next hole in the same size class */
+	struct memory_hole *mh_prev;	/* Pointer to the previous hole in the same size class */
 };
 
 /*
  * Structure used to prefix any allocated block of memory.
  */
 struct memory_block {
-	addr_t mb_size;			/* Size of the block including this structure */
+	addr_t mb_size;			/* Size of the block including this structure, plus flags */
+	struct memory_block *mb_prev_phys;
+					/* Hole or block physically preceding this one */
 };
 
 /*
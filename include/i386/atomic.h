@@ -0,0 +1,84 @@
+/*
+ * i386/atomic.h
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+
+/*
+ * atomic_ref_inc()
+ *	Atomically increment a reference count.
+ */
+extern inline void atomic_ref_inc(ref_t *r)
+{
+	asm volatile ("lock; incl %0\n\t"
+			: "+m" (*r)
+			: /* No input */
+			: "memory");
+}
+
+/*
+ * atomic_ref_dec()
+ *	Atomically decrement a reference count.
+ *
+ * Returns zero if the count has reached zero, or non-zero otherwise.  We
+ * don't use xadd to get the new count back as the i386 doesn't have it.
+ */
+extern inline ref_t atomic_ref_dec(ref_t *r)
+{
+	u8_t res;
+
+	asm volatile ("lock; decl %0\n\t"
+			"setnz %1\n\t"
+			: "+m" (*r), "=q" (res)
+			: /* No input */
+			: "memory", "cc");
+
+	return (ref_t)res;
+}
+
+/*
+ * atomic_ptr_get()
+ *	Atomically read a pointer that may be changed by another thread.
+ *
+ * Aligned 32 bit reads and writes are atomic so all we need to do is stop
+ * the compiler from caching or reordering the access.
+ */
+extern inline void *atomic_ptr_get(void **p)
+{
+	void *res;
+
+	asm volatile ("movl %1, %0\n\t"
+			: "=r" (res)
+			: "m" (*p)
+			: "memory");
+
+	return res;
+}
+
+/*
+ * atomic_ptr_set()
+ *	Atomically write a pointer that may be read by another thread.
+ *
+ * Everything that we wrote before this (such as the contents of a newly
+ * built structure) is visible before the pointer is.
+ */
+extern inline void atomic_ptr_set(void **p, void *val)
+{
+	asm volatile ("movl %1, %0\n\t"
+			: "=m" (*p)
+			: "r" (val)
+			: "memory");
+}
@@ -50,6 +50,17 @@
 #define CR0_CD 0x40000000U		/* Cache disable */
 #define CR0_PG 0x80000000U		/* Paging - use PTEs/CR3 */
 
+/*
+ * Bits in CPU configuration register cr4
+ */
+#define CR4_OSFXSR 0x00000200U		/* OS supports fxsave - enable SSE */
+
+/*
+ * Feature bits returned in edx by cpuid function 1
+ */
+#define CPUID_FXSR 0x01000000U		/* fxsave/fxrstor supported */
+#define CPUID_SSE2 0x04000000U		/* SSE2 instructions supported */
+
 /*
  * Various descriptor sizes to bear in mind
  */
@@ -267,6 +278,49 @@ extern inline void set_cr3(u32_t addr)
 			: "r" (addr));
 }
 
+/*
+ * get_cr4()
+ *	Get the value of the processor config register cr4 - the extended
+ *	feature enables
+ */
+extern inline u32_t get_cr4(void)
+{
+	register u32_t res;
+	
+	asm volatile ("movl %%cr4,%0\n\t"
+			: "=r" (res)
+			: /* No input */);
+	return res;
+}
+
+/*
+ * set_cr4()
+ *	Set the value of the processor config register cr4 - the extended
+ *	feature enables
+ */
+extern inline void set_cr4(u32_t addr)
+{
+	asm volatile ("movl %0,%%cr4\n\t"
+			: /* No output */
+			: "r" (addr));
+}
+
+/*
+ * get_cpuid_features()
+ *	Get the feature flags (edx) returned by cpuid function 1.
+ *
+ * This needs a CPU that supports cpuid, so must only be used in 686 builds.
+ */
+extern inline u32_t get_cpuid_features(void)
+{
+	u32_t eax, ebx, ecx, edx;
+
+	asm volatile ("cpuid\n\t"
+			: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			: "0" (1));
+	return edx;
+}
+
 /*
  * get_stack_pointer()
  */
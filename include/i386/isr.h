@@ -33,6 +33,21 @@ extern inline void isr_enable(void)
 	asm volatile ("sti\n\t" ::);
 }
 
+/*
+ * isr_enable_halt()
+ *	Enable interrupts and halt the CPU until the next one arrives.
+ *
+ * The "sti" doesn't take effect until after the following instruction, so no
+ * interrupt can be taken between the two and lost before we halt.
+ */
+extern inline void isr_enable_halt(void)
+{
+	asm volatile ("sti\n\t"
+			"hlt\n\t"
+			: /* No output */
+			: /* No input */);
+}
+
 /*
  * isr_check_disabled()
  */
@@ -26,6 +26,42 @@
  */
 #define PSTR(s) (s)
 
+/*
+ * ROM_DATA
+ *	Attribute used to place constant tables within the ROM space.
+ *
+ * As with PSTR() there's nothing special to do here, and the accessors
+ * below are just normal reads.
+ */
+#define ROM_DATA
+
+/*
+ * rom_read8()
+ *	Read a byte from the ROM space.
+ */
+extern inline u8_t rom_read8(const void *addr)
+{
+	return *((const u8_t *)addr);
+}
+
+/*
+ * rom_read16()
+ *	Read a 16 bit value from the ROM space.
+ */
+extern inline u16_t rom_read16(const void *addr)
+{
+	return *((const u16_t *)addr);
+}
+
+/*
+ * rom_read32()
+ *	Read a 32 bit value from the ROM space.
+ */
+extern inline u32_t rom_read32(const void *addr)
+{
+	return *((const u32_t *)addr);
+}
+
 /*
  * memcpy()
  *	Copy a block of memory from one location to another.
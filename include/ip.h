@@ -27,8 +27,7 @@ struct ip_header {
 	u8_t ih_type_of_service;
 	u16_t ih_total_len;
 	u16_t ih_ident;
-	u16_t ih_flags : 3,
-		ih_fragment_offs : 13;
+	u16_t ih_frag;			/* Flags and fragment offset (see below) */
 	u8_t ih_time_to_live;
 	u8_t ih_protocol;
 	u16_t ih_header_csum;
@@ -36,6 +35,67 @@ struct ip_header {
 	u32_t ih_dest_addr;
 };
 
+/*
+ * Flags and fragment offset mask for ih_frag (in host byte order).
+ */
+#define IP_FRAG_DF 0x4000		/* Don't fragment */
+#define IP_FRAG_MF 0x2000		/* More fragments */
+#define IP_FRAG_OFFS 0x1fff		/* Fragment offset (in units of 8 bytes) */
+
+/*
+ * Limits on the reassembly of fragmented datagrams.  IP_REASS_MEMORY is a
+ * hard limit on the memory that an instance will tie up in fragments,
+ * IP_REASS_MAX on the number of datagrams that it will reassemble at once and
+ * IP_REASS_SOURCE_FRAGS on the number of fragments that it will hold from any
+ * one source address.
+ *
+ * Smaller systems don't reassemble datagrams at all (IP_REASS isn't defined)
+ * and drop any fragments that they receive.  Each fragment is held in the
+ * receive buffer that it arrived in, and as SLIP and PPP receive into MRU
+ * sized buffers, the fragments of even one full sized datagram would need
+ * more RAM than these systems have.
+ */
+#if defined(I386)
+#define IP_REASS
+#define IP_REASS_MEMORY (96 * 1024)
+#define IP_REASS_MAX 16
+#define IP_REASS_SOURCE_FRAGS 64
+#endif
+
+#define IP_REASS_TIMEOUT (30 * TICK_RATE)
+					/* Time allowed to receive all of a datagram's fragments */
+#define IP_REASS_INTERVAL TICK_RATE	/* Interval between checks for timed out datagrams */
+
+/*
+ * Size of the table of transport protocol clients.  On i386 every protocol
+ * number has an entry of its own.  Smaller systems can't spare the RAM for
+ * that so they index a smaller table with the low bits of the protocol
+ * number; only one of the protocols that share an entry can be attached.
+ */
+#if defined(I386)
+#define IP_PROTOCOL_TABLE_SIZE 256
+#else
+#define IP_PROTOCOL_TABLE_SIZE 8
+#endif
+
+#define IP_PROTOCOL_TABLE_MASK (IP_PROTOCOL_TABLE_SIZE - 1)
+
+/*
+ * Size of the table of ICMP clients.  This covers all of the message types
+ * that clients are allowed to hook (see icmp_client_attach()).
+ */
+#define ICMP_TYPE_TABLE_SIZE 0x12
+
+/*
+ * Echo requests that can't be answered in place need a copy of the packet.
+ * We don't make one unless at least this much heap is free.
+ */
+#if defined(I386)
+#define ICMP_ECHO_MIN_FREE 16384
+#else
+#define ICMP_ECHO_MIN_FREE 512
+#endif
+
 /*
  * ICMP header layout.
  *	well the first few bytes that are common to all ICMP messages anyway.
@@ -47,9 +107,10 @@ struct icmp_header {
 };
 
 /*
- * Forward declaration
+ * Forward declarations
  */
 struct ip_instance;
+struct oneshot;
 
 /*
  * IP server structure.
@@ -69,7 +130,6 @@ struct ip_client {
 	void *ic_instance;		/* The instance of our client */
 	u8_t ic_protocol;		/* Transport protocol implemented by the client */
 	struct ip_server *ic_server;	/* Reference to the server structure given to our client */
-	struct ip_client *ic_next;	/* Next client in the list */
 	void (*ic_recv)(void *clnt, struct netbuf *nb);
 					/* Callback to the client when data is received */
 	void (*ic_recv_icmp)(void *clnt, struct netbuf *nb);
@@ -90,15 +150,25 @@ struct icmp_server {
 struct icmp_client {
 	u8_t ic_type;			/* ICMP type handled by client */
 	struct icmp_server *ic_server;	/* Reference to the server structure given to our client */
-	struct icmp_client *ic_next;	/* Next client in the list of clients */
 	void (*ic_recv)(void *clnt, struct netbuf *);
 					/* Function callled when ICMP data is received */
 };
 
 /*
- * Number of ARP cache slots allocated per TCP instance.
+ * Datagram being reassembled from its fragments.
  */
-#define ARP_CACHE_SLOTS 8
+struct ip_reass {
+	struct ip_reass *ira_next;	/* Next datagram in the list (oldest first) */
+	u32_t ira_src_addr;		/* Source address (network byte order) */
+	u32_t ira_dest_addr;		/* Destination address (network byte order) */
+	u16_t ira_ident;		/* Identification (network byte order) */
+	u8_t ira_protocol;		/* Transport protocol */
+	u8_t ira_frags;			/* Number of fragments held */
+	u16_t ira_len;			/* Length of the data (0 until the last fragment arrives) */
+	u32_t ira_jiffies;		/* When we started reassembling the datagram */
+	addr_t ira_mem;			/* Memory held for the datagram */
+	struct netbuf *ira_list;	/* Fragments held, in order of their offsets */
+};
 
 /*
  * IP service instance.
@@ -108,8 +178,24 @@ struct ip_instance {
 	u32_t ii_addr;
 	u16_t ii_pkt_ident;
 	struct ip_datalink_server *ii_server;
-	struct ip_client *ii_client_list;
-	struct icmp_client *ii_icmp_client_list;
+	struct ip_datalink_instance *ii_idi;
+					/* Datalink instance that we're attached to */
+	struct ip_instance *ii_next;	/* Next instance in the list of all instances */
+	u8_t ii_forward;		/* Do we forward packets that aren't for us? */
+	u32_t ii_forwarded;		/* Number of packets received and forwarded */
+	u32_t ii_forward_drops;		/* Number of packets received that we couldn't forward */
+#if defined(IP_REASS)
+	struct ip_reass *ii_reass_list;	/* Datagrams being reassembled (oldest first) */
+	addr_t ii_reass_mem;		/* Memory held for datagrams being reassembled */
+	u8_t ii_reass_count;		/* Number of datagrams being reassembled */
+	u32_t ii_reass_drops;		/* Number of datagrams that we gave up reassembling */
+	struct oneshot *ii_reass_timer;	/* Timer that expires datagrams being reassembled */
+	u8_t ii_reass_timer_running;	/* Is the reassembly timer running? */
+#endif
+	struct ip_client *ii_protocol_table[IP_PROTOCOL_TABLE_SIZE];
+					/* Transport clients, indexed by protocol number */
+	struct icmp_client *ii_icmp_type_table[ICMP_TYPE_TABLE_SIZE];
+					/* ICMP clients, indexed by message type */
 	struct ip_server *(*ii_ip_client_attach)(struct ip_instance *ii, struct ip_client *ic);
 	void (*ii_ip_client_detach)(struct ip_instance *ii, struct ip_server *is);
 	struct icmp_server *(*ii_icmp_client_attach)(struct ip_instance *ii, struct icmp_client *ic);
@@ -121,12 +207,33 @@ struct ip_instance {
  */
 struct ip_datalink_instance;
 
+/*
+ * Destination cache entry.
+ *
+ * A sender that keeps talking to the same destination (such as a connected
+ * TCP socket) owns one of these and hangs it off each netbuf that it sends
+ * (nb_dst_cache).  The datalink layer records the result of its route and
+ * address lookups here and reuses them on later sends for as long as the
+ * destination is unchanged and neither the interface's generation count
+ * (idi_dst_gen) nor the routing table's (ip_route_gen) has moved on.  All
+ * fields are protected by the datalink instance's lock.
+ */
+struct ip_dst_cache {
+	struct ip_datalink_instance *dc_idi;
+					/* Interface that the entry was resolved on (NULL if none) */
+	u32_t dc_addr;			/* Destination IP address */
+	u32_t dc_gen;			/* Interface's idi_dst_gen when we resolved the entry */
+	u32_t dc_route_gen;		/* ip_route_gen when we resolved the entry */
+	u8_t dc_mac[6];			/* Next hop's hardware address */
+};
+
 /*
  * Function prototypes.
  */
 extern struct ip_client *ip_client_alloc(void);
 extern struct icmp_client *icmp_client_alloc(void);
 extern struct ip_instance *ip_instance_alloc(struct ip_datalink_instance *idi, u32_t addr);
+extern void ip_instance_set_forward(struct ip_instance *ii, u8_t forward);
 
 /*
  * ip_client_ref()
@@ -207,3 +314,11 @@ extern inline ref_t icmp_server_deref(struct icmp_server *is)
 {
 	return membuf_deref(is);
 }
+
+/*
+ * ip_dst_cache_init()
+ */
+extern inline void ip_dst_cache_init(struct ip_dst_cache *dc)
+{
+	dc->dc_idi = NULL;
+}
@@ -47,6 +47,7 @@ struct ip_datalink_instance {
 	struct lock idi_lock;
 	u16_t idi_mru;			/* Maximum receive unit size */
 	u16_t idi_mtu;			/* Maximum transmit unit size */
+	u32_t idi_dst_gen;		/* Bumped whenever cached destinations may be stale */
 	struct ip_datalink_client *idi_client;
 	struct ip_datalink_server *(*idi_client_attach)(struct ip_datalink_instance *idi, struct ip_datalink_client *idc);
 	void (*idi_client_detach)(struct ip_datalink_instance *idi, struct ip_datalink_server *ids);
@@ -0,0 +1,66 @@
+/*
+ * ip_route.h
+ *	IP routing table.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+
+/*
+ * Route details.
+ */
+struct ip_route {
+	u32_t ir_addr;			/* Network number (or host address for a host route) */
+	u8_t ir_prefix_len;		/* Number of significant bits in ir_addr */
+	u32_t ir_gateway;		/* Address of gateway to access this route (0 if none) */
+	struct ip_datalink_instance *ir_idi;
+					/* Interface that the route goes through */
+	struct ip_route *ir_next;	/* Next route waiting to be freed */
+};
+
+/*
+ * Routing table node.
+ *
+ * The routing table is a path-compressed binary trie keyed on the route's
+ * network number.  Each node tests the first irn_prefix_len bits of an
+ * address, and may hold the route for exactly that prefix.  Nodes only exist
+ * where they hold a route or where two branches of the trie separate.
+ */
+struct ip_route_node {
+	u32_t irn_addr;			/* Prefix bits (the rest are zero) */
+	u8_t irn_prefix_len;		/* Number of significant bits in irn_addr */
+	struct ip_route *irn_route;	/* Route for this prefix (NULL if none) */
+	struct ip_route_node *irn_child[2];
+					/* Subtries for the next bit being 0 or 1 */
+	struct ip_route_node *irn_next;	/* Next node waiting to be freed */
+};
+
+/*
+ * Advance declarations.
+ */
+struct ip_datalink_instance;
+
+/*
+ * Bumped whenever the routing table changes (see struct ip_dst_cache).
+ */
+extern u32_t ip_route_gen;
+
+/*
+ * Function prototypes.
+ */
+extern void ip_route_add(struct ip_datalink_instance *idi, u32_t addr, u8_t prefix_len, u32_t gateway);
+extern u8_t ip_route_delete(u32_t addr, u8_t prefix_len);
+extern void ip_route_delete_datalink(struct ip_datalink_instance *idi);
+extern u8_t ip_route_find(u32_t ip, struct ip_route *rt);
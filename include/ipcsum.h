@@ -18,10 +18,83 @@
  * "copying-liquorice.txt" for details.
  */
 
+/*
+ * Structure type referenced in parameter list.
+ */
+struct netbuf;
+
 /*
  * Function prototypes.
  */
 extern u16_t ipcsum_partial(u16_t partial_csum, void *buf, u16_t count);
+extern u16_t ipcsum_copy_partial(u16_t partial_csum, void *dest, void *src, u16_t count);
+extern u16_t ipcsum_netbuf_partial(u16_t partial_csum, struct netbuf *nb, void *buf, u16_t count);
 extern u16_t ipcsum(u16_t partial_csum, void *buf, u16_t count);
 extern u16_t ipcsum_pseudo_partial(u32_t src_addr, u32_t dest_addr, u8_t protocol, u16_t len);
 extern u16_t ipcsum_pseudo(u32_t src_addr, u32_t dest_addr, u8_t protocol, u16_t len);
+
+/*
+ * ipcsum_add()
+ *	Add a 16 bit value into a partial IP checksum.
+ *
+ * As with the partial checksums, the value must be in network byte order.
+ */
+extern inline u16_t ipcsum_add(u16_t partial_csum, u16_t val)
+{
+	u32_t sum;
+
+	sum = (u32_t)partial_csum + val;
+	return (u16_t)((sum & 0xffff) + (sum >> 16));
+}
+
+/*
+ * ipcsum_sub()
+ *	Take a 16 bit value out of a partial IP checksum.
+ *
+ * In one's complement arithmetic this is just adding the complement.  The
+ * answer may be 0xffff where summing the remaining data would have given
+ * 0x0000, but the two are equivalent.
+ */
+extern inline u16_t ipcsum_sub(u16_t partial_csum, u16_t val)
+{
+	return ipcsum_add(partial_csum, val ^ 0xffff);
+}
+
+/*
+ * ipcsum_swap()
+ *	Swap the bytes of a partial IP checksum.
+ *
+ * This converts the sum of a block of data into the sum that we would have
+ * had if the block had started one byte further along.
+ */
+extern inline u16_t ipcsum_swap(u16_t partial_csum)
+{
+	return (partial_csum << 8) | (partial_csum >> 8);
+}
+
+/*
+ * ipcsum_fold()
+ *	Fold a 32 bit running sum of 16 bit words into a partial IP checksum.
+ *
+ * Receivers that sum data as they read it can simply add words into a
+ * 32 bit variable, as long as no more than 64 kBytes is added, and then fold
+ * the result once at the end.
+ */
+extern inline u16_t ipcsum_fold(u32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (u16_t)((sum & 0xffff) + (sum >> 16));
+}
+
+/*
+ * ipcsum_u8()
+ *	Work out what a single byte adds to a running sum.
+ *
+ * "offs" is the byte's offset from the start of the block being summed.
+ * Both of our CPUs are little endian, so a byte at an even offset is the
+ * low half of its 16 bit word.
+ */
+extern inline u16_t ipcsum_u8(u8_t val, addr_t offs)
+{
+	return (offs & 0x01) ? ((u16_t)val << 8) : val;
+}
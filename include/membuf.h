@@ -18,19 +18,59 @@
  * "copying-liquorice.txt" for details.
  */
 
+/*
+ * Advance declarations.
+ */
+struct objcache;
+
 /*
  * Memory buffer layout.
  */
 struct membuf {
 	ref_t mb_refs;			/* Reference count */
 	void (*mb_free)(void *);	/* Function to free up the membuf's contents */
+	struct objcache *mb_cache;	/* Object cache that the membuf came from (NULL if the heap) */
 };
 
 /*
  * Prototypes.
  */
 extern void *membuf_alloc(addr_t size, void (*mfree)(void *));
-extern void membuf_ref(void *buf);
-extern ref_t membuf_deref(void *buf);
-extern ref_t membuf_get_refs(void *buf);
+extern struct objcache *membuf_cache_create(addr_t size, u16_t count);
+extern void *membuf_cache_alloc(struct objcache *oc, void (*mfree)(void *));
+extern void __membuf_free(void *buf);
 extern void membuf_init(void);
+
+/*
+ * membuf_ref()
+ *	Increase the reference count on a membuf.
+ */
+extern inline void membuf_ref(void *buf)
+{
+	atomic_ref_inc(&(((struct membuf *)buf) - 1)->mb_refs);
+}
+
+/*
+ * membuf_deref()
+ *	Decrease the reference count on a membuf.  If zeroed, then free it!
+ */
+extern inline ref_t membuf_deref(void *buf)
+{
+	ref_t res;
+	
+	res = atomic_ref_dec(&(((struct membuf *)buf) - 1)->mb_refs);
+	if (res == 0) {
+		__membuf_free(buf);
+	}
+
+	return res;
+}
+
+/*
+ * membuf_get_refs()
+ *	Get the reference count on a membuf.
+ */
+extern inline ref_t membuf_get_refs(void *buf)
+{
+	return (((struct membuf *)buf) - 1)->mb_refs;
+}
@@ -41,12 +41,54 @@ struct netbuf {
 	addr_t nb_application_size;
 	struct netbuf *nb_next;
 	void *nb_hint_membuf;
+	addr_t nb_headroom;		/* Bytes reserved in front of the application data (or inline data) */
+	void *nb_data_membuf;		/* Netbuf holding inline packet data - see netbuf_alloc_with_data() */
+	addr_t nb_data_size;		/* Size of our inline packet data (0 if none) */
+	void *nb_dst_cache;		/* Sender's destination cache entry - not referenced (see ip_datalink.h) */
+	void *nb_rx_csum_start;		/* Start of the received data summed into nb_rx_csum - NULL if none */
+	addr_t nb_rx_csum_size;		/* Number of bytes summed into nb_rx_csum */
+	u16_t nb_rx_csum;		/* Partial IP checksum of received data, summed as it was read in */
 };
 
+/*
+ * Headroom reserved by netbuf_alloc_headroom() callers on the transmit path.
+ * NETBUF_TX_HEADROOM_MIN is what the headers of a normal TCP segment need:
+ * an ethernet header, an IP header and a TCP header with the timestamps
+ * option.  Larger systems also leave room for all 40 bytes of TCP options,
+ * while on smaller ones the rarer headers that need more (SYNs and segments
+ * carrying SACK blocks) get a membuf of their own (see netbuf_push()).
+ */
+#define NETBUF_TX_HEADROOM_MIN (14 + 20 + 20 + 12)
+
+#if defined(I386)
+#define NETBUF_TX_HEADROOM 96
+#else
+#define NETBUF_TX_HEADROOM 68
+#endif
+
+#if (NETBUF_TX_HEADROOM < NETBUF_TX_HEADROOM_MIN)
+#error "NETBUF_TX_HEADROOM is too small for the headers of a TCP segment"
+#endif
+
+/*
+ * Number of netbufs held in the netbuf object cache.
+ */
+#if defined(I386)
+#define NETBUF_CACHE_SIZE 32
+#else
+#define NETBUF_CACHE_SIZE 8
+#endif
+
 /*
  * Prototypes.
  */
 extern struct netbuf *netbuf_alloc(void);
+extern struct netbuf *netbuf_alloc_headroom(addr_t headroom, addr_t size);
+extern struct netbuf *netbuf_alloc_with_data(addr_t size);
+extern void *netbuf_push_transport(struct netbuf *nb, addr_t size);
+extern void *netbuf_push_network(struct netbuf *nb, addr_t size);
+extern void *netbuf_push_datalink(struct netbuf *nb, addr_t size);
+extern void netbuf_reclaim_headroom(struct netbuf *nb);
 extern struct netbuf *netbuf_clone(struct netbuf *orig);
 extern void netbuf_init(void);
 
@@ -68,6 +110,22 @@ extern inline ref_t netbuf_deref(struct netbuf *nb)
 	return membuf_deref(nb);
 }
 
+/*
+ * netbuf_set_rx_csum()
+ *	Record the partial IP checksum of a received packet.
+ *
+ * Receivers that sum the packet as they read it in call this so that the
+ * transport layers don't have to read it all again (see
+ * ipcsum_netbuf_partial()).  Anything that changes the packet data
+ * afterwards must set nb_rx_csum_start back to NULL.
+ */
+extern inline void netbuf_set_rx_csum(struct netbuf *nb, void *start, addr_t size, u16_t csum)
+{
+	nb->nb_rx_csum_start = start;
+	nb->nb_rx_csum_size = size;
+	nb->nb_rx_csum = csum;
+}
+
 /*
  * netbuf_get_refs()
  *	Get the number of references to a netbuf.
@@ -0,0 +1,43 @@
+/*
+ * objcache.h
+ *	Fixed-size object cache support.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+
+/*
+ * Object cache structure.
+ */
+struct objcache {
+	addr_t oc_size;			/* Size of each object */
+	u16_t oc_count;			/* Number of objects in the cache's slab */
+	u16_t oc_in_use;		/* Number of slab objects currently allocated */
+	u16_t oc_high_water;		/* Largest number of slab objects ever allocated */
+	u16_t oc_overflows;		/* Number of allocations passed on to the heap */
+	void *oc_free;			/* List of free objects within the slab */
+	void *oc_slab;			/* Base address of the slab */
+	void *oc_slab_end;		/* Address just beyond the end of the slab */
+	struct lock oc_lock;
+	struct objcache *oc_next;	/* Next cache in the list of all caches */
+};
+
+/*
+ * Function prototypes.
+ */
+extern struct objcache *objcache_create(addr_t size, u16_t count);
+extern void *objcache_alloc(struct objcache *oc);
+extern void objcache_free(struct objcache *oc, void *obj);
+extern int objcache_dump_stats(struct objcache *obuf, int max);
@@ -24,10 +24,36 @@ struct oneshot {
 	u32_t os_ticks_left;		/* Number of ticks before the timer triggers */
 	void (*os_callback)(void *);	/* Callback function */
 	void *os_arg;			/* Callback function argument */
-	struct oneshot *os_next;	/* Next timer in the list */
+	struct oneshot *os_next;	/* Next timer in the wheel slot */
+	struct oneshot **os_pprev;	/* Link that points at us (NULL if not attached) */
+	u32_t os_expires;		/* Wheel tick at which the timer triggers */
 	struct oneshot *os_call_queue;	/* Next timer on the callback queue */
 };
 
+/*
+ * Timing wheel geometry.  Each level has (1 << ONESHOT_WHEEL_BITS) slots and
+ * each slot of a level spans all of the slots of the level below it.
+ */
+#if defined(I386)
+#define ONESHOT_WHEEL_BITS 6
+#define ONESHOT_WHEEL_LEVELS 4
+#else
+#define ONESHOT_WHEEL_BITS 4
+#define ONESHOT_WHEEL_LEVELS 4
+#endif
+
+#define ONESHOT_WHEEL_SLOTS (1 << ONESHOT_WHEEL_BITS)
+#define ONESHOT_WHEEL_MASK (ONESHOT_WHEEL_SLOTS - 1)
+
+/*
+ * Number of timers held in the oneshot object cache.
+ */
+#if defined(I386)
+#define ONESHOT_CACHE_SIZE 32
+#else
+#define ONESHOT_CACHE_SIZE 8
+#endif
+
 /*
  * Function declarations
  */
@@ -35,6 +61,7 @@ extern void oneshot_tick(u16_t ticks);
 extern struct oneshot *oneshot_alloc(void);
 extern void oneshot_attach(struct oneshot *timer);
 extern void oneshot_detach(struct oneshot *timer);
+extern u16_t isr_oneshot_get_idle_ticks(u16_t max);
 extern int oneshot_dump_stats(struct oneshot *obuf, int max);
 extern void oneshot_init(void);
 
@@ -57,8 +57,10 @@ struct ppp_ahdlc_instance {
 	u8_t pai_recv_esc;
 	u16_t pai_recv_octets;
 	u8_t pai_recv_ignore;
+	struct netbuf *pai_recv_netbuf;
 	u8_t *pai_recv_packet;
 	u16_t pai_recv_crc;
+	u32_t pai_recv_csum;		/* Running IP checksum sum of the frame being received */
 	u32_t pai_accm;
 	struct context *pai_send_ctx;
 	struct netbuf *pai_send_queue;
@@ -31,7 +31,9 @@ struct slip_instance {
 	u8_t si_recv_esc;
 	u16_t si_recv_octets;
 	u8_t si_recv_ignore;
+	struct netbuf *si_recv_netbuf;
 	u8_t *si_recv_packet;
+	u32_t si_recv_csum;		/* Running IP checksum sum of the packet being received */
 	struct context *si_send_ctx;
 	struct netbuf *si_send_queue;
 };
@@ -59,6 +59,74 @@ struct tcp_header {
 #define TCS_LAST_ACK 9
 #define TCS_TIME_WAIT 10
 
+/*
+ * Sequence number comparisons.  These allow for the sequence space wrapping
+ * around.
+ */
+#define SEQ_LT(a, b) ((s32_t)((a) - (b)) < 0)
+#define SEQ_LE(a, b) ((s32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((s32_t)((a) - (b)) > 0)
+#define SEQ_GE(a, b) ((s32_t)((a) - (b)) >= 0)
+
+/*
+ * Receive buffer sizing.  TCP_RCV_BUF_SIZE is the budget from which our
+ * advertised window is taken.  Up to TCP_RCV_OOO_SEGS segments that arrive
+ * out of order are held for reassembly, and up to TCP_RCV_HELD_SLOTS
+ * segments that our client keeps hold of are charged against the budget (we
+ * accept no more data while our client holds that many).
+ */
+#if defined(I386)
+#define TCP_RCV_BUF_SIZE 8192
+#define TCP_RCV_OOO_SEGS 8
+#define TCP_RCV_HELD_SLOTS 4
+#else
+#define TCP_RCV_BUF_SIZE 1024
+#define TCP_RCV_OOO_SEGS 2
+#define TCP_RCV_HELD_SLOTS 1
+#endif
+
+/*
+ * SACK sizing.  TCP_SACK_BLOCKS is the most SACK blocks that we'll take from
+ * a segment that we receive, and TCP_SACK_SCOREBOARD is the number of SACK'd
+ * ranges that we remember for each socket when deciding what to retransmit.
+ */
+#define TCP_SACK_BLOCKS 4
+#if defined(I386)
+#define TCP_SACK_SCOREBOARD 4
+#else
+#define TCP_SACK_SCOREBOARD 1
+#endif
+
+/*
+ * A range of sequence space reported by a SACK option (RFC2018).  The right
+ * edge is the sequence number that follows the last byte in the range.
+ */
+struct tcp_sack_block {
+	u32_t tsb_left;
+	u32_t tsb_right;
+};
+
+/*
+ * TCP congestion control operations.
+ *
+ * A congestion control module looks after a socket's congestion window
+ * (ts_cwnd) and slow start threshold (ts_ssthresh) in response to the events
+ * reported here.  Where an operation returns non-zero the TCP retransmits the
+ * oldest unacknowledged segment straight away.
+ */
+struct tcp_socket;
+
+struct tcp_cong_ops {
+	void (*tco_init)(struct tcp_socket *ts);
+					/* Called when a connection is established */
+	u8_t (*tco_ack)(struct tcp_socket *ts, u32_t acked);
+					/* Called when new data has been ACK'd */
+	u8_t (*tco_dup_ack)(struct tcp_socket *ts);
+					/* Called for each duplicate ACK */
+	void (*tco_timeout)(struct tcp_socket *ts);
+					/* Called when the retransmit timer expires */
+};
+
 /*
  * TCP socket structure.
  *
@@ -70,24 +138,59 @@ struct tcp_socket {
 	u16_t ts_local_port;		/* Local port number */
 	u16_t ts_remote_port;		/* Remote port number */
 	u32_t ts_remote_addr;		/* Remote IP address */
+	struct ip_dst_cache ts_dst;	/* Route and next hop to the remote address */
+	struct tcp_header ts_hdr_tmpl;	/* Header template holding the fixed fields of our segments */
+	u16_t ts_pseudo_csum;		/* Partial checksum of our pseudo header (without its length) */
 	u32_t ts_snd_nxt;		/* SND-NXT from RFC793 */
 	u32_t ts_snd_una;		/* SND-UNA from RFC793 */
 	u32_t ts_rcv_nxt;		/* RCV-NXT from RFC793 */
+	u32_t ts_rcv_adv;		/* Right edge of the last window we advertised */
+	struct netbuf *ts_rcv_ooo;	/* Out-of-order segments, in sequence order */
+	u16_t ts_rcv_ooo_size;		/* Bytes held in out-of-order segments */
+	u8_t ts_rcv_ooo_segs;		/* Number of out-of-order segments */
+	struct netbuf *ts_rcv_held[TCP_RCV_HELD_SLOTS];
+					/* Received segments still held by our client */
+	u32_t ts_rcv_sack_last;		/* Start of the most recently queued out-of-order segment */
 	u32_t ts_remote_mss;		/* MSS for remote socket */
-	u32_t ts_send_jiffies;		/* Jiffy count at which we sent the last segment */
+	u32_t ts_snd_wnd;		/* SND-WND from RFC793 (the peer's advertised window) */
+	u8_t ts_opt_flags;		/* Options in use on the connection - see below */
+	u8_t ts_snd_wscale;		/* Shift applied to the peer's advertised windows */
+	u8_t ts_rcv_wscale;		/* Shift applied to the windows that we advertise */
+	u32_t ts_ts_recent;		/* TS.Recent from RFC7323 (the timestamp we echo) */
+	u32_t ts_seg_tsecr;		/* Timestamp echoed by the segment being processed */
+	u8_t ts_seg_sacks;		/* Number of SACK blocks in the segment being processed */
+	struct tcp_sack_block ts_seg_sack[TCP_SACK_BLOCKS];
+					/* SACK blocks in the segment being processed */
+	u8_t ts_sacks;			/* Number of ranges on the SACK scoreboard */
+	struct tcp_sack_block ts_sack[TCP_SACK_SCOREBOARD];
+					/* Ranges beyond SND-UNA that our peer has SACK'd */
+	u32_t ts_rexmit_nxt;		/* End of the last segment retransmitted during recovery */
+	u32_t ts_send_jiffies;		/* Jiffy count at which we sent the timed segment */
+	u32_t ts_rtt_seq;		/* Sequence number that ends the timed segment */
 	struct netbuf *ts_awaiting_send;
+					/* Segments waiting for space in the send window */
 	struct netbuf *ts_awaiting_ack;
+					/* Retransmission queue of unacknowledged segments */
 	struct oneshot *ts_wait_timer;  /* Timer used for handling misc waits */
 	u16_t ts_retransmits;
 	struct netbuf *ts_deferred_ack;
 	struct oneshot *ts_deferred_ack_timer;
 					/* Timer used for handling deferred ACKs */
 	u8_t ts_send_flags;		/* Flags used during transmissions - see below */
+	struct tcp_cong_ops *ts_cong;	/* Congestion control module */
+	u32_t ts_cwnd;			/* Congestion window */
+	u32_t ts_ssthresh;		/* Slow start threshold */
+	u32_t ts_recover;		/* Highest sequence sent when loss recovery started */
+	u8_t ts_dup_acks;		/* Number of consecutive duplicate ACKs */
+	u16_t ts_fast_retransmits;	/* Statistics: segments sent by fast retransmit */
+	u16_t ts_timeouts;		/* Statistics: retransmit timer expiries */
 	u32_t ts_rto_next;		/* Next round-trip timeout */
 	u32_t ts_srtt_avg;		/* Scaled round-trip timer average */
 	u32_t ts_srtt_var;		/* Scaled round-trip timer variance */
 	struct tcp_socket *ts_awaiting_accept;
 	struct tcp_socket *ts_next;
+	struct tcp_socket *ts_hash_next;
+					/* Next socket in the same demultiplexing hash bucket */
 	struct condvar ts_wait_cv;
 	struct tcp_server *ts_server;
 	struct tcp_client *ts_client;
@@ -101,6 +204,38 @@ struct tcp_socket {
 #define TCP_SND_RETRANS_TIMING 0x02
 #define TCP_SND_ACKED 0x04
 #define TCP_SND_DEFERRED_ACK 0x08
+#define TCP_SND_RECOVERY 0x10
+
+/*
+ * TCP option flags.  These show which of the options from RFC7323 and RFC2018
+ * both ends agreed to use when the connection was opened.
+ */
+#define TCP_OPT_WSCALE 0x01
+#define TCP_OPT_SACK 0x02
+#define TCP_OPT_TSTAMP 0x04
+#define TCP_OPT_ALL 0x07
+
+/*
+ * Number of sockets held in the TCP socket object cache.
+ */
+#if defined(I386)
+#define TCP_SOCKET_CACHE_SIZE 16
+#else
+#define TCP_SOCKET_CACHE_SIZE 4
+#endif
+
+/*
+ * Sizes of the socket demultiplexing hash tables (each must be a power of 2).
+ * Connected sockets are hashed on their remote address and port and local
+ * port, while listening sockets are hashed on their local port.
+ */
+#if defined(I386)
+#define TCP_CONN_HASH_SIZE 64
+#define TCP_LISTEN_HASH_SIZE 16
+#else
+#define TCP_CONN_HASH_SIZE 4
+#define TCP_LISTEN_HASH_SIZE 2
+#endif
 
 /*
  * TCP server structure.
@@ -141,16 +276,28 @@ struct tcp_instance {
 	struct lock ti_lock;
 	struct tcp_client *ti_client_list;
 	struct tcp_socket *ti_socks;
+	struct tcp_socket *ti_conn_hash[TCP_CONN_HASH_SIZE];
+	struct tcp_socket *ti_listen_hash[TCP_LISTEN_HASH_SIZE];
 	u16_t ti_last_local_port;
 	struct ip_server *ti_server;
+	struct tcp_cong_ops *ti_cong;	/* Congestion control module for new sockets */
+	u32_t ti_segs_in;		/* Statistics: segments received for our sockets */
+	u32_t ti_pred_acks;		/* Statistics: segments handled as predicted ACKs */
+	u32_t ti_pred_data;		/* Statistics: segments handled as predicted data */
 	struct tcp_server *(*ti_client_attach)(struct tcp_instance *ti, struct tcp_client *tc);
 	void (*ti_client_detach)(struct tcp_instance *ti, struct tcp_server *ts);
 };
 
+/*
+ * Congestion control modules.
+ */
+extern struct tcp_cong_ops tcp_cong_newreno;
+
 /*
  * Function prototypes.
  */
 extern int tcp_dump_stats(struct tcp_instance *ti, struct tcp_socket *sbuf, int max);
+extern void tcp_dump_pred_stats(struct tcp_instance *ti, u32_t *buf);
 extern struct tcp_client *tcp_client_alloc(void);
 extern struct tcp_instance *tcp_instance_alloc(struct ip_instance *ii);
 
@@ -39,6 +39,7 @@ extern void thread_wait(struct lock *l);
 extern void thread_interrupt(struct thread *t);
 extern int thread_dump_stats(struct thread *tbuf, int max);
 extern void thread_init(void *idle, addr_t idle_size) __attribute__ ((noreturn));
+extern void thread_idle_wait(void);
 
 /*
  * isr_thread_get_run_queue_len()
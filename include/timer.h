@@ -32,4 +32,6 @@
  */
 extern void timer_init(void);
 extern u32_t timer_get_jiffies(void);
+extern u32_t timer_get_wall_seconds(void);
 extern void timer_dump_stats(u32_t *ldavgs, int max);
+extern void isr_timer_wakeup(void);
@@ -34,6 +34,7 @@ struct udp_header {
 struct udp_server {
 	void *us_instance;		/* The instance of this service */
 	u16_t us_port;
+	struct ip_dst_cache us_dst;	/* Route and next hop for the last destination we sent to */
 	void (*us_send)(void *srv, u32_t dest_addr, u16_t dest_port, struct netbuf *nb);
 					/* The callback function for when we send packet data */
 };
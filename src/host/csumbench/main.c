@@ -0,0 +1,245 @@
+/*
+ * main.c
+ *	Host-side check and benchmark of the i386 IP checksum kernels.
+ *
+ * We build the library's i386 checksum code straight into this program and
+ * compare it against the original 16 bit "lodsw" implementation, first for
+ * correctness and then for speed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../lib/ipcsum/i386/ipcsum.c"
+
+/*
+ * Size of the test buffer.  This allows for the largest block plus a
+ * misaligned start.
+ */
+#define BUF_SIZE (65536 + 16)
+
+/*
+ * Number of timed runs per measurement.  We keep the fastest.
+ */
+#define RUNS 64
+
+static u8_t buf[BUF_SIZE] __attribute__ ((aligned (16)));
+static fast_u8_t sse2_state;
+
+/*
+ * Block sizes to time.
+ */
+static u16_t sizes[] = {20, 40, 64, 128, 256, 512, 576, 1024, 1460, 1500, 4096, 16384, 65534};
+
+/*
+ * ref_ipcsum_partial()
+ *	The original i386 implementation, kept as a reference.
+ */
+static u16_t ref_ipcsum_partial(u16_t partial_csum, void *buf, u16_t count)
+{
+	u32_t words;
+	void *d1;
+	u32_t d2;
+
+	words = count >> 1;
+	d1 = buf;
+
+	if (words != 0) {
+		asm volatile ("\n"
+				"L_redo%=:\n\t"
+				"lodsw\n\t"
+				"addw %%ax, %0\n\t"
+				"adcw $0, %0\n\t"
+				"loop L_redo%=\n\t"
+				"\n\t"
+				: "=g" (partial_csum), "=S" (d1), "=c" (d2)
+				: "0" (partial_csum), "1" (d1), "2" (words)
+				: "ax");
+	}
+
+	if (count & 0x01) {
+		asm volatile ("movb (%%esi), %%al\n\t"
+				"xorb %%ah, %%ah\n\t"
+				"addw %%ax, %0\n\t"
+				"adcw $0, %0\n\t"
+				: "=g" (partial_csum), "=S" (d1)
+				: "0" (partial_csum), "1" (d1)
+				: "ax");
+	}
+
+	return partial_csum;
+}
+
+/*
+ * rdtsc()
+ *	Read the CPU's timestamp counter.
+ */
+static u64_t rdtsc(void)
+{
+	u64_t t;
+
+	asm volatile ("rdtsc\n\t"
+			: "=A" (t));
+	return t;
+}
+
+/*
+ * fill()
+ *	Fill the test buffer with pseudo-random data.
+ *
+ * "bias" lets us push the data towards all-zero or all-ones, where the
+ * differences between 0x0000 and 0xffff results would show up.
+ */
+static void fill(int bias)
+{
+	int i;
+
+	for (i = 0; i < BUF_SIZE; i++) {
+		switch (bias) {
+		case 1:
+			buf[i] = 0;
+			break;
+
+		case 2:
+			buf[i] = 0xff;
+			break;
+
+		default:
+			buf[i] = (u8_t)rand();
+		}
+	}
+}
+
+/*
+ * check_one()
+ *	Compare one checksum against the reference.
+ */
+static int check_one(u16_t partial, int offs, int len)
+{
+	u16_t ref, res;
+
+	ref = ref_ipcsum_partial(partial, buf + offs, len);
+	res = ipcsum_partial(partial, buf + offs, len);
+	if (ref == res) {
+		return 0;
+	}
+
+	fprintf(stderr, "mismatch: sse2 %d offs %d len %d partial %04x: %04x != %04x\n",
+			ipcsum_sse2_state, offs, len, partial, res, ref);
+	return 1;
+}
+
+/*
+ * check()
+ *	Compare the checksum functions against the reference.
+ *
+ * We try every start alignment with all the short lengths and the very
+ * longest ones, for random, all-zero and all-ones data.
+ */
+static int check(void)
+{
+	int bias, offs, len, sse2, errors;
+	u16_t partial;
+
+	errors = 0;
+	for (bias = 0; bias < 3; bias++) {
+		fill(bias);
+		for (sse2 = 0; sse2 < 2; sse2++) {
+			for (offs = 0; offs < 16; offs++) {
+				ipcsum_sse2_state = sse2 ? IPCSUM_SSE2_UNKNOWN : IPCSUM_SSE2_ABSENT;
+				for (len = 0; len < 2100; len++) {
+					partial = (len % 7 == 3) ? 0xffff : (len & 1) ? (u16_t)rand() : 0;
+					errors += check_one(partial, offs, len);
+				}
+
+				for (len = 65535 - 31; len <= 65535; len++) {
+					errors += check_one((u16_t)rand(), offs, len);
+				}
+			}
+		}
+	}
+
+	return errors;
+}
+
+/*
+ * time_csum()
+ *	Work out the best number of cycles per byte for a checksum function.
+ */
+static double time_csum(u16_t (*fn)(u16_t, void *, u16_t), u16_t size, int offs)
+{
+	u64_t t, best;
+	volatile u16_t res;
+	int i;
+
+	best = ~0ULL;
+	for (i = 0; i < RUNS; i++) {
+		t = rdtsc();
+		res = fn(0, buf + offs, size);
+		t = rdtsc() - t;
+		if (t < best) {
+			best = t;
+		}
+	}
+
+	(void)res;
+	return (double)best / size;
+}
+
+/*
+ * ipcsum_partial_32()
+ *	Run the library function with the SSE2 kernel disabled.
+ */
+static u16_t ipcsum_partial_32(u16_t partial_csum, void *buf, u16_t count)
+{
+	ipcsum_sse2_state = IPCSUM_SSE2_ABSENT;
+	return ipcsum_partial(partial_csum, buf, count);
+}
+
+/*
+ * ipcsum_partial_best()
+ *	Run the library function with the SSE2 kernel enabled if the CPU has it.
+ *
+ * We don't want to time "cpuid" on every call, so we reuse the result that
+ * was found in main().
+ */
+static u16_t ipcsum_partial_best(u16_t partial_csum, void *buf, u16_t count)
+{
+	ipcsum_sse2_state = sse2_state;
+	return ipcsum_partial(partial_csum, buf, count);
+}
+
+/*
+ * main()
+ *	Entry point.
+ */
+int main(int argc, char **argv)
+{
+	int i, offs, errors;
+
+	printf("Liquorice IP checksum benchmark\n");
+
+	errors = check();
+	if (errors) {
+		printf("FAILED: %d mismatches against the reference\n", errors);
+		return 1;
+	}
+	printf("All results match the reference implementation\n");
+
+	ipcsum_sse2_state = IPCSUM_SSE2_UNKNOWN;
+	printf("SSE2 kernel: %s\n\n", ipcsum_sse2_usable() ? "available" : "not available");
+	sse2_state = ipcsum_sse2_state;
+
+	fill(0);
+	printf("cycles per byte (best of %d runs)\n", RUNS);
+	printf("%6s %5s %10s %10s %10s\n", "size", "offs", "lodsw", "32 bit", "best");
+	for (i = 0; i < sizeof(sizes) / sizeof(u16_t); i++) {
+		for (offs = 0; offs < 2; offs++) {
+			printf("%6d %5d %10.3f %10.3f %10.3f\n", sizes[i], offs,
+					time_csum(ref_ipcsum_partial, sizes[i], offs),
+					time_csum(ipcsum_partial_32, sizes[i], offs),
+					time_csum(ipcsum_partial_best, sizes[i], offs));
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * main.c
+ *	Entry point to the test.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * usage()
+ *	Tell our user how to invoke this client.
+ */
+void usage(char *progname)
+{
+	fprintf(stderr, "Usage: %s [-h hostname] [-p port] [-n slots]\n", progname);
+	exit(1);
+}
+
+/*
+ * get_info()
+ *	Get the kernel's view of our connection.
+ */
+void get_info(int s, struct tcp_info *ti)
+{
+	socklen_t len;
+
+	len = sizeof(struct tcp_info);
+	if (getsockopt(s, IPPROTO_TCP, TCP_INFO, ti, &len) < 0) {
+		perror("get_info(): getsockopt");
+		exit(1);
+	}
+}
+
+/*
+ * send_byte()
+ *	Send a single byte segment and give the target time to ACK it.
+ */
+void send_byte(int s, char c)
+{
+	if (send(s, &c, 1, 0) != 1) {
+		perror("send_byte(): send");
+		exit(1);
+	}
+
+	usleep(300000);
+}
+
+/*
+ * main()
+ *	Entry point.
+ */
+int main(int argc, char **argv)
+{
+	char c;
+	int s, i, one;
+	struct sockaddr_in sa;
+	struct hostent *hp;
+	struct tcp_info ti;
+	char *progname;
+	char hostname[128];
+	int port, slots;
+	unsigned int wnd, last_wnd;
+	char *tmp;
+
+	printf("Liquorice TCP held segment test 20261017a\n");
+
+	progname = argv[0];
+	strcpy(hostname, "127.0.0.1");
+	port = 1238;
+	slots = 4;
+
+	/*
+	 * What options have been passed to us on the command line?
+	 */
+	while ((c = getopt(argc, argv, "h:p:n:")) != EOF) {
+		switch (c) {
+			case 'h':
+				strncpy(hostname, optarg, sizeof(hostname));
+				break;
+
+			case 'p':
+				port = (int)strtol(optarg, &tmp, 0);
+				break;
+
+			case 'n':
+				slots = (int)strtol(optarg, &tmp, 0);
+				break;
+
+			default:
+				usage(progname);
+		}
+	}
+
+	/*
+	 * Determine the host and port that we're going to talk to.
+	 */
+	hp = gethostbyname(hostname);
+	if (hp == NULL) {
+		fprintf(stderr, "main(): unable to get host entry\n");
+		exit(1);
+	}
+
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	memcpy(&sa.sin_addr, hp->h_addr, hp->h_length);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) {
+		perror("main(): unable to create socket");
+		exit(1);
+	}
+
+	/*
+	 * Each byte that we send must go in a segment of its own.
+	 */
+	one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	printf("Connecting to '%s', port %d\n", hostname, port);
+
+	if (connect(s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0) {
+		perror("main(): connect");
+		exit(1);
+	}
+
+	get_info(s, &ti);
+	last_wnd = ti.tcpi_snd_wnd;
+	printf("Initial window: %u\n", last_wnd);
+
+	/*
+	 * The target holds each of these, and each must be ACK'd with the
+	 * window closing up behind it.
+	 */
+	for (i = 0; i < slots; i++) {
+		send_byte(s, 'a' + i);
+		get_info(s, &ti);
+		wnd = ti.tcpi_snd_wnd;
+		printf("Segment %d held: unacked %u, window %u\n", i + 1, ti.tcpi_unacked, wnd);
+		if (ti.tcpi_unacked) {
+			printf("FAIL: segment %d not accepted\n", i + 1);
+			exit(1);
+		}
+		if (wnd >= last_wnd) {
+			printf("FAIL: window didn't close for held segment %d\n", i + 1);
+			exit(1);
+		}
+		last_wnd = wnd;
+	}
+
+	/*
+	 * Every slot is in use now, so the target can't account for any more
+	 * data that it holds.  It must not accept any, nor open its window.
+	 */
+	send_byte(s, 'z');
+	get_info(s, &ti);
+	wnd = ti.tcpi_snd_wnd;
+	printf("Segment with all slots held: unacked %u, window %u\n", ti.tcpi_unacked, wnd);
+	if (!ti.tcpi_unacked) {
+		printf("FAIL: segment accepted with every slot held\n");
+		exit(1);
+	}
+	if (wnd > last_wnd) {
+		printf("FAIL: window opened with every slot held\n");
+		exit(1);
+	}
+
+	/*
+	 * Once the target lets go of the segments, our retransmission must
+	 * get through.
+	 */
+	for (i = 0; i < 30; i++) {
+		sleep(1);
+		get_info(s, &ti);
+		if (!ti.tcpi_unacked) {
+			break;
+		}
+	}
+
+	if (ti.tcpi_unacked) {
+		printf("FAIL: segment not accepted after the target released its segments\n");
+		exit(1);
+	}
+
+	printf("Accepted after release: window %u\n", ti.tcpi_snd_wnd);
+	printf("PASS\n");
+
+	close(s);
+
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * main.c
+ *	Entry point to the test.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Size of the ICMP message that we send - an 8 byte ICMP header, the quoted
+ * 20 byte IP header and the first 8 bytes of the quoted TCP header.
+ */
+#define ICMP_MSG_SIZE (8 + 20 + 8)
+
+/*
+ * usage()
+ *	Tell our user how to invoke this client.
+ */
+void usage(char *progname)
+{
+	fprintf(stderr, "Usage: %s [-h hostname] [-p port]\n", progname);
+	exit(1);
+}
+
+/*
+ * csum()
+ *	Calculate an IP checksum.
+ */
+unsigned short csum(unsigned char *buf, int len)
+{
+	unsigned long sum = 0;
+
+	while (len > 1) {
+		sum += (buf[0] << 8) | buf[1];
+		buf += 2;
+		len -= 2;
+	}
+
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return ~sum & 0xffff;
+}
+
+/*
+ * send_unreachable()
+ *	Send a "port unreachable" to the target quoting a segment that it sent.
+ *
+ * The quoted segment is from the target's address and port to our local
+ * address and the given port.
+ */
+void send_unreachable(int r, struct sockaddr_in *target, struct sockaddr_in *local, int lport)
+{
+	unsigned char msg[ICMP_MSG_SIZE];
+	unsigned char *iph = msg + 8;
+	unsigned char *tch = msg + 28;
+	unsigned short cs;
+
+	memset(msg, 0, sizeof(msg));
+
+	msg[0] = 0x03;				/* Destination unreachable */
+	msg[1] = 0x03;				/* Port unreachable */
+
+	iph[0] = 0x45;
+	iph[3] = 40;				/* Total length */
+	iph[8] = 64;				/* TTL */
+	iph[9] = 6;				/* TCP */
+	memcpy(iph + 12, &target->sin_addr, 4);
+	memcpy(iph + 16, &local->sin_addr, 4);
+	cs = csum(iph, 20);
+	iph[10] = cs >> 8;
+	iph[11] = cs & 0xff;
+
+	memcpy(tch, &target->sin_port, 2);
+	tch[2] = (lport >> 8) & 0xff;
+	tch[3] = lport & 0xff;
+
+	cs = csum(msg, sizeof(msg));
+	msg[2] = cs >> 8;
+	msg[3] = cs & 0xff;
+
+	if (sendto(r, msg, sizeof(msg), 0, (struct sockaddr *)target, sizeof(struct sockaddr_in)) < 0) {
+		perror("send_unreachable(): sendto");
+		exit(1);
+	}
+}
+
+/*
+ * check_open()
+ *	Wait a while to see if the target resets our connection.
+ *
+ * Returns 1 if the connection is still open or 0 if it was reset.
+ */
+int check_open(int s, int secs)
+{
+	struct timeval tv;
+	char c;
+	int res;
+
+	tv.tv_sec = secs;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	res = recv(s, &c, 1, 0);
+	if (res < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			return 1;
+		}
+		if (errno != ECONNRESET) {
+			perror("check_open(): recv");
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * main()
+ *	Entry point.
+ */
+int main(int argc, char **argv)
+{
+	char c;
+	int s, r;
+	struct sockaddr_in sa, la;
+	socklen_t len;
+	struct hostent *hp;
+	char *progname;
+	char hostname[128];
+	int port, lport;
+	char *tmp;
+
+	printf("Liquorice ICMP test 20261017a\n");
+
+	progname = argv[0];
+	strcpy(hostname, "127.0.0.1");
+	port = 80;
+
+	/*
+	 * What options have been passed to us on the command line?
+	 */
+	while ((c = getopt(argc, argv, "h:p:")) != EOF) {
+		switch (c) {
+			case 'h':
+				strncpy(hostname, optarg, sizeof(hostname));
+				break;
+
+			case 'p':
+				port = (int)strtol(optarg, &tmp, 0);
+				break;
+
+			default:
+				usage(progname);
+		}
+	}
+
+	/*
+	 * We need a raw socket to send our ICMP messages.
+	 */
+	r = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+	if (r < 0) {
+		perror("main(): unable to create raw socket (are you root?)");
+		exit(1);
+	}
+
+	/*
+	 * Determine the host and port that we're going to talk to.
+	 */
+	hp = gethostbyname(hostname);
+	if (hp == NULL) {
+		fprintf(stderr, "main(): unable to get host entry\n");
+		exit(1);
+	}
+
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	memcpy(&sa.sin_addr, hp->h_addr, hp->h_length);
+
+	/*
+	 * Open a connection and find out which of our ports it uses.
+	 */
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0) {
+		perror("main(): unable to create socket");
+		exit(1);
+	}
+
+	printf("Connecting to '%s', port %d\n", hostname, port);
+
+	if (connect(s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0) {
+		perror("main(): connect");
+		exit(1);
+	}
+
+	len = sizeof(struct sockaddr_in);
+	getsockname(s, (struct sockaddr *)&la, &len);
+	lport = ntohs(la.sin_port);
+
+	/*
+	 * An unreachable that quotes a segment for some other connection
+	 * must leave ours alone.
+	 */
+	printf("Sending port unreachable for port %d\n", lport + 1);
+	send_unreachable(r, &sa, &la, lport + 1);
+	if (!check_open(s, 2)) {
+		printf("FAIL: connection reset by an unrelated unreachable\n");
+		exit(1);
+	}
+
+	/*
+	 * One that quotes a segment sent on our connection must abort it.
+	 */
+	printf("Sending port unreachable for port %d\n", lport);
+	send_unreachable(r, &sa, &la, lport);
+	if (check_open(s, 2)) {
+		printf("FAIL: connection still open after unreachable\n");
+		exit(1);
+	}
+
+	printf("PASS\n");
+
+	close(s);
+	close(r);
+
+	return 0;
+}
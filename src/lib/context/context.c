@@ -41,9 +41,31 @@
 #error "no valid architecture found"
 #endif
 
+/*
+ * Run queue configuration.
+ *
+ * Ready contexts are kept on one FIFO list per priority level, with a bitmap
+ * of which lists are non-empty so that we can find the most urgent context
+ * without walking anything.  On the AVR we can't afford a list for each of
+ * the 256 priority levels, so each list covers 16 levels and is kept sorted
+ * (the lists are short so this is cheap).
+ */
+#if defined(I386)
+#define RUN_QUEUE_PRI_SHIFT 0
+#else
+#define RUN_QUEUE_PRI_SHIFT 4
+#endif
+
+#define RUN_QUEUE_LISTS (0x100 >> RUN_QUEUE_PRI_SHIFT)
+#define RUN_QUEUE_MAP_WORDS ((RUN_QUEUE_LISTS + 15) / 16)
+
 /*
  * Global declarations associated with scheduling contexts.
  *
+ * run_queue always points at the most urgent ready context (the head of the
+ * first non-empty run list).  This is the one that isr_context_switch() will
+ * run next.
+ *
  * Note that the volatile declaration of run_queue is very important and it
  * definitely should *NOT* be:
  *
@@ -55,27 +77,168 @@ struct lock run_queue_lock = {0x00, 0x00, 0xff};
 u8_t run_queue_len = 0;
 struct context *context_list = NULL;
 
+static struct context *run_list_head[RUN_QUEUE_LISTS];
+static struct context *run_list_tail[RUN_QUEUE_LISTS];
+static u16_t run_list_map[RUN_QUEUE_MAP_WORDS];
+static u16_t run_list_map_summary = 0;
+
+/*
+ * run_queue_update()
+ *	Recalculate the head of the run queue from the run list bitmaps.
+ */
+static inline void run_queue_update(void)
+{
+	u8_t w;
+	
+	if (!run_list_map_summary) {
+		run_queue = NULL;
+		return;
+	}
+	
+	w = __builtin_ctz(run_list_map_summary);
+	run_queue = run_list_head[(w << 4) + __builtin_ctz(run_list_map[w])];
+}
+
+/*
+ * run_list_insert()
+ *	Add a context to the run list for its current priority.
+ *
+ * If "ahead" is set then the context goes in front of any others of the same
+ * priority, otherwise it goes after them.
+ */
+static void run_list_insert(struct context *c, u8_t ahead)
+{
+	struct context *q, *qprev;
+	u8_t idx;
+
+	idx = (u8_t)(c->c_priority >> RUN_QUEUE_PRI_SHIFT);
+	c->c_run_index = idx;
+
+	q = run_list_tail[idx];
+	if (!q) {
+		c->c_run_queue = NULL;
+		run_list_head[idx] = c;
+		run_list_tail[idx] = c;
+		run_list_map[idx >> 4] |= (1U << (idx & 0x0f));
+		run_list_map_summary |= (1U << (idx >> 4));
+		return;
+	}
+
+	if (!ahead && (q->c_priority <= c->c_priority)) {
+		c->c_run_queue = NULL;
+		q->c_run_queue = c;
+		run_list_tail[idx] = c;
+		return;
+	}
+	
+	qprev = NULL;
+	q = run_list_head[idx];
+	while (q && ((q->c_priority < c->c_priority)
+			|| (!ahead && (q->c_priority == c->c_priority)))) {
+		qprev = q;
+		q = q->c_run_queue;
+	}
+	
+	c->c_run_queue = q;
+	if (qprev) {
+		qprev->c_run_queue = c;
+	} else {
+		run_list_head[idx] = c;
+	}
+	if (!q) {
+		run_list_tail[idx] = c;
+	}
+}
+
 /*
  * isr_context_ready()
+ *	Add a context to the run queue.
+ *
+ * The context goes after any others of the same priority.
  */
 void isr_context_ready(struct context *c)
 {
-	struct context *q, **qprev;
-
 	if (DEBUG) {
 		debug_assert_isr(TRUE);
 	}
-		
-	q = (struct context *)run_queue;
-	qprev = (struct context **)&run_queue;
+	
+	run_list_insert(c, FALSE);
+	run_queue_update();
+}
 
-	while (q && (q->c_priority <= c->c_priority)) {
-		qprev = &q->c_run_queue;
+/*
+ * isr_context_unready()
+ *	Remove a context from the run queue.
+ *
+ * The context is almost always the first on its list (it's normally the one
+ * that's running) so this is quick.
+ */
+void isr_context_unready(struct context *c)
+{
+	struct context *q, *qprev;
+	u8_t idx;
+	
+	idx = c->c_run_index;
+	
+	qprev = NULL;
+	q = run_list_head[idx];
+	while (q != c) {
+		qprev = q;
 		q = q->c_run_queue;
 	}
-		
-	c->c_run_queue = q;
-	*qprev = c;
+	
+	if (qprev) {
+		qprev->c_run_queue = c->c_run_queue;
+	} else {
+		run_list_head[idx] = c->c_run_queue;
+	}
+	
+	if (run_list_tail[idx] == c) {
+		run_list_tail[idx] = qprev;
+	}
+	
+	if (!run_list_head[idx]) {
+		run_list_map[idx >> 4] &= ~(1U << (idx & 0x0f));
+		if (!run_list_map[idx >> 4]) {
+			run_list_map_summary &= ~(1U << (idx >> 4));
+		}
+	}
+
+	run_queue_update();
+}
+
+/*
+ * isr_context_preempt()
+ *	Switch to another context if one is more urgent than the current one.
+ *
+ * This is called whenever the current context's priority may have dropped.
+ * We requeue ourself according to our current priority (which may still be
+ * raised because we hold a lock) and ahead of any others of that priority,
+ * so that if we're pre-empted we'll be the next of our priority to run.
+ */
+void isr_context_preempt(void)
+{
+	struct context *c = current_context;
+	
+	/*
+	 * If we're at the head of the run queue, on the right list for our
+	 * priority and nobody behind us on that list is more urgent, then
+	 * there's nothing to do.
+	 */
+	if ((run_queue == c)
+			&& (c->c_run_index == (u8_t)(c->c_priority >> RUN_QUEUE_PRI_SHIFT))
+			&& (!c->c_run_queue || (c->c_run_queue->c_priority >= c->c_priority))) {
+		return;
+	}
+	
+	isr_context_unready(c);
+	run_list_insert(c, TRUE);
+	run_queue_update();
+
+	if (run_queue != c) {
+		c->c_state = CONTEXT_READY;
+		isr_context_switch();
+	}
 }
 
 /*
@@ -91,7 +254,7 @@ void context_exit(void)
 	isr_disable();
 	debug_set_lights(0x11);
 	
-	run_queue = current_context->c_run_queue;
+	isr_context_unready(current_context);
         run_queue_len--;
 		
 	current_context->c_state = CONTEXT_NULL;
@@ -107,7 +270,7 @@ void context_exit(void)
  */
 void isr_context_yield(void)
 {
-	run_queue = current_context->c_run_queue;
+	isr_context_unready(current_context);
 	isr_context_ready(current_context);
 
 	if (current_context != (struct context *)run_queue) {
@@ -177,7 +340,7 @@ u8_t __isr_context_wait(struct lock *l, u8_t sleep_state)
 	/*
 	 * Get off the run queue and sleep until someone wakes us up.
 	 */
-	run_queue = current_context->c_run_queue;
+	isr_context_unready(current_context);
 	run_queue_len--;
 	current_context->c_state = sleep_state;
 	ret = isr_context_switch();
@@ -481,8 +644,5 @@ void context_init(struct context *c, void (*fn)(void *), void *arg, void *stack_
 		jump_startup();
 	}
 	
-	if (current_context != (struct context *)run_queue) {
-		current_context->c_state = CONTEXT_READY;
-		isr_context_switch();
-	}
+	isr_context_preempt();
 }
@@ -156,26 +156,7 @@ void isr_spinlock_unlock(struct lock *l)
 	 * would need to check all CPUs to determine whether this (current)
 	 * context needs to be pre-empted out.
 	 */
-        if (current_context->c_run_queue) {
-        	if (current_context->c_run_queue->c_priority < l->l_pri_unlocked) {
-			struct context *q, **qprev;
-
-			run_queue = current_context->c_run_queue;
-		
-			q = (struct context *)run_queue;
-			qprev = (struct context **)&run_queue;
-
-			while (q && (q->c_priority < current_context->c_priority)) {
-				qprev = &q->c_run_queue;
-				q = q->c_run_queue;
-			}
-		
-			current_context->c_run_queue = q;
-			*qprev = current_context;
-			current_context->c_state = CONTEXT_READY;
-			isr_context_switch();
-        	}
-	}
+	isr_context_preempt();
 }
 
 /*
@@ -229,26 +210,7 @@ void spinlock_unlock(struct lock *l)
 	 * would need to check all CPUs to determine whether this (current)
 	 * context needs to be pre-empted out.
 	 */
-        if (current_context->c_run_queue) {
-        	if (current_context->c_run_queue->c_priority < l->l_pri_unlocked) {
-			struct context *q, **qprev;
-
-			run_queue = current_context->c_run_queue;
-		
-			q = (struct context *)run_queue;
-			qprev = (struct context **)&run_queue;
-
-			while (q && (q->c_priority < current_context->c_priority)) {
-				qprev = &q->c_run_queue;
-				q = q->c_run_queue;
-			}
-		
-			current_context->c_run_queue = q;
-			*qprev = current_context;
-			current_context->c_state = CONTEXT_READY;
-			isr_context_switch();
-        	}
-	}
+	isr_context_preempt();
 	
 	isr_enable();
 }
@@ -0,0 +1,205 @@
+/*
+ * crc16.c
+ *	16 bit CRC support.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ *
+ * This is the CCITT polynomial (x^16 + x^12 + x^5 + 1) in the bit reversed
+ * form used by HDLC and PPP (RFC1662), where each byte is fed in least
+ * significant bit first.  The caller chooses the initial value and any
+ * final inversion.
+ *
+ * Which implementation we get depends on how the library is built (see the
+ * Makefile): a table in ROM, a table built in RAM by crc16_init(), or a
+ * bitwise calculation that needs no table at all.  With either of the
+ * tables the i386 code also builds three more in crc16_init() so that
+ * crc16_block() can work through 4 bytes at a time ("slicing-by-4").
+ */
+#include "types.h"
+#include "memory.h"
+#include "crc.h"
+
+#if !defined(CRC_ROM) && !defined(CRC_RAM) && !defined(CRC_BITWISE)
+#define CRC_ROM
+#endif
+
+/*
+ * The CRC polynomial (bit reversed).
+ */
+#define CRC16_POLY 0x8408
+
+#if defined(CRC_ROM)
+/*
+ * CRC table, held in ROM.
+ */
+static const u16_t crc16_table[256] ROM_DATA = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+#define crc16_table_read(i) rom_read16(&crc16_table[i])
+
+#elif defined(CRC_RAM)
+/*
+ * CRC table, built by crc16_init().
+ */
+static u16_t crc16_table[256];
+static u8_t crc16_table_ready = FALSE;
+
+#define crc16_table_read(i) (crc16_table[i])
+#endif
+
+#if defined(I386) && !defined(CRC_BITWISE)
+/*
+ * Slicing-by-4 tables.  crc16_slice[k][i] is the CRC of byte "i" followed
+ * by k + 1 zero bytes.
+ */
+static u16_t crc16_slice[3][256];
+static u8_t crc16_slice_ready = FALSE;
+#endif
+
+/*
+ * crc16_calc()
+ *	Calculate the CRC of a single byte, one bit at a time.
+ */
+#if !defined(CRC_ROM)
+static u16_t crc16_calc(u16_t crc)
+{
+	u8_t i;
+
+	for (i = 0; i < 8; i++) {
+		crc = (crc & 1) ? ((crc >> 1) ^ CRC16_POLY) : (crc >> 1);
+	}
+
+	return crc;
+}
+#endif
+
+/*
+ * crc16_init()
+ *	Get ready to calculate 16 bit CRCs.
+ *
+ * This must be called before any of the other functions are used.  It can
+ * be called any number of times.
+ */
+void crc16_init(void)
+{
+#if defined(CRC_RAM) || (defined(I386) && !defined(CRC_BITWISE))
+	u16_t i;
+#endif
+#if defined(I386) && !defined(CRC_BITWISE)
+	u8_t k;
+	u16_t c;
+#endif
+
+#if defined(CRC_RAM)
+	if (!crc16_table_ready) {
+		for (i = 0; i < 256; i++) {
+			crc16_table[i] = crc16_calc(i);
+		}
+		crc16_table_ready = TRUE;
+	}
+#endif
+
+#if defined(I386) && !defined(CRC_BITWISE)
+	if (!crc16_slice_ready) {
+		for (i = 0; i < 256; i++) {
+			c = crc16_table_read(i);
+			for (k = 0; k < 3; k++) {
+				c = (c >> 8) ^ crc16_table_read(c & 0xff);
+				crc16_slice[k][i] = c;
+			}
+		}
+		crc16_slice_ready = TRUE;
+	}
+#endif
+}
+
+/*
+ * crc16_update()
+ *	Update a 16 bit CRC with one more byte.
+ */
+u16_t crc16_update(u16_t crc, u8_t val)
+{
+#if defined(CRC_BITWISE)
+	return crc16_calc(crc ^ val);
+#else
+	return (crc >> 8) ^ crc16_table_read((crc ^ val) & 0xff);
+#endif
+}
+
+/*
+ * crc16_block()
+ *	Update a 16 bit CRC with a block of data.
+ */
+u16_t crc16_block(u16_t crc, void *buf, addr_t count)
+{
+	u8_t *p;
+#if defined(I386) && !defined(CRC_BITWISE)
+	u32_t x;
+#endif
+
+	p = (u8_t *)buf;
+
+#if defined(I386) && !defined(CRC_BITWISE)
+	if (crc16_slice_ready) {
+		while (count >= 4) {
+			x = crc ^ *((u16_t *)p);
+			crc = crc16_slice[2][x & 0xff] ^ crc16_slice[1][x >> 8]
+					^ crc16_slice[0][p[2]] ^ crc16_table_read(p[3]);
+			p += 4;
+			count -= 4;
+		}
+	}
+#endif
+
+	while (count) {
+		crc = crc16_update(crc, *p++);
+		count--;
+	}
+
+	return crc;
+}
@@ -25,6 +25,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
 #include "ethdev.h"
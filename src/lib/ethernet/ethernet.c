@@ -21,6 +21,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
 #include "ethdev.h"
@@ -88,11 +89,7 @@ void ethernet_send_netbuf(void *srv, u8_t *dest_mac, struct netbuf *nb)
 	ethdev_server_ref(eds);
 	spinlock_unlock(&ei->ei_lock);
 
-	nb->nb_datalink_membuf = membuf_alloc(sizeof(struct eth_phys_header), NULL);
-	nb->nb_datalink = nb->nb_datalink_membuf;
-	nb->nb_datalink_size = sizeof(struct eth_phys_header);
-
-	eph = (struct eth_phys_header *)nb->nb_datalink;
+	eph = (struct eth_phys_header *)netbuf_push_datalink(nb, sizeof(struct eth_phys_header));
 	memcpy(eph->eph_src_mac, eds->eds_get_mac(eds), 6);
 	memcpy(eph->eph_dest_mac, dest_mac, 6);
 	eph->eph_type = hton16(es->es_type);
@@ -21,71 +21,221 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
-#include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "timer.h"
+#include "oneshot.h"
 #include "ethdev.h"
 #include "ethernet.h"
 #include "ip_datalink.h"
+#include "ip_route.h"
 #include "ethernet_ip.h"
 #include "ip.h"
 
+/*
+ * ip_arp_hash()
+ *	Find the first ARP cache slot that an IP address may be held in.
+ */
+static inline u8_t ip_arp_hash(u32_t ip)
+{
+	ip ^= ip >> 16;
+	ip ^= ip >> 8;
+
+	return (u8_t)(ip & ARP_CACHE_MASK);
+}
+
+/*
+ * ip_arp_slot_discard()
+ *	Discard any packets waiting on an ARP cache slot and free the slot.
+ */
+static void ip_arp_slot_discard(struct ip_arp_cache_slot *iacs)
+{
+	struct netbuf *nb;
+
+	while (iacs->iacs_pending) {
+		nb = iacs->iacs_pending;
+		iacs->iacs_pending = nb->nb_next;
+		netbuf_deref(nb);
+	}
+
+	iacs->iacs_pending_count = 0;
+	iacs->iacs_state = ARP_SLOT_FREE;
+}
+
 /*
  * __ethernet_ip_instance_free()
  */
 static void __ethernet_ip_instance_free(void *inst)
 {
 	struct ethernet_ip_instance *eii;
-	struct ip_route *r;
+	u8_t i;
 	
 	eii = (struct ethernet_ip_instance *)inst;
 	
 	/*
-	 * Clean up the route table - don't worry about locking as this is a
-	 * dead reference!
+	 * Remove our routes from the routing table.
 	 */
-	r = eii->eii_route_info;
-	while (r) {
-		struct ip_route *p;
-		
-		p = r;
-		r = r->ir_next;
-	
-		heap_free(p);
+	ip_route_delete_datalink(&eii->eii_idi);
+
+	/*
+	 * Discard any packets that are still waiting for ARP replies.
+	 */
+	for (i = 0; i < ARP_CACHE_SLOTS; i++) {
+		ip_arp_slot_discard(&eii->eii_arp_cache[i]);
 	}
+
+	oneshot_deref(eii->eii_arp_timer);
+}
+
+/*
+ * ip_arp_cache_lookup()
+ *	Find the ARP cache slot holding an IP address.
+ *
+ * It is assumed that the instance lock is held on entry to this function.
+ */
+static struct ip_arp_cache_slot *ip_arp_cache_lookup(struct ethernet_ip_instance *eii, u32_t ip)
+{
+	struct ip_arp_cache_slot *iacs;
+	u8_t i, h;
+
+	h = ip_arp_hash(ip);
+	for (i = 0; i < ARP_CACHE_PROBES; i++) {
+		iacs = &eii->eii_arp_cache[(h + i) & ARP_CACHE_MASK];
+		if ((iacs->iacs_state != ARP_SLOT_FREE) && (iacs->iacs_ip == ip)) {
+			return iacs;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * ip_arp_cache_alloc()
+ *	Find an ARP cache slot for a new IP address.
+ *
+ * We use a free slot if there is one.  Failing that we throw out the oldest
+ * resolved entry, and only if there are none of those do we throw out a
+ * pending one.  Any destination cache entries that were using a resolved
+ * entry are now stale.
+ *
+ * It is assumed that the instance lock is held on entry to this function.
+ */
+static struct ip_arp_cache_slot *ip_arp_cache_alloc(struct ethernet_ip_instance *eii, u32_t ip, u32_t now)
+{
+	struct ip_arp_cache_slot *iacs, *victim;
+	u8_t i, h;
+
+	h = ip_arp_hash(ip);
+	victim = NULL;
+	for (i = 0; i < ARP_CACHE_PROBES; i++) {
+		iacs = &eii->eii_arp_cache[(h + i) & ARP_CACHE_MASK];
+		if (iacs->iacs_state == ARP_SLOT_FREE) {
+			victim = iacs;
+			break;
+		}
+
+		if (!victim || ((victim->iacs_state == ARP_SLOT_PENDING) && (iacs->iacs_state == ARP_SLOT_RESOLVED))
+				|| ((victim->iacs_state == iacs->iacs_state)
+					&& ((now - iacs->iacs_jiffies) > (now - victim->iacs_jiffies)))) {
+			victim = iacs;
+		}
+	}
+
+	if (victim->iacs_state == ARP_SLOT_RESOLVED) {
+		eii->eii_idi.idi_dst_gen++;
+	}
+	ip_arp_slot_discard(victim);
+
+	victim->iacs_ip = ip;
+	victim->iacs_requests = 0;
+	victim->iacs_jiffies = now;
+
+	return victim;
+}
+
+/*
+ * ip_arp_timer_start()
+ *	Start the ARP timer if it isn't already running.
+ *
+ * The caller must have set eii_arp_timer_running while holding the instance
+ * lock, and must have released the lock before calling this.  The running
+ * timer holds a reference to the instance.
+ */
+static void ip_arp_timer_start(struct ethernet_ip_instance *eii)
+{
+	ip_datalink_instance_ref(&eii->eii_idi);
+	eii->eii_arp_timer->os_ticks_left = ARP_REQUEST_INTERVAL;
+	oneshot_attach(eii->eii_arp_timer);
 }
 
 /*
  * ip_arp_cache_add()
+ *	Record the MAC address for an IP address.
  *
- * I know this is wrong, but it's only for a short time (the age bit's screwed up).
+ * If there are packets waiting for the address then we send them now.
  */
 static void ip_arp_cache_add(struct ip_datalink_instance *idi, u8_t *mac, u32_t ip)
 {
-	u8_t i;
-	u8_t oldest = 0;
-        u32_t old_age = 0xffffffff;
+	u8_t i, start;
 	struct ethernet_ip_instance *eii;
+	struct ip_arp_cache_slot *iacs;
+	struct ethernet_server *es;
+	struct netbuf *nb, *pending;
+	u32_t now;
 	
 	eii = (struct ethernet_ip_instance *)idi;
-        		
+	now = timer_get_jiffies();
+	start = FALSE;
+	
 	spinlock_lock(&idi->idi_lock);
-		
-	for (i = 0; i < ARP_CACHE_SLOTS; i++) {
-		if (eii->eii_arp_cache[i].iacs_ip == ip) {
-			oldest = i;
-			break;
-		} else if (eii->eii_arp_cache[i].iacs_age < old_age) {
-			oldest = i;
-			old_age = eii->eii_arp_cache[i].iacs_age;
+
+	iacs = ip_arp_cache_lookup(eii, ip);
+	if (!iacs) {
+		iacs = ip_arp_cache_alloc(eii, ip, now);
+		if (!eii->eii_arp_timer_running) {
+			eii->eii_arp_timer_running = TRUE;
+			start = TRUE;
+		}
+	} else if (iacs->iacs_state == ARP_SLOT_RESOLVED) {
+		/*
+		 * If a host's MAC address has changed then destination cache
+		 * entries may now be stale.
+		 */
+		for (i = 0; i < 6; i++) {
+			if (iacs->iacs_mac[i] != mac[i]) {
+				idi->idi_dst_gen++;
+				break;
+			}
 		}
 	}
 
-	memcpy(eii->eii_arp_cache[oldest].iacs_mac, mac, 6);
-	eii->eii_arp_cache[oldest].iacs_ip = ip;
-	eii->eii_arp_cache[oldest].iacs_age = eii->eii_ip_arp_age++;
+	memcpy(iacs->iacs_mac, mac, 6);
+	iacs->iacs_state = ARP_SLOT_RESOLVED;
+	iacs->iacs_jiffies = now;
+
+	pending = iacs->iacs_pending;
+	iacs->iacs_pending = NULL;
+	iacs->iacs_pending_count = 0;
+
+	es = eii->eii_ip_server;
+	ethernet_server_ref(es);
 
 	spinlock_unlock(&idi->idi_lock);
+
+	if (start) {
+		ip_arp_timer_start(eii);
+	}
+
+	while (pending) {
+		nb = pending;
+		pending = nb->nb_next;
+		nb->nb_next = NULL;
+		es->es_send(es, mac, nb);
+		netbuf_deref(nb);
+	}
+
+	ethernet_server_deref(es);
 }
 
 /*
@@ -93,36 +243,152 @@ static void ip_arp_cache_add(struct ip_datalink_instance *idi, u8_t *mac, u32_t
  *
  * Returns 0 if no match is found, or 1 if one is found.  If one is found
  * we also write the MAC address into the area pointed to by mac.
+ *
+ * If no match is found then we keep a copy of the packet "nb" to send when
+ * the address is resolved, and if we've not already asked for the address
+ * then we do so now.  Only the newest ARP_PENDING_MAX packets are kept.  The
+ * copy doesn't carry the sender's destination cache entry as we hold no
+ * reference to it.
  */
-static u8_t ip_arp_cache_find(struct ip_datalink_instance *idi, u8_t *mac, u32_t ip)
+static u8_t ip_arp_cache_find(struct ip_datalink_instance *idi, u8_t *mac, u32_t ip, struct netbuf *nb)
 {
-	u8_t i;
-        u8_t retval = 0;
 	struct ethernet_ip_instance *eii;
+	struct ip_arp_cache_slot *iacs;
+	struct netbuf *old, **pprev;
+	u8_t request, start;
+	u32_t now;
 	
 	eii = (struct ethernet_ip_instance *)idi;
+	now = timer_get_jiffies();
+	request = FALSE;
+	start = FALSE;
         		
 	spinlock_lock(&idi->idi_lock);
 		
-	/*
-	 * First look in our cache slots.
-	 */
+	iacs = ip_arp_cache_lookup(eii, ip);
+	if (iacs && (iacs->iacs_state == ARP_SLOT_RESOLVED)) {
+		if ((now - iacs->iacs_jiffies) < ARP_CACHE_TIMEOUT) {
+			memcpy(mac, iacs->iacs_mac, 6);
+			spinlock_unlock(&idi->idi_lock);
+			return 1;
+		}
+
+		/*
+		 * The entry has expired so we need to ask again.
+		 */
+		idi->idi_dst_gen++;
+		iacs->iacs_state = ARP_SLOT_FREE;
+		iacs = NULL;
+	}
+
+	if (!iacs) {
+		iacs = ip_arp_cache_alloc(eii, ip, now);
+		iacs->iacs_state = ARP_SLOT_PENDING;
+		iacs->iacs_requests = 1;
+		request = TRUE;
+		if (!eii->eii_arp_timer_running) {
+			eii->eii_arp_timer_running = TRUE;
+			start = TRUE;
+		}
+	}
+
+	if (iacs->iacs_pending_count == ARP_PENDING_MAX) {
+		old = iacs->iacs_pending;
+		iacs->iacs_pending = old->nb_next;
+		iacs->iacs_pending_count--;
+		netbuf_deref(old);
+	}
+
+	pprev = &iacs->iacs_pending;
+	while (*pprev) {
+		pprev = &(*pprev)->nb_next;
+	}
+	*pprev = netbuf_clone(nb);
+	(*pprev)->nb_dst_cache = NULL;
+	iacs->iacs_pending_count++;
+
+	spinlock_unlock(&idi->idi_lock);
+
+	if (start) {
+		ip_arp_timer_start(eii);
+	}
+
+	if (request) {
+		ip_arp_request(idi, ip);
+	}
+	
+	return 0;
+}
+
+/*
+ * ip_arp_tick()
+ *	Callback function for the ARP timer.
+ *
+ * We expire old entries and deal with pending ones: either asking for their
+ * addresses again or giving up on them.  The timer keeps running for as long
+ * as there's anything in the cache.
+ */
+static void ip_arp_tick(void *inst)
+{
+	struct ip_datalink_instance *idi;
+	struct ethernet_ip_instance *eii;
+	struct ip_arp_cache_slot *iacs;
+	u32_t requests[ARP_CACHE_SLOTS];
+	u32_t now;
+	u8_t i, nrequests, used;
+
+	idi = (struct ip_datalink_instance *)inst;
+	eii = (struct ethernet_ip_instance *)idi;
+	now = timer_get_jiffies();
+	nrequests = 0;
+	used = FALSE;
+
+	spinlock_lock(&idi->idi_lock);
+
 	for (i = 0; i < ARP_CACHE_SLOTS; i++) {
-		if (eii->eii_arp_cache[i].iacs_ip == ip) {
-			/*
-			 * If we get a match then flag that this entry has
-			 * been newly refreshed.
-			 */
-			eii->eii_arp_cache[i].iacs_age = eii->eii_ip_arp_age++;
-			memcpy(mac, eii->eii_arp_cache[i].iacs_mac, 6);
-			retval = 1;
+		iacs = &eii->eii_arp_cache[i];
+		switch (iacs->iacs_state) {
+		case ARP_SLOT_RESOLVED:
+			if ((now - iacs->iacs_jiffies) >= ARP_CACHE_TIMEOUT) {
+				idi->idi_dst_gen++;
+				iacs->iacs_state = ARP_SLOT_FREE;
+				break;
+			}
+			used = TRUE;
+			break;
+
+		case ARP_SLOT_PENDING:
+			if ((now - iacs->iacs_jiffies) < ARP_REQUEST_INTERVAL) {
+				used = TRUE;
+				break;
+			}
+
+			if (iacs->iacs_requests >= ARP_REQUEST_RETRIES) {
+				ip_arp_slot_discard(iacs);
+				break;
+			}
+
+			iacs->iacs_requests++;
+			iacs->iacs_jiffies = now;
+			requests[nrequests++] = iacs->iacs_ip;
+			used = TRUE;
 			break;
 		}
 	}
 
+	eii->eii_arp_timer_running = used;
+
 	spinlock_unlock(&idi->idi_lock);
-	
-	return retval;
+
+	if (used) {
+		ip_arp_timer_start(eii);
+	}
+
+	for (i = 0; i < nrequests; i++) {
+		ip_arp_request(idi, requests[i]);
+	}
+
+	ip_datalink_instance_deref(idi);
 }
 
 /*
@@ -291,93 +557,6 @@ u8_t ip_arp_request(struct ip_datalink_instance *idi, u32_t ip)
 	return 0;
 }
 
-/*
- * ip_route_add()
- *	Add a route into the routing list.
- *
- * We jump through quite a few hoops here to ensure that the routes are added
- * in such a way that we can scan from the head of the list and use the first
- * path that we find.
- */
-void ip_route_add(struct ip_datalink_instance *idi, struct ip_route *radd)
-{
-	struct ip_route *r, **rprev;
-	struct ethernet_ip_instance *eii;
-	
-	eii = (struct ethernet_ip_instance *)idi;
-	
-	spinlock_lock(&idi->idi_lock);
-		
-	r = eii->eii_route_info;
-	rprev = &eii->eii_route_info;
-
-	/*
-	 * Are we adding a host or a network?  If we're adding a host then we can
-	 * drop through and place it at the head of the list.
-	 */
-	if (radd->ir_network) {
-		/*
-		 * We're adding a network - skip past the host entries.
-		 */
-		while (r && (r->ir_network == FALSE)) {
-			rprev = &r->ir_next;
-			r = r->ir_next;
-		}
-
-		/*
-		 * Add the network reference, placing the ones with the fewest
-		 * possible hosts at the head of the list.  This means a simple
-		 * search will check smaller specific routes before more general
-		 * ones.
-		 */	
-		while (r && (r->ir_addr.ir_network.irn_netmask > radd->ir_addr.ir_network.irn_netmask)) {
-			rprev = &r->ir_next;
-			r = r->ir_next;
-		}
-	}
-
-	/*
-	 * Insert the entry into the list.
-	 */
-	radd->ir_next = r;
-	*rprev = radd;
-
-	spinlock_unlock(&idi->idi_lock);
-}
-
-/*
- * ip_route_find()
- *	Find the device associated with a particular IP route.
- */
-struct ip_route *ip_route_find(struct ip_datalink_instance *idi, u32_t ip)
-{
-	struct ip_route *ir;
-	struct ethernet_ip_instance *eii;
-	
-	eii = (struct ethernet_ip_instance *)idi;
-	
-	spinlock_lock(&idi->idi_lock);
-		
-	ir = eii->eii_route_info;
-	while (ir) {
-		if (ir->ir_network) {
-			if ((ip & ir->ir_addr.ir_network.irn_netmask) == ir->ir_addr.ir_network.irn_addr) {
-				break;
-			}
-		} else {
-			if (ip == ir->ir_addr.ir_host.irh_addr) {
-				break;
-			}
-		}
-		
-		ir = ir->ir_next;
-	}
-
-	spinlock_unlock(&idi->idi_lock);
-
-	return ir;
-}
-
 /*
  * ethernet_ip_recv_netbuf()
  */
@@ -404,6 +583,13 @@ void ethernet_ip_recv_netbuf(void *clnt, struct netbuf *nb)
  * ethernet_ip_send_netbuf()
  *	Send a netbuf.
  *
+ * If the sender has given us a destination cache entry that's still valid
+ * then we can use the MAC address that it holds and skip both the route and
+ * the ARP cache lookups.  Otherwise we do the lookups and, if we find the
+ * destination, record the result in the entry for next time.  If the ARP
+ * cache doesn't know the destination then a copy of the packet is held until
+ * it does (see ip_arp_cache_find()).
+ *
  * Note that we assume that all parameters are supplied in network byte order.
  */
 void ethernet_ip_send_netbuf(void *srv, struct netbuf *nb)
@@ -413,30 +599,65 @@ void ethernet_ip_send_netbuf(void *srv, struct netbuf *nb)
 	struct ethernet_ip_instance *eii;
 	struct ethernet_server *es;
 	struct ip_header *iph;
-        struct ip_route *rt;
-	u32_t addr;
+        struct ip_route rt;
+	struct ip_dst_cache *dc;
+	u32_t addr, dest, gen, route_gen;
 	u8_t mac[6];
 
 	ids = (struct ip_datalink_server *)srv;
 	idi = (struct ip_datalink_instance *)ids->ids_instance;
 	eii = (struct ethernet_ip_instance *)idi;
 	iph = (struct ip_header *)nb->nb_network;
+	dest = hton32(iph->ih_dest_addr);
+
+	dc = (struct ip_dst_cache *)nb->nb_dst_cache;
+	gen = 0;
+	route_gen = ip_route_gen;
+	if (dc) {
+		spinlock_lock(&idi->idi_lock);
+
+		if ((dc->dc_idi == idi) && (dc->dc_addr == dest) && (dc->dc_gen == idi->idi_dst_gen)
+				&& (dc->dc_route_gen == route_gen)) {
+			memcpy(mac, dc->dc_mac, 6);
+			es = eii->eii_ip_server;
+			ethernet_server_ref(es);
+			spinlock_unlock(&idi->idi_lock);
+
+			es->es_send(es, mac, nb);
 
-	rt = ip_route_find(idi, hton32(iph->ih_dest_addr));
-	if (!rt) {
+			ethernet_server_deref(es);
+			return;
+		}
+
+		gen = idi->idi_dst_gen;
+		spinlock_unlock(&idi->idi_lock);
+	}
+
+	/*
+	 * The routing table is shared by all of the interfaces, so a route
+	 * that goes through some other one is no more use to us than none.
+	 */
+	if (!ip_route_find(dest, &rt) || (rt.ir_idi != idi)) {
 		debug_print_pstr("\fethernet_ip_send_netbuf: no rt:");
-		debug_print32(hton32(iph->ih_dest_addr));
+		debug_print32(dest);
 		return;
 	}
 	
-	if (rt->ir_gateway) {
-		addr = rt->ir_gateway;
+	if (rt.ir_gateway) {
+		addr = rt.ir_gateway;
 	} else {
-		addr = hton32(iph->ih_dest_addr);
+		addr = dest;
 	}
 
-	if (ip_arp_cache_find(idi, mac, addr)) {
+	if (ip_arp_cache_find(idi, mac, addr, nb)) {
 		spinlock_lock(&idi->idi_lock);
+		if (dc) {
+			dc->dc_idi = idi;
+			dc->dc_addr = dest;
+			dc->dc_gen = gen;
+			dc->dc_route_gen = route_gen;
+			memcpy(dc->dc_mac, mac, 6);
+		}
 		es = eii->eii_ip_server;
 		ethernet_server_ref(es);
 		spinlock_unlock(&idi->idi_lock);
@@ -444,19 +665,6 @@ void ethernet_ip_send_netbuf(void *srv, struct netbuf *nb)
 		es->es_send(es, mac, nb);
 	
 		ethernet_server_deref(es);
-	} else {
-		/*
-		 * If we don't know where this packet should go to then
-		 * it's time to find out.  For now we simply discard the
-		 * packet we were supposed to be sending.  Sometime in
-		 * the future, perhaps this should be changed for queueing
-		 * the request until the address is known.
-		 */
-		ip_arp_request(idi, addr);
-		debug_print_pstr("\fMAC not found:");
-		debug_print32(addr);
-		debug_print_pstr("rt:");
-		debug_print32(rt->ir_addr.ir_network.irn_addr);
 	}
 }
 
@@ -504,7 +712,6 @@ struct ip_datalink_server *ethernet_ip_client_attach(struct ip_datalink_instance
  */
 struct ip_datalink_instance *ethernet_ip_instance_alloc(struct ethernet_instance *ethi)
 {
-	struct ip_route *ir;
 	struct ip_datalink_instance *idi;
 	struct ethernet_ip_instance *eii;
 	u8_t i;
@@ -515,12 +722,11 @@ struct ip_datalink_instance *ethernet_ip_instance_alloc(struct ethernet_instance
 	spinlock_init(&idi->idi_lock, 0x10);
 	idi->idi_mru = 1500;
 	idi->idi_mtu = 1500;
+	idi->idi_dst_gen = 0;
 	idi->idi_client = NULL;
 	idi->idi_client_attach = ethernet_ip_client_attach;
 	idi->idi_client_detach = ip_datalink_client_detach;
 
-	eii->eii_ip_arp_age = 1;
-	eii->eii_route_info = NULL;
 	eii->eii_ip_server = NULL;
 	eii->eii_arp_server = NULL;
 	
@@ -528,10 +734,16 @@ struct ip_datalink_instance *ethernet_ip_instance_alloc(struct ethernet_instance
 	 * Clear down the ARP cache.
 	 */
 	for (i = 0; i < ARP_CACHE_SLOTS; i++) {
-		eii->eii_arp_cache[i].iacs_age = 0;
-		eii->eii_arp_cache[i].iacs_ip = 0;
+		eii->eii_arp_cache[i].iacs_state = ARP_SLOT_FREE;
+		eii->eii_arp_cache[i].iacs_pending = NULL;
+		eii->eii_arp_cache[i].iacs_pending_count = 0;
 	}
 
+	eii->eii_arp_timer = oneshot_alloc();
+	eii->eii_arp_timer->os_callback = ip_arp_tick;
+	eii->eii_arp_timer->os_arg = idi;
+	eii->eii_arp_timer_running = FALSE;
+
 	/*
 	 * Attach this IP handler to our Ethernet channel.
 	 */
@@ -550,28 +762,6 @@ struct ip_datalink_instance *ethernet_ip_instance_alloc(struct ethernet_instance
 	ip_datalink_instance_ref(idi);
 	eii->eii_arp_server = ethi->ei_client_attach(ethi, arpec);
 	ethernet_client_deref(arpec);
-	
-	/*
-	 * Route to the network.
-	 */
-	ir = (struct ip_route *)heap_alloc(sizeof(struct ip_route));
-	ir->ir_network = TRUE;
-	ir->ir_addr.ir_network.irn_addr = 0xc0a80000;
-	ir->ir_addr.ir_network.irn_netmask = 0xffffff00;
-	ir->ir_gateway = 0x00000000;
-	ir->ir_next = NULL;
-	ip_route_add(idi, ir);
-			
-	/*
-	 * Default route to anywhere else!
-	 */
-	ir = (struct ip_route *)heap_alloc(sizeof(struct ip_route));
-	ir->ir_network = TRUE;
-	ir->ir_addr.ir_network.irn_addr = 0x00000000;
-	ir->ir_addr.ir_network.irn_netmask = 0x00000000;
-	ir->ir_gateway = 0xc0a80001;
-	ir->ir_next = NULL;
-	ip_route_add(idi, ir);
 
 	return idi;
 }
@@ -17,9 +17,20 @@
  * uses of the text contained in this file.  See the accompanying file
  * "copying-liquorice.txt" for details.
  *
- * The strategy used within this memory allocator is to try and cause as
- * little waste as possible.  This can make things a little slower than
- * would be ideal, but does give the best chance of things keeping running.
+ * The allocator is a two-level segregated-fit design (very much along the
+ * lines of TLSF).  Free holes are kept on a table of lists indexed by size
+ * class, with a pair of bitmaps recording which lists are non-empty.  Finding
+ * a suitably sized hole is then a couple of find-first-set operations rather
+ * than a scan of every hole in the system.
+ *
+ * Every block (allocated or free) carries a boundary tag: its size, a pointer
+ * to the block physically preceding it and flags saying whether it and its
+ * predecessor are free.  This lets heap_free() find its neighbours and merge
+ * with them directly, so both allocation and release run in constant time
+ * regardless of how fragmented the heap has become.
+ *
+ * Each region handed to heap_add() is terminated by a zero-sized "allocated"
+ * sentinel block so that merging never runs off the end of a region.
  */
 #include "types.h"
 #include "memory.h"
@@ -39,9 +50,196 @@ static struct lock heap_lock = {0, 0x08, 0xff};
 static addr_t free_ram = 0;
 
 /*
- * Pointer to the first memory hole.
+ * Bitmaps of the non-empty first level classes and, for each first level
+ * class, the non-empty second level lists.
+ */
+static addr_t fl_bitmap = 0;
+static addr_t sl_bitmap[HEAP_FL_INDEX_COUNT];
+
+/*
+ * Heads of each of the segregated hole lists.
+ */
+static struct memory_hole *hole_lists[HEAP_FL_INDEX_COUNT][HEAP_SL_INDEX_COUNT];
+
+/*
+ * Overheads associated with holes and blocks.
+ */
+#define HEAP_MAGIC_SIZE (HEAP_DEBUG ? sizeof(fast_u16_t) : 0)
+#define HEAP_MIN_HOLE_SIZE (((sizeof(struct memory_hole) + HEAP_MAGIC_SIZE) + HEAP_BLOCK_FLAGS) & ~HEAP_BLOCK_FLAGS)
+
+/*
+ * heap_fls()
+ *	Find the index of the most significant set bit.
+ */
+static inline int heap_fls(addr_t x)
+{
+	return (sizeof(addr_t) * 8) - 1 - __builtin_clz(x);
+}
+
+/*
+ * heap_ffs()
+ *	Find the index of the least significant set bit.
+ */
+static inline int heap_ffs(addr_t x)
+{
+	return __builtin_ctz(x);
+}
+
+/*
+ * mapping_insert()
+ *	Find the list indicies that a hole of a given size belongs on.
+ */
+static inline void mapping_insert(addr_t size, int *fl, int *sl)
+{
+	int f, s;
+
+	if (size < HEAP_SMALL_BLOCK_SIZE) {
+		f = 0;
+		s = size / (HEAP_SMALL_BLOCK_SIZE / HEAP_SL_INDEX_COUNT);
+	} else {
+		f = heap_fls(size);
+		s = (size >> (f - HEAP_SL_INDEX_COUNT_LOG2)) ^ (1 << HEAP_SL_INDEX_COUNT_LOG2);
+		f -= (HEAP_FL_INDEX_SHIFT - 1);
+	}
+
+	*fl = f;
+	*sl = s;
+}
+
+/*
+ * mapping_search()
+ *	Find the list indicies of the first list guaranteed to hold holes large
+ *	enough for the given size.
+ *
+ * We round the request up to the next list boundary so that any hole that we
+ * find is big enough without having to look at it.  If rounding up would take
+ * us past the largest size that an addr_t can hold then no list can satisfy
+ * the request, and we return a first level index beyond the last list.
+ */
+static inline void mapping_search(addr_t size, int *fl, int *sl)
+{
+	addr_t round;
+
+	if (size >= HEAP_SMALL_BLOCK_SIZE) {
+		round = ((addr_t)1 << (heap_fls(size) - HEAP_SL_INDEX_COUNT_LOG2)) - 1;
+		if (size > (addr_t)(~(addr_t)0 - round)) {
+			*fl = HEAP_FL_INDEX_COUNT;
+			*sl = 0;
+			return;
+		}
+
+		size += round;
+	}
+
+	mapping_insert(size, fl, sl);
+}
+
+/*
+ * find_suitable_hole()
+ *	Locate a non-empty list at, or above, the specified list indicies.
+ */
+static inline struct memory_hole *find_suitable_hole(int *fl, int *sl)
+{
+	int f = *fl;
+	int s;
+	addr_t map;
+
+	if (f >= HEAP_FL_INDEX_COUNT) {
+		return NULL;
+	}
+
+	map = sl_bitmap[f] & (~(addr_t)0 << *sl);
+	if (!map) {
+		map = fl_bitmap & (~(addr_t)0 << (f + 1));
+		if (!map) {
+			return NULL;
+		}
+
+		f = heap_ffs(map);
+		map = sl_bitmap[f];
+	}
+
+	s = heap_ffs(map);
+	*fl = f;
+	*sl = s;
+
+	return hole_lists[f][s];
+}
+
+/*
+ * remove_hole()
+ *	Remove a hole from its segregated list.
+ */
+static inline void remove_hole(struct memory_hole *mh, int fl, int sl)
+{
+	struct memory_hole *next = mh->mh_next;
+	struct memory_hole *prev = mh->mh_prev;
+
+	if (next) {
+		next->mh_prev = prev;
+	}
+
+	if (prev) {
+		prev->mh_next = next;
+	} else {
+		hole_lists[fl][sl] = next;
+		if (!next) {
+			sl_bitmap[fl] &= ~(1 << sl);
+			if (!sl_bitmap[fl]) {
+				fl_bitmap &= ~(1 << fl);
+			}
+		}
+	}
+}
+
+/*
+ * insert_hole()
+ *	Add a hole to the head of the appropriate segregated list.
+ */
+static inline void insert_hole(struct memory_hole *mh)
+{
+	int fl, sl;
+	struct memory_hole *head;
+
+	mapping_insert(mh->mh_size & ~HEAP_BLOCK_FLAGS, &fl, &sl);
+
+	head = hole_lists[fl][sl];
+	mh->mh_next = head;
+	mh->mh_prev = NULL;
+	if (head) {
+		head->mh_prev = mh;
+	}
+
+	hole_lists[fl][sl] = mh;
+	fl_bitmap |= (1 << fl);
+	sl_bitmap[fl] |= (1 << sl);
+
+	if (HEAP_DEBUG) {
+		fast_u16_t *magic = (fast_u16_t *)(mh + 1);
+		*magic = MEMORY_HOLE_MAGIC;
+	}
+}
+
+/*
+ * unlink_hole()
+ *	Remove a hole, given only its address, from its segregated list.
  */
-struct memory_hole *first_hole = NULL;
+static inline void unlink_hole(struct memory_hole *mh)
+{
+	int fl, sl;
+
+	mapping_insert(mh->mh_size & ~HEAP_BLOCK_FLAGS, &fl, &sl);
+	remove_hole(mh, fl, sl);
+}
+
+/*
+ * next_phys()
+ *	Find the block that physically follows the one specified.
+ */
+static inline struct memory_block *next_phys(struct memory_block *mb)
+{
+	return (struct memory_block *)((addr_t)mb + (mb->mb_size & ~HEAP_BLOCK_FLAGS));
+}
 
 /*
  * heap_alloc()
@@ -49,12 +247,13 @@ struct memory_hole *first_hole = NULL;
  */
 void *heap_alloc(addr_t size)
 {
-	struct memory_hole *mh, **mhprev;
-	struct memory_hole *use = NULL;
-        struct memory_hole **useprev = NULL;
-        void *block = NULL;
-        int required;
-        fast_u16_t *magic;
+	struct memory_hole *use;
+	struct memory_block *mb, *next;
+	void *block = NULL;
+	addr_t required;
+	addr_t use_size;
+	int fl, sl;
+	fast_u16_t *magic;
 
 	if (DEBUG) {
 #if defined(MEGA103) || defined (AT90S8515)
@@ -72,75 +271,78 @@ void *heap_alloc(addr_t size)
 		}
 	}
 
-        /*
-         * All allocations need to be "memory_block" bytes larger than the
-         * amount requested by our caller.  They also need to be large enough
-         * that they can contain a "memory_hole" and any magic values used in
-         * debugging (for when the block gets freed and becomes an isolated
-         * hole).
-         */
-        required = size + sizeof(struct memory_block) + (HEAP_DEBUG ? sizeof(fast_u16_t) : 0);
-	if (required < (sizeof(struct memory_hole) + (HEAP_DEBUG ? sizeof(fast_u16_t) : 0))) {
-		required = sizeof(struct memory_hole) + (HEAP_DEBUG ? sizeof(fast_u16_t) : 0);
+	/*
+	 * All allocations need to be "memory_block" bytes larger than the
+	 * amount requested by our caller.  They also need to be large enough
+	 * that they can contain a "memory_hole" and any magic values used in
+	 * debugging (for when the block gets freed and becomes an isolated
+	 * hole).  Finally they're rounded up so that the low bits of the size
+	 * are free for the boundary tag flags.
+	 */
+	required = size + sizeof(struct memory_block) + HEAP_MAGIC_SIZE;
+	required = (required + HEAP_BLOCK_FLAGS) & ~HEAP_BLOCK_FLAGS;
+	if (required < size) {
+		/*
+		 * The request was so large that the sum wrapped around.  Ask
+		 * for the largest possible size instead, which will fail.
+		 */
+		required = ~(addr_t)0;
+	} else if (required < HEAP_MIN_HOLE_SIZE) {
+		required = HEAP_MIN_HOLE_SIZE;
 	}
-	
+
 	spinlock_lock(&heap_lock);
 
 	/*
-	 * Scan the list of all available memory holes and find the smallest
-	 * one that meets our requirement.  We have an early out from this scan
-	 * if we find a hole that *exactly* matches our needs.
+	 * Find the first non-empty list whose holes are all large enough.
 	 */
-	mh = first_hole;
-	mhprev = &first_hole;
-	while (mh) {
-        	if (mh->mh_size == required) {
-        		use = mh;
-        		useprev = mhprev;
-        		break;
-        	} else if (mh->mh_size > required) {
-        		if (!use || (use->mh_size > mh->mh_size)) {
-        			use = mh;
-        			useprev = mhprev;
-        		}
-        	}
-			
-		mhprev = &mh->mh_next;
-		mh = mh->mh_next;
-	}
+	mapping_search(required, &fl, &sl);
+	use = find_suitable_hole(&fl, &sl);
 
-        /*
-         * Did we find any space available?  If yes, then remove a chunk of it
-         * and, if we can, release any of what's left as a new hole.  If we can't
-         * release any then allocate more than was requested and remove this
-         * hole from the hole list.
-         */
-        if (use) {
-        	struct memory_block *mb;
-        	
-        	if ((use->mh_size - required) > (sizeof(union memory_union) + 1 + (HEAP_DEBUG ? sizeof(fast_u16_t) : 0))) {
-        		struct memory_hole *new_hole = (struct memory_hole *)((addr_t)use + required);
-        		new_hole->mh_size = use->mh_size - required;
-        		new_hole->mh_next = use->mh_next;
-        		*useprev = new_hole;
-			if (HEAP_DEBUG) {
-				magic = (fast_u16_t *)(new_hole + 1);
-				*magic = MEMORY_HOLE_MAGIC;
+	/*
+	 * Did we find any space available?  If yes, then remove a chunk of it
+	 * and, if we can, release any of what's left as a new hole.  If we
+	 * can't release any then allocate more than was requested.
+	 */
+	if (use) {
+		if (HEAP_DEBUG) {
+			magic = (fast_u16_t *)(use + 1);
+			if (*magic != MEMORY_HOLE_MAGIC) {
+				debug_stop();
+				do {
+					debug_print_pstr("\fheap_alloc: bad hole: ");
+					debug_print_addr((addr_t)use);
+					debug_wait_button();
+					debug_stack_trace();
+				} while (debug_cycle());
 			}
-        	} else {
-        		required = use->mh_size;
-        		*useprev = use->mh_next;
-        	}
+		}
+
+		remove_hole(use, fl, sl);
 
-        	mb = (struct memory_block *)use;
-        	mb->mb_size = required;
+		mb = (struct memory_block *)use;
+		use_size = mb->mb_size & ~HEAP_BLOCK_FLAGS;
+		next = next_phys(mb);
+
+		if ((use_size - required) >= HEAP_MIN_HOLE_SIZE) {
+			struct memory_hole *new_hole = (struct memory_hole *)((addr_t)use + required);
+			new_hole->mh_size = (use_size - required) | HEAP_BLOCK_FREE;
+			new_hole->mh_prev_phys = use;
+			next->mb_prev_phys = (struct memory_block *)new_hole;
+			insert_hole(new_hole);
+		} else {
+			required = use_size;
+			next->mb_size &= ~HEAP_BLOCK_PREV_FREE;
+		}
+
+		mb->mb_size = required | (mb->mb_size & HEAP_BLOCK_PREV_FREE);
 		magic = (fast_u16_t *)(mb + 1);
 		if (HEAP_DEBUG) {
 			*magic++ = MEMORY_BLOCK_MAGIC;
 		}
-        	
-        	block = (void *)magic;
-	
+
+		block = (void *)magic;
+
 		free_ram -= required;
 	} else if (DEBUG) {
 		debug_stop();
@@ -149,10 +351,10 @@ void *heap_alloc(addr_t size)
 			debug_wait_button();
 			debug_stack_trace();
 		} while (debug_cycle());
-        }
+	}
 
 	spinlock_unlock(&heap_lock);
-	
+
 	return block;
 }
 
@@ -162,14 +364,14 @@ void *heap_alloc(addr_t size)
  */
 void heap_free(void *block)
 {
-	struct memory_block *mb;
-        struct memory_hole *mh, **mhprev;
-        struct memory_hole *new_hole;
-        fast_u16_t *magic;
-                        	
+	struct memory_block *mb, *next;
+	struct memory_hole *new_hole;
+	addr_t size;
+	fast_u16_t *magic;
+
 	magic = block;
-        if (HEAP_DEBUG) {
-        	magic--;
+	if (HEAP_DEBUG) {
+		magic--;
 		if (*magic != MEMORY_BLOCK_MAGIC) {
 			debug_stop();
 			do {
@@ -179,61 +381,58 @@ void heap_free(void *block)
 				debug_stack_trace();
 			} while (debug_cycle());
 		}
-        }
-		
+	}
+
 	mb = ((struct memory_block *)magic) - 1;
-		
+
 	spinlock_lock(&heap_lock);
 
-	free_ram += mb->mb_size;
-		
+	if (HEAP_DEBUG) {
+		if (mb->mb_size & HEAP_BLOCK_FREE) {
+			debug_stop();
+			do {
+				debug_print_pstr("\fheap_free: already free: ");
+				debug_print_addr((addr_t)block);
+				debug_wait_button();
+				debug_stack_trace();
+			} while (debug_cycle());
+		}
+	}
+
+	size = mb->mb_size & ~HEAP_BLOCK_FLAGS;
+	free_ram += size;
+
 	/*
-	 * Convert our block into a hole.
+	 * Merge with the physically preceding hole, if there is one.
 	 */
-       	new_hole = (struct memory_hole *)mb;
-	if (HEAP_DEBUG) {
-		magic = (fast_u16_t *)(new_hole + 1);
-		*magic = MEMORY_HOLE_MAGIC;
+	new_hole = (struct memory_hole *)mb;
+	if (mb->mb_size & HEAP_BLOCK_PREV_FREE) {
+		struct memory_hole *prev = (struct memory_hole *)mb->mb_prev_phys;
+
+		unlink_hole(prev);
+		size += prev->mh_size & ~HEAP_BLOCK_FLAGS;
+		new_hole = prev;
 	}
-	
+
 	/*
-	 * Stroll through the hole list and see if this newly freed block can
-	 * be merged with anything else to form a larger space.  Whatever
-	 * happens, we still ensure that the list is ordered lowest-addressed
-	 * -hole first through to highest-addressed-hole last.
+	 * Merge with the physically following hole, if there is one.
 	 */
-        mh = first_hole;
-        mhprev = &first_hole;
-        while (mh) {
-        	if (((addr_t)mh + mh->mh_size) == (addr_t)mb) {
-        		mh->mh_size += mb->mb_size;
-        		if (((addr_t)mh + mh->mh_size) == (addr_t)mh->mh_next) {
-        			mh->mh_size += mh->mh_next->mh_size;
-        			mh->mh_next = mh->mh_next->mh_next;
-        		}
-       			break;
-        	}
-
-		if ((addr_t)mh > (addr_t)mb) {
-        		*mhprev = new_hole;
-        		if (((addr_t)new_hole + new_hole->mh_size) == (addr_t)mh) {
-        			new_hole->mh_size += mh->mh_size;
-        			new_hole->mh_next = mh->mh_next;
-        		} else {
-	        		new_hole->mh_next = mh;
-        		}
-       			break;
-        	}
-        	
-        	mhprev = &mh->mh_next;
-        	mh = mh->mh_next;
-        }
-
-	if (!mh) {
-		new_hole->mh_next = mh;
-		*mhprev = new_hole;
+	next = next_phys(mb);
+	if (next->mb_size & HEAP_BLOCK_FREE) {
+		unlink_hole((struct memory_hole *)next);
+		size += next->mb_size & ~HEAP_BLOCK_FLAGS;
+		next = next_phys(next);
 	}
 
+	/*
+	 * Whatever we've ended up with is now a hole, and the next block needs
+	 * to know that this is so.
+	 */
+	new_hole->mh_size = size | HEAP_BLOCK_FREE | (new_hole->mh_size & HEAP_BLOCK_PREV_FREE);
+	next->mb_prev_phys = (struct memory_block *)new_hole;
+	next->mb_size |= HEAP_BLOCK_PREV_FREE;
+	insert_hole(new_hole);
+
 	spinlock_unlock(&heap_lock);
 }
 
@@ -244,7 +443,7 @@ void heap_free(void *block)
 addr_t heap_get_free(void)
 {
 	addr_t ret;
-	
+
 	spinlock_lock(&heap_lock);
 	ret = free_ram;
 	spinlock_unlock(&heap_lock);
@@ -254,23 +453,31 @@ addr_t heap_get_free(void)
 
 /*
  * heap_dump_stats()
+ *
+ * Holes are reported smallest size class first.  For each hole the address
+ * is returned in mh_next and its size in mh_size.
  */
 int heap_dump_stats(struct memory_hole *mbuf, int max)
 {
 	struct memory_hole *mh;
-        int ct = 0;
-		
+	int ct = 0;
+	int fl, sl;
+
 	spinlock_lock(&heap_lock);
 
-	mh = first_hole;
-	while (mh && (ct < max)) {
-		mbuf->mh_next = mh;
-		mbuf->mh_size = mh->mh_size;
-		mbuf++;
-		ct++;
-		mh = mh->mh_next;
+	for (fl = 0; fl < HEAP_FL_INDEX_COUNT; fl++) {
+		for (sl = 0; sl < HEAP_SL_INDEX_COUNT; sl++) {
+			mh = hole_lists[fl][sl];
+			while (mh && (ct < max)) {
+				mbuf->mh_next = mh;
+				mbuf->mh_size = mh->mh_size & ~HEAP_BLOCK_FLAGS;
+				mbuf++;
+				ct++;
+				mh = mh->mh_next;
+			}
+		}
 	}
-	
+
 	spinlock_unlock(&heap_lock);
 
 	return ct;
@@ -282,20 +489,34 @@ int heap_dump_stats(struct memory_hole *mbuf, int max)
  *
  * Adding new space to the heap is just a case of fooling the heap_free()
  * function into believing that the new space was previously allocated.  All we
- * have to do is forge an "alloc"'d block!
+ * have to do is forge an "alloc"'d block, plus a sentinel block at the end of
+ * the region so that nothing ever tries to merge beyond it!
  */
 void heap_add(addr_t addr, addr_t sz)
 {
-	struct memory_block *mb;
-        fast_u16_t *magic;
+	struct memory_block *mb, *sentinel;
+	addr_t end;
+	fast_u16_t *magic;
+
+	end = (addr + sz) & ~HEAP_BLOCK_FLAGS;
+	addr = (addr + HEAP_BLOCK_FLAGS) & ~HEAP_BLOCK_FLAGS;
+	if ((end - addr) < (HEAP_MIN_HOLE_SIZE + sizeof(struct memory_block))) {
+		return;
+	}
+
+	sentinel = ((struct memory_block *)end) - 1;
 
 	mb = (struct memory_block *)addr;
-	mb->mb_size = sz;
-        magic = (fast_u16_t *)(mb + 1);
-	
+	mb->mb_size = (addr_t)sentinel - addr;
+	mb->mb_prev_phys = NULL;
+
+	sentinel->mb_size = 0;
+	sentinel->mb_prev_phys = mb;
+
+	magic = (fast_u16_t *)(mb + 1);
 	if (HEAP_DEBUG) {
 		*magic++ = MEMORY_BLOCK_MAGIC;
 	}
-	
+
 	heap_free(magic);
 }
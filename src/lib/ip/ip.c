@@ -21,34 +21,78 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
+#include "heap.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "timer.h"
+#include "oneshot.h"
 #include "ip_datalink.h"
+#include "ip_route.h"
 #include "ip.h"
 #include "ipcsum.h"
 
 void icmp_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t type, u8_t code, u8_t *extra, struct netbuf *nb);
 void ip_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t protocol, struct netbuf *nb);
+static void ip_output_netbuf(struct ip_instance *ii, struct netbuf *nb);
+
+/*
+ * List of all of the IP instances (used to find the one to forward packets
+ * through) and a lock to protect it.
+ */
+static struct ip_instance *ip_instance_list = NULL;
+static struct lock ip_instance_list_lock = {0, 0x18, 0xff};
 
 /*
  * icmp_recv_netbuf_echo_request()
+ *	Answer an ICMP echo request.
+ *
+ * Where we can, we turn the request around in place and send the same
+ * netbuf back: the addresses are swapped and the ICMP checksum is updated
+ * for the new type (RFC1624) rather than recalculated, so the payload is
+ * never touched.  That's only possible if nobody else can see the packet
+ * data and its IP header has no options.  Otherwise we have to copy it,
+ * which we won't do if memory is short.
  */
 static void icmp_recv_netbuf_echo_request(struct ip_instance *ii, struct netbuf *nb)
 {
         struct ip_header *iph;
         struct icmp_header *ich;
 	struct netbuf *nbrep;
+	u16_t old;
 	
 	iph = nb->nb_network;
 	ich = nb->nb_transport;
 
+	if ((nb->nb_data_membuf == nb) && (netbuf_get_refs(nb) == 1)
+			&& (iph->ih_header_len == (sizeof(struct ip_header) / 4))) {
+		old = *((u16_t *)ich);
+		ich->ich_type = 0x00;
+		ich->ich_csum = ipcsum_add(ipcsum_sub(ich->ich_csum ^ 0xffff, old), *((u16_t *)ich)) ^ 0xffff;
+
+		iph->ih_dest_addr = iph->ih_src_addr;
+		iph->ih_src_addr = hton32(ii->ii_addr);
+		iph->ih_time_to_live = 0x40;
+		iph->ih_type_of_service = 0x00;
+		iph->ih_ident = hton16(ii->ii_pkt_ident++);
+		iph->ih_frag = 0;
+		iph->ih_header_csum = 0x0000;
+
+		nb->nb_rx_csum_start = NULL;
+		netbuf_reclaim_headroom(nb);
+
+		ip_output_netbuf(ii, nb);
+		return;
+	}
+
+	if (heap_get_free() < ICMP_ECHO_MIN_FREE) {
+		return;
+	}
+
 	/*
 	 * Issue an ICMP echo reply.
 	 */	
-	nbrep = netbuf_alloc();
-	nbrep->nb_application_membuf = membuf_alloc(nb->nb_application_size, NULL);
-        nbrep->nb_application = nbrep->nb_application_membuf;
-        nbrep->nb_application_size = nb->nb_application_size;
+	nbrep = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_application_size);
 
 	memcpy(nbrep->nb_application, nb->nb_application, nb->nb_application_size);
 
@@ -72,12 +116,8 @@ static void icmp_recv_netbuf_notify_transport(struct ip_instance *ii, struct net
 
 	spinlock_lock(&ii->ii_lock);
 
-	ic = ii->ii_client_list;
-	while (ic && (ic->ic_protocol != iph->ih_protocol)) {
-		ic = ic->ic_next;
-	}
-
-	if (ic && (ic->ic_recv_icmp)) {
+	ic = ii->ii_protocol_table[iph->ih_protocol & IP_PROTOCOL_TABLE_MASK];
+	if (ic && (ic->ic_protocol == iph->ih_protocol) && (ic->ic_recv_icmp)) {
 		ip_client_ref(ic);
 		spinlock_unlock(&ii->ii_lock);
 		ic->ic_recv_icmp(ic, nb);
@@ -96,13 +136,13 @@ void icmp_recv_netbuf_default(struct ip_instance *ii, struct netbuf *nb)
 	struct icmp_client *ic;
 	struct icmp_header *ich = (struct icmp_header *)nb->nb_transport;
 	
-	spinlock_lock(&ii->ii_lock);
-
-	ic = ii->ii_icmp_client_list;
-	while (ic && (ic->ic_type != ich->ich_type)) {
-		ic = ic->ic_next;
+	if (ich->ich_type >= ICMP_TYPE_TABLE_SIZE) {
+		return;
 	}
 
+	spinlock_lock(&ii->ii_lock);
+
+	ic = ii->ii_icmp_type_table[ich->ich_type];
 	if (ic) {
 		icmp_client_ref(ic);
 		spinlock_unlock(&ii->ii_lock);
@@ -122,11 +162,15 @@ void icmp_recv_netbuf(struct ip_instance *ii, struct netbuf *nb)
 	
 	ich = (struct icmp_header *)nb->nb_transport;
 
+	if (nb->nb_transport_size < 8) {
+		return;
+	}
+
 	/*
 	 * If we have a checksum then check it.
 	 */
 	if (ich->ich_csum) {
-		if (ipcsum(0, nb->nb_transport, nb->nb_transport_size) != 0x0000) {
+		if (ipcsum_netbuf_partial(0, nb, nb->nb_transport, nb->nb_transport_size) != 0xffff) {
 			debug_print_pstr("\n\ricmp rx cs fail");
 			return;
 		}
@@ -176,11 +220,7 @@ void icmp_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t type, u8_t
 	struct icmp_header *ich;
 	u16_t csum;
 
-	nb->nb_transport_membuf = membuf_alloc(8, NULL);
-	nb->nb_transport = nb->nb_transport_membuf;
-	nb->nb_transport_size = 8;
-
-	ich = (struct icmp_header *)nb->nb_transport;
+	ich = (struct icmp_header *)netbuf_push_transport(nb, 8);
 	ich->ich_type = type;
 	ich->ich_code = code;
 	ich->ich_csum = 0x0000;
@@ -192,6 +232,58 @@ void icmp_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t type, u8_t
 	ip_issue_netbuf(ii, dest_addr, 0x01, nb);
 }
 
+/*
+ * icmp_issue_error()
+ *	Send an ICMP error message about a packet that we've received.
+ *
+ * The message quotes the packet's IP header and the first 8 bytes of its
+ * data (RFC792).  "extra" is the second word of the ICMP header, in network
+ * byte order.  In accordance with RFC1122 we don't send errors about ICMP
+ * errors, about fragments other than the first, or about packets that
+ * weren't sent to a single host.
+ */
+static void icmp_issue_error(struct ip_instance *ii, struct netbuf *nb, u8_t type, u8_t code, u32_t extra)
+{
+	struct ip_header *iph;
+	struct icmp_header *ich;
+	struct netbuf *nbrep;
+	addr_t hlen, dlen;
+	u32_t src;
+
+	iph = (struct ip_header *)nb->nb_network;
+	hlen = iph->ih_header_len * 4;
+	dlen = hton16(iph->ih_total_len) - hlen;
+
+	if (hton16(iph->ih_frag) & IP_FRAG_OFFS) {
+		return;
+	}
+
+	src = hton32(iph->ih_src_addr);
+	if ((src == 0) || ((src & 0xf0000000) == 0xe0000000) || (src == 0xffffffff)) {
+		return;
+	}
+
+	if (iph->ih_protocol == 0x01) {
+		ich = (struct icmp_header *)((u8_t *)iph + hlen);
+		if ((dlen < sizeof(struct icmp_header))
+				|| ((ich->ich_type != 0x00) && (ich->ich_type != 0x08)
+					&& (ich->ich_type != 0x0d) && (ich->ich_type != 0x0e))) {
+			return;
+		}
+	}
+
+	if (dlen > 8) {
+		dlen = 8;
+	}
+
+	nbrep = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, hlen + dlen);
+	memcpy(nbrep->nb_application, iph, hlen + dlen);
+
+	icmp_issue_netbuf(ii, iph->ih_src_addr, type, code, (u8_t *)(&extra), nbrep);
+
+	netbuf_deref(nbrep);
+}
+
 /*
  * icmp_send_netbuf()
  *	Send an ICMP netbuf.
@@ -244,7 +336,6 @@ struct icmp_client *icmp_client_alloc(void)
 struct icmp_server *icmp_client_attach(struct ip_instance *ii, struct icmp_client *ic)
 {
 	struct icmp_server *is = NULL;
-        struct icmp_client *p;
 
 	/*
 	 * Before we do anything, check if we allow our client to hook the
@@ -258,21 +349,15 @@ struct icmp_server *icmp_client_attach(struct ip_instance *ii, struct icmp_clien
 	spinlock_lock(&ii->ii_lock);
 
 	/*
-	 * Walk the list of clients and check that we can do this request.
+	 * Check that nobody else has already hooked this type.
 	 */
-	p = ii->ii_icmp_client_list;
-	while (p && (p->ic_type != ic->ic_type)) {
-		p = p->ic_next;
-	}
-
-	if (!p) {
+	if (!ii->ii_icmp_type_table[ic->ic_type]) {
 		is = icmp_server_alloc();
 		is->is_instance = ii;
                 ip_instance_ref(ii);
 
 		ic->ic_server = is;
-		ic->ic_next = ii->ii_icmp_client_list;
-		ii->ii_icmp_client_list = ic;
+		ii->ii_icmp_type_table[ic->ic_type] = ic;
 		icmp_client_ref(ic);
 	}
 				
@@ -288,70 +373,871 @@ struct icmp_server *icmp_client_attach(struct ip_instance *ii, struct icmp_clien
 void icmp_client_detach(struct ip_instance *ii, struct icmp_server *is)
 {
         struct icmp_client *ic;
-        struct icmp_client **icprev;
+	u16_t i;
 	
 	spinlock_lock(&ii->ii_lock);
 
 	/*
-	 * Walk the list of clients and find the one we're to remove.
+	 * Find the table entry that we're to remove.
 	 */
-	ic = ii->ii_icmp_client_list;
-	icprev = &ii->ii_icmp_client_list;
-	while (ic) {
-		if (ic->ic_server == is) {
-			*icprev = ic->ic_next;
+	for (i = 0; i < ICMP_TYPE_TABLE_SIZE; i++) {
+		ic = ii->ii_icmp_type_table[i];
+		if (ic && (ic->ic_server == is)) {
+			ii->ii_icmp_type_table[i] = NULL;
 			icmp_server_deref(is);
 			ip_instance_deref(ii);
 			icmp_client_deref(ic);
 			break;
 		}
-	
-		icprev = &ic->ic_next;
-		ic = ic->ic_next;
 	}
 			
 	spinlock_unlock(&ii->ii_lock);
 }
 
 /*
- * ip_recv_netbuf()
+ * Piece of a packet's data, used when we split the packet into fragments.
  */
-void ip_recv_netbuf(void *clnt, struct netbuf *nb)
+struct ip_frag_piece {
+	u8_t *ifp_data;			/* Start of the data */
+	addr_t ifp_size;		/* Number of bytes of data */
+	void *ifp_membuf;		/* Membuf that holds the data (NULL if it's the netbuf's inline data) */
+};
+
+/*
+ * ip_frag_copy_options()
+ *	Build the options for the second and later fragments of a packet.
+ *
+ * Only the options that have their "copied" flag set go in every fragment
+ * (RFC791).  The result is padded to a multiple of 4 bytes and its length is
+ * returned.
+ */
+static u8_t ip_frag_copy_options(u8_t *dest, u8_t *opts, u8_t len)
+{
+	u8_t i, n, sz;
+
+	i = 0;
+	n = 0;
+	while (i < len) {
+		if (opts[i] == 0x00) {
+			break;
+		}
+
+		if (opts[i] == 0x01) {
+			i++;
+			continue;
+		}
+
+		if ((i + 1) >= len) {
+			break;
+		}
+
+		sz = opts[i + 1];
+		if ((sz < 2) || ((i + sz) > len)) {
+			break;
+		}
+
+		if (opts[i] & 0x80) {
+			memcpy(dest + n, opts + i, sz);
+			n += sz;
+		}
+
+		i += sz;
+	}
+
+	while (n & 0x03) {
+		dest[n++] = 0x00;
+	}
+
+	return n;
+}
+
+/*
+ * ip_frag_fill()
+ *	Point a fragment's netbuf at its share of the original packet's data.
+ *
+ * The data isn't copied; the fragment takes references to the membufs that
+ * hold it instead.  A fragment may straddle two pieces of the original (its
+ * transport header and application data) so we use its transport and
+ * application layers to describe up to two slices.
+ */
+static void ip_frag_fill(struct netbuf *fnb, struct netbuf *nb, struct ip_frag_piece *pieces, u8_t npieces, addr_t offs, addr_t size)
+{
+	struct ip_frag_piece slice[2];
+	addr_t sz;
+	u8_t i, n;
+
+	n = 0;
+	for (i = 0; (i < npieces) && size; i++) {
+		if (offs >= pieces[i].ifp_size) {
+			offs -= pieces[i].ifp_size;
+			continue;
+		}
+
+		sz = pieces[i].ifp_size - offs;
+		if (sz > size) {
+			sz = size;
+		}
+
+		slice[n].ifp_data = pieces[i].ifp_data + offs;
+		slice[n].ifp_size = sz;
+		slice[n].ifp_membuf = pieces[i].ifp_membuf;
+		n++;
+
+		offs = 0;
+		size -= sz;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (slice[i].ifp_membuf) {
+			membuf_ref(slice[i].ifp_membuf);
+		} else if (!fnb->nb_data_membuf) {
+			fnb->nb_data_membuf = nb->nb_data_membuf;
+			membuf_ref(fnb->nb_data_membuf);
+		}
+	}
+
+	fnb->nb_transport_membuf = slice[0].ifp_membuf;
+	fnb->nb_transport = slice[0].ifp_data;
+	fnb->nb_transport_size = slice[0].ifp_size;
+
+	if (n > 1) {
+		fnb->nb_application_membuf = slice[1].ifp_membuf;
+		fnb->nb_application = slice[1].ifp_data;
+		fnb->nb_application_size = slice[1].ifp_size;
+	}
+}
+
+/*
+ * ip_frag_add_piece()
+ *	Add a layer of a packet to the list of pieces to be fragmented.
+ */
+static void ip_frag_add_piece(struct ip_frag_piece *pieces, u8_t *npieces, struct netbuf *nb, void *data, addr_t size, void *membuf)
+{
+	if (!size) {
+		return;
+	}
+
+	/*
+	 * Layers that were pushed into headroom live in the application
+	 * layer's membuf.
+	 */
+	if (!membuf && nb->nb_headroom) {
+		membuf = nb->nb_application_membuf;
+	}
+
+	pieces[*npieces].ifp_data = (u8_t *)data;
+	pieces[*npieces].ifp_size = size;
+	pieces[*npieces].ifp_membuf = membuf;
+	(*npieces)++;
+}
+
+/*
+ * ip_fragment_netbuf()
+ *	Send a packet that's too large for the datalink as a series of fragments.
+ *
+ * The IP header must be complete apart from its checksum.  The data either
+ * follows the header in the network layer (a packet that we're forwarding)
+ * or is in the transport and application layers (one of our own).  Each
+ * fragment gets its own header but shares the original packet's data.
+ *
+ * Returns FALSE if the MTU is too small for the packet to be fragmented.
+ */
+static u8_t ip_fragment_netbuf(struct ip_datalink_server *ids, struct netbuf *nb, u16_t mtu)
+{
+	struct ip_header *iph, *fiph;
+	struct ip_frag_piece pieces[2];
+	struct netbuf *fnb;
+	u8_t opts[40];
+	u8_t hlen, fhlen, optlen, npieces;
+	u16_t frag, more, offs, len, flen, max;
+
+	iph = (struct ip_header *)nb->nb_network;
+	hlen = iph->ih_header_len * 4;
+	len = hton16(iph->ih_total_len) - hlen;
+	frag = hton16(iph->ih_frag);
+
+	if (mtu < (hlen + 8)) {
+		return FALSE;
+	}
+
+	optlen = ip_frag_copy_options(opts, (u8_t *)(iph + 1), hlen - sizeof(struct ip_header));
+
+	npieces = 0;
+	if (nb->nb_network_size > hlen) {
+		ip_frag_add_piece(pieces, &npieces, nb, (u8_t *)iph + hlen,
+				nb->nb_network_size - hlen, nb->nb_network_membuf);
+	} else {
+		ip_frag_add_piece(pieces, &npieces, nb, nb->nb_transport,
+				nb->nb_transport_size, nb->nb_transport_membuf);
+		ip_frag_add_piece(pieces, &npieces, nb, nb->nb_application,
+				nb->nb_application_size, nb->nb_application_membuf);
+	}
+
+	offs = 0;
+	fhlen = hlen;
+	while (offs < len) {
+		flen = len - offs;
+		more = frag & IP_FRAG_MF;
+		max = (mtu - fhlen) & ~0x07;
+		if (flen > max) {
+			flen = max;
+			more = IP_FRAG_MF;
+		}
+
+		fnb = netbuf_alloc();
+		fnb->nb_dst_cache = nb->nb_dst_cache;
+		ip_frag_fill(fnb, nb, pieces, npieces, offs, flen);
+
+		fiph = (struct ip_header *)netbuf_push_network(fnb, fhlen);
+		memcpy(fiph, iph, sizeof(struct ip_header));
+		if (offs == 0) {
+			memcpy(fiph + 1, iph + 1, hlen - sizeof(struct ip_header));
+		} else {
+			memcpy(fiph + 1, opts, optlen);
+		}
+		fiph->ih_header_len = fhlen / 4;
+		fiph->ih_total_len = hton16(fhlen + flen);
+		fiph->ih_frag = hton16(((frag & IP_FRAG_OFFS) + (offs >> 3)) | more);
+		fiph->ih_header_csum = 0x0000;
+		fiph->ih_header_csum = ipcsum(0, fiph, fhlen);
+
+		ids->ids_send(ids, fnb);
+		netbuf_deref(fnb);
+
+		offs += flen;
+		fhlen = sizeof(struct ip_header) + optlen;
+	}
+
+	return TRUE;
+}
+
+/*
+ * ip_forward_count()
+ *	Count a received packet that we forwarded or dropped.
+ */
+static void ip_forward_count(struct ip_instance *ii, u8_t forwarded)
+{
+	spinlock_lock(&ii->ii_lock);
+
+	if (forwarded) {
+		ii->ii_forwarded++;
+	} else {
+		ii->ii_forward_drops++;
+	}
+
+	spinlock_unlock(&ii->ii_lock);
+}
+
+/*
+ * ip_instance_find_datalink()
+ *	Find the IP instance that's attached to a datalink instance.
+ *
+ * If one is found then it's returned with a reference held.
+ */
+static struct ip_instance *ip_instance_find_datalink(struct ip_datalink_instance *idi)
+{
+	struct ip_instance *ii;
+
+	spinlock_lock(&ip_instance_list_lock);
+
+	ii = ip_instance_list;
+	while (ii && (ii->ii_idi != idi)) {
+		ii = ii->ii_next;
+	}
+
+	if (ii) {
+		ip_instance_ref(ii);
+	}
+
+	spinlock_unlock(&ip_instance_list_lock);
+
+	return ii;
+}
+
+/*
+ * ip_addr_is_local()
+ *	Check whether an address belongs to any of our IP instances.
+ */
+static u8_t ip_addr_is_local(u32_t addr)
 {
-	struct ip_datalink_client *idc;
 	struct ip_instance *ii;
+
+	spinlock_lock(&ip_instance_list_lock);
+
+	ii = ip_instance_list;
+	while (ii && (ii->ii_addr != addr)) {
+		ii = ii->ii_next;
+	}
+
+	spinlock_unlock(&ip_instance_list_lock);
+
+	return ii ? TRUE : FALSE;
+}
+
+/*
+ * ip_forward_netbuf()
+ *	Forward a packet that isn't for us.
+ *
+ * We pick the outgoing interface from the routing table and hand it the
+ * netbuf that we received, so the packet data is never copied.  The only
+ * change that we make is to decrement the TTL, updating the header checksum
+ * to match (RFC1624) rather than recalculating it.  Packets that are too
+ * large for the outgoing interface are fragmented unless their sender has
+ * asked us not to.
+ */
+static void ip_forward_netbuf(struct ip_instance *ii, struct netbuf *nb)
+{
 	struct ip_header *iph;
-	struct ip_client *ic;
-	u32_t empty = 0;
-	
-	idc = (struct ip_datalink_client *)clnt;
-	ii = (struct ip_instance *)idc->idc_instance;
-		
-	iph = nb->nb_network;
-		
+	struct ip_instance *out;
+	struct ip_datalink_server *ids;
+	struct ip_route rt;
+	u16_t *ttl_word;
+	u16_t old, len;
+	u32_t dest;
+	u8_t forwarded;
+
+	iph = (struct ip_header *)nb->nb_network;
+	dest = hton32(iph->ih_dest_addr);
+	len = hton16(iph->ih_total_len);
+
 	/*
-	 * We're only dealing with v4 IP here.
+	 * We only forward to single hosts, and only packets that make sense.
 	 */
-	if (iph->ih_version != 4) {
+	if ((dest == 0xffffffff) || ((dest & 0xf0000000) == 0xe0000000)
+			|| (iph->ih_header_len < 5) || (len < (iph->ih_header_len * 4))
+			|| (len > nb->nb_network_size)) {
+		ip_forward_count(ii, FALSE);
+		return;
+	}
+
+	if (iph->ih_time_to_live <= 1) {
+		icmp_issue_error(ii, nb, 0x0b, 0x00, 0);
+		ip_forward_count(ii, FALSE);
+		return;
+	}
+
+	if (!ip_route_find(dest, &rt)) {
+		icmp_issue_error(ii, nb, 0x03, 0x00, 0);
+		ip_forward_count(ii, FALSE);
 		return;
 	}
 
 	/*
-	 * If we have a header checksum then check it.
+	 * A directed broadcast for one of the networks that we're attached to
+	 * is one that we'd receive ourselves, so we don't pass it on (RFC1812
+	 * para 5.3.5.2 lets us choose not to).
 	 */
-	if (iph->ih_header_csum) {
-		if (ipcsum(0, iph, iph->ih_header_len * 4) != 0x0000) {
-			return;
-		}
+	if (!rt.ir_gateway && (rt.ir_prefix_len < 31)
+			&& ((dest | (0xffffffff >> rt.ir_prefix_len)) == dest)) {
+		ip_forward_count(ii, FALSE);
+		return;
+	}
+
+	out = ip_instance_find_datalink(rt.ir_idi);
+	if (!out) {
+		icmp_issue_error(ii, nb, 0x03, 0x01, 0);
+		ip_forward_count(ii, FALSE);
+		return;
 	}
 
 	/*
-	 * Check that we have a match on the IP address.
+	 * We never send a packet back out of the interface that it arrived
+	 * on.  Instead we tell the sender which next hop it should have used
+	 * (a host redirect) and drop the packet.
 	 */
-	if (hton32(iph->ih_dest_addr) != ii->ii_addr) {
+	if (out == ii) {
+		icmp_issue_error(ii, nb, 0x05, 0x01, hton32(rt.ir_gateway ? rt.ir_gateway : dest));
+		ip_instance_deref(out);
+		ip_forward_count(ii, FALSE);
+		return;
+	}
+
+	if (!out->ii_forward) {
+		icmp_issue_error(ii, nb, 0x03, 0x0d, 0);
+		ip_instance_deref(out);
+		ip_forward_count(ii, FALSE);
+		return;
+	}
+
+	if ((len > rt.ir_idi->idi_mtu) && (hton16(iph->ih_frag) & IP_FRAG_DF)) {
+		icmp_issue_error(ii, nb, 0x03, 0x04, hton32((u32_t)rt.ir_idi->idi_mtu));
+		ip_instance_deref(out);
+		ip_forward_count(ii, FALSE);
 		return;
 	}
 
+	/*
+	 * Trim off any datalink padding and decrement the TTL.  The TTL shares
+	 * a 16 bit word with the protocol number.
+	 */
+	nb->nb_network_size = len;
+	nb->nb_transport = NULL;
+	nb->nb_transport_size = 0;
+	nb->nb_application = NULL;
+	nb->nb_application_size = 0;
+	nb->nb_rx_csum_start = NULL;
+
+	ttl_word = (u16_t *)&iph->ih_time_to_live;
+	old = *ttl_word;
+	iph->ih_time_to_live--;
+	iph->ih_header_csum = ipcsum_add(ipcsum_sub(iph->ih_header_csum ^ 0xffff, old), *ttl_word) ^ 0xffff;
+
+	spinlock_lock(&out->ii_lock);
+	ids = out->ii_server;
+	ip_datalink_server_ref(ids);
+	spinlock_unlock(&out->ii_lock);
+
+	if (len > rt.ir_idi->idi_mtu) {
+		forwarded = ip_fragment_netbuf(ids, nb, rt.ir_idi->idi_mtu);
+	} else {
+		ids->ids_send(ids, nb);
+		forwarded = TRUE;
+	}
+
+	ip_datalink_server_deref(ids);
+	ip_instance_deref(out);
+	ip_forward_count(ii, forwarded);
+}
+
+#if defined(IP_REASS)
+/*
+ * ip_frag_offs()
+ *	Get the offset of a received fragment's data within its datagram.
+ */
+static u16_t ip_frag_offs(struct netbuf *nb)
+{
+	struct ip_header *iph;
+
+	iph = (struct ip_header *)nb->nb_network;
+	return (hton16(iph->ih_frag) & IP_FRAG_OFFS) << 3;
+}
+
+/*
+ * ip_frag_len()
+ *	Get the length of a received fragment's data.
+ */
+static u16_t ip_frag_len(struct netbuf *nb)
+{
+	struct ip_header *iph;
+
+	iph = (struct ip_header *)nb->nb_network;
+	return hton16(iph->ih_total_len) - (iph->ih_header_len * 4);
+}
+
+/*
+ * ip_frag_mem()
+ *	Get the memory that holding on to a received fragment ties up.
+ *
+ * Most receive paths hand us netbufs with their packet data inline, in
+ * storage that's sized for the largest frame that the datalink can receive
+ * (see netbuf_alloc_with_data()), so we charge for the whole of that rather
+ * than just for the fragment.
+ */
+static addr_t ip_frag_mem(struct netbuf *nb)
+{
+	struct netbuf *data;
+	addr_t mem;
+
+	mem = sizeof(struct membuf) + sizeof(struct netbuf);
+
+	data = (struct netbuf *)nb->nb_data_membuf;
+	if (!data) {
+		return mem + nb->nb_datalink_size + nb->nb_network_size;
+	}
+
+	mem += data->nb_data_size;
+	if (data != nb) {
+		mem += sizeof(struct membuf) + sizeof(struct netbuf);
+	}
+
+	return mem;
+}
+
+/*
+ * ip_reass_unlink()
+ *	Remove a datagram from the list of those being reassembled.
+ *
+ * The datagram's fragments are left for the caller to release (see
+ * ip_reass_free()) once the instance lock has been dropped.
+ *
+ * It is assumed that the instance lock is held on entry to this function.
+ */
+static void ip_reass_unlink(struct ip_instance *ii, struct ip_reass *ira)
+{
+	struct ip_reass **prev;
+
+	prev = &ii->ii_reass_list;
+	while (*prev != ira) {
+		prev = &(*prev)->ira_next;
+	}
+	*prev = ira->ira_next;
+	ira->ira_next = NULL;
+
+	ii->ii_reass_mem -= ira->ira_mem;
+	ii->ii_reass_count--;
+}
+
+/*
+ * ip_reass_free()
+ *	Release a list of datagrams that have been unlinked.
+ */
+static void ip_reass_free(struct ip_reass *ira)
+{
+	struct ip_reass *next;
+	struct netbuf *nb;
+
+	while (ira) {
+		next = ira->ira_next;
+
+		while (ira->ira_list) {
+			nb = ira->ira_list;
+			ira->ira_list = nb->nb_next;
+			nb->nb_next = NULL;
+			netbuf_deref(nb);
+		}
+
+		membuf_deref(ira);
+		ira = next;
+	}
+}
+
+/*
+ * ip_reass_evict()
+ *	Give up on the oldest datagram that's being reassembled.
+ *
+ * The datagram is added to the "dead" list for the caller to release.
+ *
+ * It is assumed that the instance lock is held on entry to this function.
+ */
+static struct ip_reass *ip_reass_evict(struct ip_instance *ii, struct ip_reass **dead)
+{
+	struct ip_reass *ira;
+
+	ira = ii->ii_reass_list;
+	ip_reass_unlink(ii, ira);
+	ira->ira_next = *dead;
+	*dead = ira;
+	ii->ii_reass_drops++;
+
+	return ira;
+}
+
+/*
+ * ip_reass_timer_start()
+ *	Start the reassembly timer.
+ *
+ * The caller must have set ii_reass_timer_running while holding the
+ * instance lock.  The timer holds a reference to the instance.
+ */
+static void ip_reass_timer_start(struct ip_instance *ii)
+{
+	ip_instance_ref(ii);
+	ii->ii_reass_timer->os_ticks_left = IP_REASS_INTERVAL;
+	oneshot_attach(ii->ii_reass_timer);
+}
+
+/*
+ * ip_reass_tick()
+ *	Callback function for the reassembly timer.
+ *
+ * We give up on any datagram that we've been waiting too long for.  If we
+ * have its first fragment then we tell the sender with an ICMP "time
+ * exceeded" message (RFC1122).  The timer keeps running for as long as
+ * there's anything being reassembled.
+ */
+static void ip_reass_tick(void *inst)
+{
+	struct ip_instance *ii;
+	struct ip_reass *ira, *next, *dead;
+	u32_t now;
+	u8_t used;
+
+	ii = (struct ip_instance *)inst;
+	now = timer_get_jiffies();
+	dead = NULL;
+
+	spinlock_lock(&ii->ii_lock);
+
+	ira = ii->ii_reass_list;
+	while (ira) {
+		next = ira->ira_next;
+		if ((now - ira->ira_jiffies) >= IP_REASS_TIMEOUT) {
+			ip_reass_unlink(ii, ira);
+			ira->ira_next = dead;
+			dead = ira;
+			ii->ii_reass_drops++;
+		}
+		ira = next;
+	}
+
+	used = (ii->ii_reass_list != NULL);
+	ii->ii_reass_timer_running = used;
+
+	spinlock_unlock(&ii->ii_lock);
+
+	if (used) {
+		ip_reass_timer_start(ii);
+	}
+
+	for (ira = dead; ira; ira = ira->ira_next) {
+		if (ira->ira_list && (ip_frag_offs(ira->ira_list) == 0)) {
+			icmp_issue_error(ii, ira->ira_list, 0x0b, 0x01, 0);
+		}
+	}
+
+	ip_reass_free(dead);
+
+	ip_instance_deref(ii);
+}
+
+/*
+ * ip_reass_build()
+ *	Build a complete datagram from its fragments.
+ *
+ * The fragments' data is copied into a single new netbuf and summed as it
+ * goes, so the transport layer doesn't have to read it again to check its
+ * checksum.  The result looks just like a whole datagram that has been
+ * received.
+ */
+static struct netbuf *ip_reass_build(struct ip_reass *ira)
+{
+	struct ip_header *iph;
+	struct netbuf *nb, *fnb;
+	u8_t *p;
+	u16_t hlen, flen, csum;
+
+	fnb = ira->ira_list;
+	hlen = ((struct ip_header *)fnb->nb_network)->ih_header_len * 4;
+	if (((u32_t)hlen + ira->ira_len) > 0xffff) {
+		return NULL;
+	}
+
+	nb = netbuf_alloc_with_data(hlen + ira->ira_len);
+	nb->nb_network = nb->nb_datalink;
+	nb->nb_network_size = nb->nb_datalink_size;
+	nb->nb_datalink_size = 0;
+
+	iph = (struct ip_header *)nb->nb_network;
+	memcpy(iph, fnb->nb_network, hlen);
+	iph->ih_total_len = hton16(hlen + ira->ira_len);
+	iph->ih_frag = 0;
+	iph->ih_header_csum = 0x0000;
+	iph->ih_header_csum = ipcsum(0, iph, hlen);
+
+	/*
+	 * Every fragment but the last carries a multiple of 8 bytes, so the
+	 * partial sums can simply be added together.
+	 */
+	p = (u8_t *)iph + hlen;
+	csum = 0;
+	while (fnb) {
+		flen = ip_frag_len(fnb);
+		csum = ipcsum_copy_partial(csum, p, (u8_t *)fnb->nb_network + (((struct ip_header *)fnb->nb_network)->ih_header_len * 4), flen);
+		p += flen;
+		fnb = fnb->nb_next;
+	}
+
+	netbuf_set_rx_csum(nb, (u8_t *)iph + hlen, ira->ira_len, csum);
+
+	return nb;
+}
+
+/*
+ * ip_reass_netbuf()
+ *	Handle a fragment of a datagram that's for us.
+ *
+ * We hold on to fragments until we have the whole of their datagram, and
+ * then return a new netbuf holding it.  Otherwise we return NULL.
+ *
+ * The memory that we tie up is strictly limited.  Under pressure we give up
+ * on the oldest datagrams first, any one source can only have so many
+ * fragments held, and datagrams that aren't completed in time are dropped.
+ * We don't accept fragments that overlap others: a datagram that has them
+ * is discarded.
+ */
+static struct netbuf *ip_reass_netbuf(struct ip_instance *ii, struct netbuf *nb)
+{
+	struct ip_header *iph;
+	struct ip_reass *ira, *p, *dead;
+	struct ip_reass **pira;
+	struct netbuf **pnb, *rnb;
+	u16_t hlen, total, offs, len, end, prev_end, expect;
+	u8_t more, srcfrags, start, complete;
+	addr_t mem;
+
+	iph = (struct ip_header *)nb->nb_network;
+	hlen = iph->ih_header_len * 4;
+	total = hton16(iph->ih_total_len);
+	if ((hlen < sizeof(struct ip_header)) || (total <= hlen) || (total > nb->nb_network_size)) {
+		return NULL;
+	}
+
+	offs = ip_frag_offs(nb);
+	len = total - hlen;
+	more = (hton16(iph->ih_frag) & IP_FRAG_MF) ? TRUE : FALSE;
+	if ((more && (len & 0x07)) || (((u32_t)offs + len) > (0xffff - sizeof(struct ip_header)))) {
+		return NULL;
+	}
+	end = offs + len;
+
+	mem = ip_frag_mem(nb);
+	if (mem > (IP_REASS_MEMORY - sizeof(struct ip_reass))) {
+		return NULL;
+	}
+
+	dead = NULL;
+	rnb = NULL;
+	start = FALSE;
+	complete = FALSE;
+
+	spinlock_lock(&ii->ii_lock);
+
+	/*
+	 * Find the datagram that this is part of, counting the fragments that
+	 * we're holding from the same source as we go.
+	 */
+	srcfrags = 0;
+	ira = NULL;
+	for (p = ii->ii_reass_list; p; p = p->ira_next) {
+		if (p->ira_src_addr != iph->ih_src_addr) {
+			continue;
+		}
+
+		srcfrags += p->ira_frags;
+		if ((p->ira_dest_addr == iph->ih_dest_addr) && (p->ira_ident == iph->ih_ident)
+				&& (p->ira_protocol == iph->ih_protocol)) {
+			ira = p;
+		}
+	}
+
+	if (srcfrags >= IP_REASS_SOURCE_FRAGS) {
+		spinlock_unlock(&ii->ii_lock);
+		return NULL;
+	}
+
+	if (!ira) {
+		if (ii->ii_reass_count >= IP_REASS_MAX) {
+			ip_reass_evict(ii, &dead);
+		}
+
+		ira = (struct ip_reass *)membuf_alloc(sizeof(struct ip_reass), NULL);
+		ira->ira_next = NULL;
+		ira->ira_src_addr = iph->ih_src_addr;
+		ira->ira_dest_addr = iph->ih_dest_addr;
+		ira->ira_ident = iph->ih_ident;
+		ira->ira_protocol = iph->ih_protocol;
+		ira->ira_frags = 0;
+		ira->ira_len = 0;
+		ira->ira_jiffies = timer_get_jiffies();
+		ira->ira_mem = sizeof(struct ip_reass);
+		ira->ira_list = NULL;
+
+		pira = &ii->ii_reass_list;
+		while (*pira) {
+			pira = &(*pira)->ira_next;
+		}
+		*pira = ira;
+
+		ii->ii_reass_mem += ira->ira_mem;
+		ii->ii_reass_count++;
+
+		if (!ii->ii_reass_timer_running) {
+			ii->ii_reass_timer_running = TRUE;
+			start = TRUE;
+		}
+	}
+
+	/*
+	 * Make room for the fragment, oldest datagrams first.  If that means
+	 * giving up on this one then so be it.
+	 */
+	while ((ii->ii_reass_mem + mem) > IP_REASS_MEMORY) {
+		if (ip_reass_evict(ii, &dead) == ira) {
+			goto done;
+		}
+	}
+
+	/*
+	 * Find where the fragment goes and check that it's consistent with
+	 * the ones that we already have.
+	 */
+	prev_end = 0;
+	pnb = &ira->ira_list;
+	while (*pnb && (ip_frag_offs(*pnb) < offs)) {
+		prev_end = ip_frag_offs(*pnb) + ip_frag_len(*pnb);
+		pnb = &(*pnb)->nb_next;
+	}
+
+	if (*pnb && (ip_frag_offs(*pnb) == offs) && (ip_frag_len(*pnb) == len)) {
+		goto done;
+	}
+
+	if ((prev_end > offs) || (*pnb && (end > ip_frag_offs(*pnb)))
+			|| (ira->ira_len && (end > ira->ira_len))
+			|| (!more && ((ira->ira_len && (end != ira->ira_len)) || *pnb))) {
+		ip_reass_unlink(ii, ira);
+		ira->ira_next = dead;
+		dead = ira;
+		ii->ii_reass_drops++;
+		goto done;
+	}
+
+	netbuf_ref(nb);
+	nb->nb_next = *pnb;
+	*pnb = nb;
+	ira->ira_frags++;
+	ira->ira_mem += mem;
+	ii->ii_reass_mem += mem;
+	if (!more) {
+		ira->ira_len = end;
+	}
+
+	/*
+	 * Once we've seen the last fragment, check whether there are any
+	 * holes left.
+	 */
+	if (ira->ira_len) {
+		expect = 0;
+		for (rnb = ira->ira_list; rnb && (ip_frag_offs(rnb) == expect); rnb = rnb->nb_next) {
+			expect += ip_frag_len(rnb);
+		}
+		rnb = NULL;
+
+		if (expect == ira->ira_len) {
+			ip_reass_unlink(ii, ira);
+			complete = TRUE;
+		}
+	}
+
+done:
+	spinlock_unlock(&ii->ii_lock);
+
+	if (start) {
+		ip_reass_timer_start(ii);
+	}
+
+	if (complete) {
+		rnb = ip_reass_build(ira);
+		ip_reass_free(ira);
+	}
+
+	ip_reass_free(dead);
+
+	return rnb;
+}
+#endif
+
+/*
+ * ip_deliver_netbuf()
+ *	Pass a datagram that's for us to its transport protocol.
+ */
+static void ip_deliver_netbuf(struct ip_instance *ii, struct netbuf *nb)
+{
+	struct ip_header *iph;
+	struct ip_client *ic;
+
+	iph = nb->nb_network;
+
 	/*
 	 * Now that we know things are sane then we should refine our
 	 * netbuf structure.
@@ -370,40 +1256,83 @@ void ip_recv_netbuf(void *clnt, struct netbuf *nb)
 	
 	spinlock_lock(&ii->ii_lock);
 
-	ic = ii->ii_client_list;
-	while (ic && (ic->ic_protocol != iph->ih_protocol)) {
-		ic = ic->ic_next;
-	}
-
-	if (ic) {
+	ic = ii->ii_protocol_table[iph->ih_protocol & IP_PROTOCOL_TABLE_MASK];
+	if (ic && (ic->ic_protocol == iph->ih_protocol)) {
 		ip_client_ref(ic);
 		spinlock_unlock(&ii->ii_lock);
 		ic->ic_recv(ic, nb);
 		ip_client_deref(ic);
 	} else {
-		struct ip_header *iph, *iphc;
-		struct netbuf *nbrep;
-			
 		spinlock_unlock(&ii->ii_lock);
 		
-		iph = (struct ip_header *)nb->nb_network;
-                              		
 		/*
 		 * Issue an ICMP destination unreachable message (protocol unreachable).
 		 */	
-		nbrep = netbuf_alloc();
-		nbrep->nb_application_membuf = membuf_alloc(nb->nb_network_size + 8, NULL);
-		nbrep->nb_application = nbrep->nb_application_membuf;
-	        nbrep->nb_application_size = nb->nb_network_size + 8;
-	
-		iphc = (struct ip_header *)nbrep->nb_application;
-		memcpy(iphc, iph, nb->nb_network_size);
-		memcpy((iphc + 1), nb->nb_transport, 8);
+		icmp_issue_error(ii, nb, 0x03, 0x02, 0);
+	}
+}
+
+/*
+ * ip_recv_netbuf()
+ */
+void ip_recv_netbuf(void *clnt, struct netbuf *nb)
+{
+	struct ip_datalink_client *idc;
+	struct ip_instance *ii;
+	struct ip_header *iph;
+	u32_t dest;
 	
-		icmp_issue_netbuf(ii, iph->ih_src_addr, 0x03, 0x02, (u8_t *)(&empty), nbrep);
+	idc = (struct ip_datalink_client *)clnt;
+	ii = (struct ip_instance *)idc->idc_instance;
+		
+	iph = nb->nb_network;
+		
+	/*
+	 * We're only dealing with v4 IP here.
+	 */
+	if (iph->ih_version != 4) {
+		return;
+	}
+
+	/*
+	 * If we have a header checksum then check it.
+	 */
+	if (iph->ih_header_csum) {
+		if (ipcsum(0, iph, iph->ih_header_len * 4) != 0x0000) {
+			return;
+		}
+	}
 
-		netbuf_deref(nbrep);
+	/*
+	 * Check that we have a match on the IP address.  If we don't then we
+	 * may be able to forward the packet, but not if it's a broadcast or is
+	 * for one of our other interfaces' addresses (we only accept packets
+	 * for an interface's address on that interface).
+	 */
+	dest = hton32(iph->ih_dest_addr);
+	if (dest != ii->ii_addr) {
+		if (ii->ii_forward && (dest != 0xffffffff) && !ip_addr_is_local(dest)) {
+			ip_forward_netbuf(ii, nb);
+		}
+		return;
 	}
+
+	/*
+	 * Fragments are held until we can reassemble their datagram (or dropped
+	 * if we don't do reassembly).
+	 */
+	if (hton16(iph->ih_frag) & (IP_FRAG_MF | IP_FRAG_OFFS)) {
+#if defined(IP_REASS)
+		nb = ip_reass_netbuf(ii, nb);
+		if (nb) {
+			ip_deliver_netbuf(ii, nb);
+			netbuf_deref(nb);
+		}
+#endif
+		return;
+	}
+
+	ip_deliver_netbuf(ii, nb);
 }
 
 /*
@@ -415,13 +1344,8 @@ void ip_recv_netbuf(void *clnt, struct netbuf *nb)
 void ip_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t protocol, struct netbuf *nb)
 {
 	struct ip_header *iph;
-	struct ip_datalink_server *ids;
 
-	nb->nb_network_membuf = membuf_alloc(sizeof(struct ip_header), NULL);
-	nb->nb_network = nb->nb_network_membuf;
-	nb->nb_network_size = sizeof(struct ip_header);
-		
-	iph = (struct ip_header *)nb->nb_network;
+	iph = (struct ip_header *)netbuf_push_network(nb, sizeof(struct ip_header));
 	iph->ih_version = 4;
 	iph->ih_header_len = sizeof(struct ip_header) / 4;
 	iph->ih_src_addr = hton32(ii->ii_addr);
@@ -430,21 +1354,57 @@ void ip_issue_netbuf(struct ip_instance *ii, u32_t dest_addr, u8_t protocol, str
 	iph->ih_time_to_live = 0x40;
 	iph->ih_type_of_service = 0x00;
 	iph->ih_ident = hton16(ii->ii_pkt_ident++);
-	iph->ih_flags = 0;
-	iph->ih_fragment_offs = 0;
+	iph->ih_frag = 0;
 	iph->ih_total_len = hton16(nb->nb_network_size + nb->nb_transport_size + nb->nb_application_size);
 	iph->ih_header_csum = 0x0000;
 
+	ip_output_netbuf(ii, nb);
+}
+
+/*
+ * ip_output_netbuf()
+ *	Hand a packet to a datalink layer.
+ *
+ * The IP header must be complete apart from its checksum.  The routing table
+ * is shared by all of our interfaces, so if it says that the destination is
+ * reached through another one then we send the packet that way, just as we
+ * would if we were forwarding it.  Packets that are too large for the
+ * datalink are sent as fragments.
+ */
+static void ip_output_netbuf(struct ip_instance *ii, struct netbuf *nb)
+{
+	struct ip_header *iph;
+	struct ip_datalink_server *ids;
+	struct ip_instance *out;
+	struct ip_route rt;
+
+	iph = (struct ip_header *)nb->nb_network;
+
+	out = NULL;
+	if (ip_route_find(hton32(iph->ih_dest_addr), &rt) && (rt.ir_idi != ii->ii_idi)) {
+		out = ip_instance_find_datalink(rt.ir_idi);
+	}
+	if (out) {
+		ii = out;
+	}
+
 	spinlock_lock(&ii->ii_lock);
 	ids = ii->ii_server;
 	ip_datalink_server_ref(ids);
 	spinlock_unlock(&ii->ii_lock);
 		
-	iph->ih_header_csum = ipcsum(0, iph, iph->ih_header_len * 4);
-	
-	ids->ids_send(ids, nb);
+	if (hton16(iph->ih_total_len) > ii->ii_idi->idi_mtu) {
+		ip_fragment_netbuf(ids, nb, ii->ii_idi->idi_mtu);
+	} else {
+		iph->ih_header_csum = ipcsum(0, iph, iph->ih_header_len * 4);
+		ids->ids_send(ids, nb);
+	}
 
 	ip_datalink_server_deref(ids);
+
+	if (out) {
+		ip_instance_deref(out);
+	}
 }
 
 /*
@@ -499,27 +1459,24 @@ struct ip_client *ip_client_alloc(void)
  */
 struct ip_server *ip_client_attach(struct ip_instance *ii, struct ip_client *ic)
 {
-        struct ip_client *p;
         struct ip_server *is = NULL;
+        struct ip_client **entry;
         	
 	spinlock_lock(&ii->ii_lock);
 
 	/*
-	 * Walk the client list and check that we can do this request.
+	 * Check that the protocol's table entry is free.  On systems where
+	 * the table is smaller than the protocol space this also refuses a
+	 * protocol that shares its entry with one already attached.
 	 */
-	p = ii->ii_client_list;
-	while (p && (p->ic_protocol != ic->ic_protocol)) {
-		p = p->ic_next;
-	}
-
-	if (!p) {
+	entry = &ii->ii_protocol_table[ic->ic_protocol & IP_PROTOCOL_TABLE_MASK];
+	if (!*entry) {
 		is = ip_server_alloc();
 		is->is_instance = ii;
                 ip_instance_ref(ii);
 
 		ic->ic_server = is;
-		ic->ic_next = ii->ii_client_list;
-		ii->ii_client_list = ic;
+		*entry = ic;
 		ip_client_ref(ic);
 	}
 				
@@ -535,26 +1492,22 @@ struct ip_server *ip_client_attach(struct ip_instance *ii, struct ip_client *ic)
 void ip_client_detach(struct ip_instance *ii, struct ip_server *is)
 {
         struct ip_client *ic;
-        struct ip_client **icprev;
+	u16_t i;
 	
 	spinlock_lock(&ii->ii_lock);
 
 	/*
-	 * Walk the client list and find the one we're to remove.
+	 * Find the table entry that we're to remove.
 	 */
-	ic = ii->ii_client_list;
-	icprev = &ii->ii_client_list;
-	while (ic) {
-		if (ic->ic_server == is) {
-			*icprev = ic->ic_next;
+	for (i = 0; i < IP_PROTOCOL_TABLE_SIZE; i++) {
+		ic = ii->ii_protocol_table[i];
+		if (ic && (ic->ic_server == is)) {
+			ii->ii_protocol_table[i] = NULL;
 			ip_server_deref(is);
 			ip_instance_deref(ii);
 			ip_client_deref(ic);
 			break;
 		}
-	
-		icprev = &ic->ic_next;
-		ic = ic->ic_next;
 	}
 			
 	spinlock_unlock(&ii->ii_lock);
@@ -567,14 +1520,33 @@ struct ip_instance *ip_instance_alloc(struct ip_datalink_instance *idi, u32_t ad
 {
 	struct ip_instance *ii;
         struct ip_datalink_client *idc;
+	u16_t i;
         		
 	ii = (struct ip_instance *)membuf_alloc(sizeof(struct ip_instance), NULL);
 	spinlock_init(&ii->ii_lock, 0x18);
 	ii->ii_addr = addr;
 	ii->ii_pkt_ident = 0;
 	ii->ii_server = NULL;
-	ii->ii_client_list = NULL;
-	ii->ii_icmp_client_list = NULL;
+	ii->ii_idi = idi;
+	ii->ii_forward = FALSE;
+	ii->ii_forwarded = 0;
+	ii->ii_forward_drops = 0;
+#if defined(IP_REASS)
+	ii->ii_reass_list = NULL;
+	ii->ii_reass_mem = 0;
+	ii->ii_reass_count = 0;
+	ii->ii_reass_drops = 0;
+	ii->ii_reass_timer = oneshot_alloc();
+	ii->ii_reass_timer->os_callback = ip_reass_tick;
+	ii->ii_reass_timer->os_arg = ii;
+	ii->ii_reass_timer_running = FALSE;
+#endif
+	for (i = 0; i < IP_PROTOCOL_TABLE_SIZE; i++) {
+		ii->ii_protocol_table[i] = NULL;
+	}
+	for (i = 0; i < ICMP_TYPE_TABLE_SIZE; i++) {
+		ii->ii_icmp_type_table[i] = NULL;
+	}
 	ii->ii_ip_client_attach = ip_client_attach;
 	ii->ii_ip_client_detach = ip_client_detach;
 	ii->ii_icmp_client_attach = icmp_client_attach;
@@ -591,5 +1563,29 @@ struct ip_instance *ip_instance_alloc(struct ip_datalink_instance *idi, u32_t ad
 	ii->ii_server = idi->idi_client_attach(idi, idc);
 	ip_datalink_client_deref(idc);
 
+	/*
+	 * Add this instance to the list of all instances.  The list holds a
+	 * reference to it.
+	 */
+	spinlock_lock(&ip_instance_list_lock);
+	ip_instance_ref(ii);
+	ii->ii_next = ip_instance_list;
+	ip_instance_list = ii;
+	spinlock_unlock(&ip_instance_list_lock);
+
 	return ii;
 }
+
+/*
+ * ip_instance_set_forward()
+ *	Enable or disable the forwarding of packets through an IP instance.
+ *
+ * Packets are only forwarded between instances that both have forwarding
+ * enabled.
+ */
+void ip_instance_set_forward(struct ip_instance *ii, u8_t forward)
+{
+	spinlock_lock(&ii->ii_lock);
+	ii->ii_forward = forward;
+	spinlock_unlock(&ii->ii_lock);
+}
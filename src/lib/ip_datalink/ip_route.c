@@ -0,0 +1,382 @@
+/*
+ * ip_route.c
+ *	IP routing table.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ */
+#include "types.h"
+#include "memory.h"
+#include "debug.h"
+#include "context.h"
+#include "heap.h"
+#include "atomic.h"
+#include "membuf.h"
+#include "netbuf.h"
+#include "ip_datalink.h"
+#include "ip_route.h"
+
+/*
+ * The routing table is shared by all of the datalink interfaces.
+ *
+ * Lookups don't take any lock.  Changes are serialized by ip_route_lock and
+ * are made by completely building any new nodes before linking them into
+ * the trie with a single pointer write.  Nodes and routes that are taken out
+ * of the trie aren't freed until there are no lookups in progress that might
+ * still be looking at them.
+ */
+static struct ip_route_node *ip_route_root = NULL;
+static struct lock ip_route_lock = {0, 0x10, 0xff};
+static ref_t ip_route_readers = 0;
+static struct ip_route_node *ip_route_dead_nodes = NULL;
+static struct ip_route *ip_route_dead_routes = NULL;
+
+u32_t ip_route_gen = 0;
+
+/*
+ * ip_route_mask()
+ *	Get the netmask for a prefix length.
+ */
+static inline u32_t ip_route_mask(u8_t prefix_len)
+{
+	return prefix_len ? (0xffffffff << (32 - prefix_len)) : 0;
+}
+
+/*
+ * ip_route_bit()
+ *	Get the bit of an address that follows a prefix of a given length.
+ */
+static inline u8_t ip_route_bit(u32_t addr, u8_t prefix_len)
+{
+	return (u8_t)((addr >> (31 - prefix_len)) & 1);
+}
+
+/*
+ * ip_route_common()
+ *	Find how many leading bits two addresses have in common (up to a limit).
+ */
+static u8_t ip_route_common(u32_t a, u32_t b, u8_t max)
+{
+	u32_t diff;
+	u8_t len;
+
+	diff = a ^ b;
+	len = 0;
+	while ((len < max) && !(diff & 0x80000000)) {
+		diff <<= 1;
+		len++;
+	}
+
+	return len;
+}
+
+/*
+ * ip_route_node_alloc()
+ *	Allocate and fill in a routing table node.
+ */
+static struct ip_route_node *ip_route_node_alloc(u32_t addr, u8_t prefix_len, struct ip_route *r)
+{
+	struct ip_route_node *n;
+
+	n = (struct ip_route_node *)heap_alloc(sizeof(struct ip_route_node));
+	n->irn_addr = addr;
+	n->irn_prefix_len = prefix_len;
+	n->irn_route = r;
+	n->irn_child[0] = NULL;
+	n->irn_child[1] = NULL;
+	n->irn_next = NULL;
+
+	return n;
+}
+
+/*
+ * ip_route_reclaim()
+ *	Free the nodes and routes that have been taken out of the trie, if no
+ *	lookups can still be looking at them.
+ *
+ * It is assumed that the routing table lock is held on entry to this function.
+ */
+static void ip_route_reclaim(void)
+{
+	struct ip_route_node *n;
+	struct ip_route *r;
+
+	if (*((volatile ref_t *)&ip_route_readers)) {
+		return;
+	}
+
+	while (ip_route_dead_nodes) {
+		n = ip_route_dead_nodes;
+		ip_route_dead_nodes = n->irn_next;
+		heap_free(n);
+	}
+
+	while (ip_route_dead_routes) {
+		r = ip_route_dead_routes;
+		ip_route_dead_routes = r->ir_next;
+		heap_free(r);
+	}
+}
+
+/*
+ * ip_route_compress()
+ *	Take a node out of the trie if it no longer holds a route or separates
+ *	two branches.
+ *
+ * It is assumed that the routing table lock is held on entry to this function.
+ */
+static void ip_route_compress(struct ip_route_node **pn)
+{
+	struct ip_route_node *n;
+
+	n = *pn;
+	if (n->irn_route || (n->irn_child[0] && n->irn_child[1])) {
+		return;
+	}
+
+	atomic_ptr_set((void **)pn, n->irn_child[0] ? n->irn_child[0] : n->irn_child[1]);
+	n->irn_next = ip_route_dead_nodes;
+	ip_route_dead_nodes = n;
+}
+
+/*
+ * __ip_route_delete()
+ *	Delete the route for a prefix.
+ *
+ * It is assumed that the routing table lock is held on entry to this function.
+ */
+static u8_t __ip_route_delete(u32_t addr, u8_t prefix_len)
+{
+	struct ip_route_node *n, **pn, **ppn;
+	struct ip_route *r;
+
+	ppn = NULL;
+	pn = &ip_route_root;
+	while ((n = *pn)) {
+		if ((n->irn_prefix_len > prefix_len)
+				|| ((addr ^ n->irn_addr) & ip_route_mask(n->irn_prefix_len))) {
+			return FALSE;
+		}
+
+		if (n->irn_prefix_len == prefix_len) {
+			break;
+		}
+
+		ppn = pn;
+		pn = &n->irn_child[ip_route_bit(addr, n->irn_prefix_len)];
+	}
+
+	if (!n || !n->irn_route) {
+		return FALSE;
+	}
+
+	r = n->irn_route;
+	atomic_ptr_set((void **)&n->irn_route, NULL);
+	r->ir_next = ip_route_dead_routes;
+	ip_route_dead_routes = r;
+
+	/*
+	 * Removing the node may leave its parent with nothing to do too.
+	 */
+	ip_route_compress(pn);
+	if (ppn) {
+		ip_route_compress(ppn);
+	}
+
+	ip_route_gen++;
+
+	return TRUE;
+}
+
+/*
+ * ip_route_find_datalink()
+ *	Find any route that goes through a particular interface.
+ *
+ * It is assumed that the routing table lock is held on entry to this function.
+ */
+static struct ip_route *ip_route_find_datalink(struct ip_route_node *n, struct ip_datalink_instance *idi)
+{
+	struct ip_route *r;
+
+	if (!n) {
+		return NULL;
+	}
+
+	if (n->irn_route && (n->irn_route->ir_idi == idi)) {
+		return n->irn_route;
+	}
+
+	r = ip_route_find_datalink(n->irn_child[0], idi);
+	if (r) {
+		return r;
+	}
+
+	return ip_route_find_datalink(n->irn_child[1], idi);
+}
+
+/*
+ * ip_route_add()
+ *	Add a route to the routing table.
+ *
+ * Any existing route for the same prefix is replaced.
+ */
+void ip_route_add(struct ip_datalink_instance *idi, u32_t addr, u8_t prefix_len, u32_t gateway)
+{
+	struct ip_route *r, *old;
+	struct ip_route_node *n, *nn, *branch, **pn;
+	u8_t common;
+
+	addr &= ip_route_mask(prefix_len);
+
+	r = (struct ip_route *)heap_alloc(sizeof(struct ip_route));
+	r->ir_addr = addr;
+	r->ir_prefix_len = prefix_len;
+	r->ir_gateway = gateway;
+	r->ir_idi = idi;
+	r->ir_next = NULL;
+
+	spinlock_lock(&ip_route_lock);
+
+	/*
+	 * Walk down the trie for as long as the nodes we find are prefixes of
+	 * the one we're adding.
+	 */
+	common = 0;
+	pn = &ip_route_root;
+	while ((n = *pn)) {
+		common = ip_route_common(addr, n->irn_addr,
+				(prefix_len < n->irn_prefix_len) ? prefix_len : n->irn_prefix_len);
+		if (common < n->irn_prefix_len) {
+			break;
+		}
+
+		if (n->irn_prefix_len == prefix_len) {
+			old = n->irn_route;
+			atomic_ptr_set((void **)&n->irn_route, r);
+			if (old) {
+				old->ir_next = ip_route_dead_routes;
+				ip_route_dead_routes = old;
+			}
+			goto done;
+		}
+
+		pn = &n->irn_child[ip_route_bit(addr, n->irn_prefix_len)];
+	}
+
+	/*
+	 * If we stopped at a node then our new one either goes directly above
+	 * it or we need a new node where the two separate.
+	 */
+	nn = ip_route_node_alloc(addr, prefix_len, r);
+	if (n) {
+		if (common == prefix_len) {
+			nn->irn_child[ip_route_bit(n->irn_addr, prefix_len)] = n;
+		} else {
+			branch = ip_route_node_alloc(addr & ip_route_mask(common), common, NULL);
+			branch->irn_child[ip_route_bit(addr, common)] = nn;
+			branch->irn_child[ip_route_bit(n->irn_addr, common)] = n;
+			nn = branch;
+		}
+	}
+
+	atomic_ptr_set((void **)pn, nn);
+
+done:
+	ip_route_gen++;
+	ip_route_reclaim();
+
+	spinlock_unlock(&ip_route_lock);
+}
+
+/*
+ * ip_route_delete()
+ *	Delete a route from the routing table.
+ *
+ * Returns TRUE if the route was found, or FALSE otherwise.
+ */
+u8_t ip_route_delete(u32_t addr, u8_t prefix_len)
+{
+	u8_t res;
+
+	spinlock_lock(&ip_route_lock);
+
+	res = __ip_route_delete(addr & ip_route_mask(prefix_len), prefix_len);
+	ip_route_reclaim();
+
+	spinlock_unlock(&ip_route_lock);
+
+	return res;
+}
+
+/*
+ * ip_route_delete_datalink()
+ *	Delete all of the routes that go through a particular interface.
+ */
+void ip_route_delete_datalink(struct ip_datalink_instance *idi)
+{
+	struct ip_route *r;
+
+	spinlock_lock(&ip_route_lock);
+
+	while ((r = ip_route_find_datalink(ip_route_root, idi))) {
+		__ip_route_delete(r->ir_addr, r->ir_prefix_len);
+	}
+	ip_route_reclaim();
+
+	spinlock_unlock(&ip_route_lock);
+}
+
+/*
+ * ip_route_find()
+ *	Find the route to an IP address.
+ *
+ * We want the longest prefix that matches, so we walk down the trie,
+ * remembering the last route that we passed, until the address no longer
+ * matches.  If we find a route then we copy it to "rt" and return TRUE.
+ */
+u8_t ip_route_find(u32_t ip, struct ip_route *rt)
+{
+	struct ip_route_node *n;
+	struct ip_route *r, *best;
+
+	atomic_ref_inc(&ip_route_readers);
+
+	best = NULL;
+	n = (struct ip_route_node *)atomic_ptr_get((void **)&ip_route_root);
+	while (n) {
+		if ((ip ^ n->irn_addr) & ip_route_mask(n->irn_prefix_len)) {
+			break;
+		}
+
+		r = (struct ip_route *)atomic_ptr_get((void **)&n->irn_route);
+		if (r) {
+			best = r;
+		}
+
+		if (n->irn_prefix_len == 32) {
+			break;
+		}
+
+		n = (struct ip_route_node *)atomic_ptr_get((void **)&n->irn_child[ip_route_bit(ip, n->irn_prefix_len)]);
+	}
+
+	if (best) {
+		*rt = *best;
+	}
+
+	atomic_ref_dec(&ip_route_readers);
+
+	return best ? TRUE : FALSE;
+}
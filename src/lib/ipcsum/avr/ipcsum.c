@@ -54,10 +54,8 @@ u16_t ipcsum_partial(u16_t partial_csum, void *buf, u16_t count)
 				"adc %B0, __tmp_reg__\n\t"
 				"adc %A0, r1\n\t"
 				"adc %B0, r1\n\t"
-				"dec %A2\n\t"
+				"sbiw %2, 1\n\t"
 				"brne L_redo%=\n\t"
-				"subi %B2, 1\n\t"
-				"brsh L_redo%=\n\t"
 				"\n\t"
 				: "=r" (partial_csum), "=e" (d1), "=w" (d2)
 				: "0" (partial_csum), "1" (d1), "2" (words));
@@ -77,3 +75,57 @@ u16_t ipcsum_partial(u16_t partial_csum, void *buf, u16_t count)
 	
 	return partial_csum;
 }
+
+/*
+ * ipcsum_copy_partial()
+ *	Copy a block of data and calculate its partial IP checksum in one pass.
+ *
+ * The result is the same as calling ipcsum_partial() on the copy, but the
+ * data is only read once.
+ */
+u16_t ipcsum_copy_partial(u16_t partial_csum, void *dest, void *src, u16_t count)
+{
+	u16_t words;
+	void *s1;
+	void *d1;
+	u16_t d2;
+
+	words = count >> 1;
+	s1 = src;
+	d1 = dest;
+
+	if (words != 0) {
+		asm volatile ("\n"
+				"L_redo%=:\n\t"
+				"ld __tmp_reg__, %a1+\n\t"
+				"st %a2+, __tmp_reg__\n\t"
+				"add %A0, __tmp_reg__\n\t"
+				"ld __tmp_reg__, %a1+\n\t"
+				"st %a2+, __tmp_reg__\n\t"
+				"adc %B0, __tmp_reg__\n\t"
+				"adc %A0, r1\n\t"
+				"adc %B0, r1\n\t"
+				"sbiw %3, 1\n\t"
+				"brne L_redo%=\n\t"
+				"\n\t"
+				: "=r" (partial_csum), "=e" (s1), "=e" (d1), "=w" (d2)
+				: "0" (partial_csum), "1" (s1), "2" (d1), "3" (words)
+				: "memory");
+	}
+
+	/*
+	 * Did we have an odd number of bytes to do?
+	 */
+	if (count & 0x01) {
+		asm volatile ("ld __tmp_reg__, %a1+\n\t"
+				"st %a2+, __tmp_reg__\n\t"
+				"add %A0, __tmp_reg__\n\t"
+				"adc %B0, r1\n\t"
+				"adc %A0, r1\n\t"
+				: "=r" (partial_csum), "=e" (s1), "=e" (d1)
+				: "0" (partial_csum), "1" (s1), "2" (d1)
+				: "memory");
+	}
+
+	return partial_csum;
+}
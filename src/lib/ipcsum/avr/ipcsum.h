@@ -21,3 +21,4 @@
  * Function prototypes.
  */
 extern u16_t ipcsum_partial(u16_t partial_csum, void *buf, u16_t count);
+extern u16_t ipcsum_copy_partial(u16_t partial_csum, void *dest, void *src, u16_t count);
@@ -19,6 +19,225 @@
  */
 #include "types.h"
 
+#if defined(I686)
+#include "cpu.h"
+#include "isr.h"
+
+/*
+ * Smallest block that is worth handing to the SSE2 kernel.  Below this the
+ * cost of masking interrupts and, possibly, toggling cr0 outweighs the gain.
+ */
+#define IPCSUM_SSE2_MIN 1024
+
+/*
+ * State of SSE2 support.  This is worked out the first time that we need it.
+ */
+#define IPCSUM_SSE2_UNKNOWN 0
+#define IPCSUM_SSE2_ABSENT 1
+#define IPCSUM_SSE2_PRESENT 2
+
+static fast_u8_t ipcsum_sse2_state = IPCSUM_SSE2_UNKNOWN;
+#endif
+
+/*
+ * ipcsum_fold()
+ *	Fold a 32 bit running sum down to 16 bits.
+ */
+static inline u32_t ipcsum_fold(u32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (sum & 0xffff) + (sum >> 16);
+}
+
+/*
+ * ipcsum_kernel_32()
+ *	Sum a block of data 32 bits at a time.
+ *
+ * "sum" must be no more than 16 bits wide, and so is the result.  The block
+ * must start on a 16 bit boundary, but may be of any length.  We step up to
+ * a 32 bit boundary before running the main loop, which adds 32 bytes per
+ * iteration using a single carry chain ("lea" and "dec" both leave the carry
+ * flag alone).
+ */
+static u32_t ipcsum_kernel_32(u32_t sum, u8_t *p, u32_t count)
+{
+	u32_t n;
+
+	if ((count >= 2) && ((addr_t)p & 0x02)) {
+		sum += *((u16_t *)p);
+		p += 2;
+		count -= 2;
+	}
+
+	n = count >> 5;
+	if (n != 0) {
+		asm volatile ("clc\n"
+				"L_blk%=:\n\t"
+				"adcl 0(%1), %0\n\t"
+				"adcl 4(%1), %0\n\t"
+				"adcl 8(%1), %0\n\t"
+				"adcl 12(%1), %0\n\t"
+				"adcl 16(%1), %0\n\t"
+				"adcl 20(%1), %0\n\t"
+				"adcl 24(%1), %0\n\t"
+				"adcl 28(%1), %0\n\t"
+				"leal 32(%1), %1\n\t"
+				"decl %2\n\t"
+				"jnz L_blk%=\n\t"
+				"adcl $0, %0\n\t"
+				: "=r" (sum), "=r" (p), "=r" (n)
+				: "0" (sum), "1" (p), "2" (n)
+				: "cc", "memory");
+	}
+
+	n = (count >> 2) & 0x07;
+	if (n != 0) {
+		asm volatile ("clc\n"
+				"L_dw%=:\n\t"
+				"adcl (%1), %0\n\t"
+				"leal 4(%1), %1\n\t"
+				"decl %2\n\t"
+				"jnz L_dw%=\n\t"
+				"adcl $0, %0\n\t"
+				: "=r" (sum), "=r" (p), "=r" (n)
+				: "0" (sum), "1" (p), "2" (n)
+				: "cc", "memory");
+	}
+
+	sum = ipcsum_fold(sum);
+
+	if (count & 0x02) {
+		sum += *((u16_t *)p);
+		p += 2;
+	}
+
+	/*
+	 * Did we have an odd number of bytes to do?  On a little endian CPU
+	 * the trailing byte is the low half of its 16 bit word.
+	 */
+	if (count & 0x01) {
+		sum += *p;
+	}
+
+	return ipcsum_fold(sum);
+}
+
+#if defined(I686)
+/*
+ * ipcsum_kernel_sse2()
+ *	Sum a block of data 128 bits at a time using SSE2.
+ *
+ * The block must be 16 byte aligned and a multiple of 16 bytes long.  Each
+ * 16 bit word is widened into a 32 bit lane, so no carries are lost.  As no
+ * block is longer than 64 kBytes, no lane can overflow either.
+ *
+ * The XMM registers are not saved over a context switch, so the caller
+ * must have interrupts disabled.  It must also make sure that SSE
+ * instructions won't trap.  We don't list the XMM registers as clobbered:
+ * the libraries are built without SSE code generation, so the compiler
+ * never keeps anything in them (and won't accept them as clobbers).
+ */
+static u32_t ipcsum_kernel_sse2(u32_t sum, u8_t *p, u32_t count)
+{
+	u32_t res;
+
+	asm volatile ("pxor %%xmm0, %%xmm0\n\t"
+			"pxor %%xmm1, %%xmm1\n\t"
+			"pxor %%xmm2, %%xmm2\n"
+			"L_sse%=:\n\t"
+			"movdqa (%1), %%xmm3\n\t"
+			"movdqa %%xmm3, %%xmm4\n\t"
+			"punpcklwd %%xmm0, %%xmm3\n\t"
+			"punpckhwd %%xmm0, %%xmm4\n\t"
+			"paddd %%xmm3, %%xmm1\n\t"
+			"paddd %%xmm4, %%xmm2\n\t"
+			"addl $16, %1\n\t"
+			"subl $16, %2\n\t"
+			"jnz L_sse%=\n\t"
+			"paddd %%xmm2, %%xmm1\n\t"
+			"pshufd $0x4e, %%xmm1, %%xmm2\n\t"
+			"paddd %%xmm2, %%xmm1\n\t"
+			"pshufd $0xb1, %%xmm1, %%xmm2\n\t"
+			"paddd %%xmm2, %%xmm1\n\t"
+			"movd %%xmm1, %0\n\t"
+			: "=r" (res), "=r" (p), "=r" (count)
+			: "1" (p), "2" (count)
+			: "cc", "memory");
+
+	return ipcsum_fold(sum + res);
+}
+
+/*
+ * ipcsum_sse2_usable()
+ *	Check whether we can use the SSE2 kernel.
+ *
+ * The first time through we ask the CPU and, if it has SSE2, enable the
+ * SSE instructions in cr4.  Two threads may race to do this, but they'll
+ * both reach the same answer.
+ */
+static fast_u8_t ipcsum_sse2_usable(void)
+{
+	u32_t features;
+
+	if (ipcsum_sse2_state == IPCSUM_SSE2_UNKNOWN) {
+		features = get_cpuid_features();
+		if ((features & (CPUID_FXSR | CPUID_SSE2)) == (CPUID_FXSR | CPUID_SSE2)) {
+#if !defined(IPCSUM_HOST_BENCH)
+			set_cr4(get_cr4() | CR4_OSFXSR);
+#endif
+			ipcsum_sse2_state = IPCSUM_SSE2_PRESENT;
+		} else {
+			ipcsum_sse2_state = IPCSUM_SSE2_ABSENT;
+		}
+	}
+
+	return ipcsum_sse2_state == IPCSUM_SSE2_PRESENT;
+}
+
+/*
+ * ipcsum_sse2()
+ *	Sum a large block of data, using the SSE2 kernel for its aligned body.
+ *
+ * The block must start on a 16 bit boundary.  Any context might be using the
+ * FPU lazily, in which case cr0.EM may be set and SSE instructions would
+ * trap, so we clear it for the duration.  Interrupts are disabled so that
+ * nothing else can see the FPU enabled or disturb the XMM registers.
+ */
+static u32_t ipcsum_sse2(u32_t sum, u8_t *p, u32_t count)
+{
+	u32_t n;
+#if !defined(IPCSUM_HOST_BENCH)
+	fast_u8_t disabled;
+	u32_t cr0;
+#endif
+
+	n = (0 - (addr_t)p) & 0x0f;
+	sum = ipcsum_kernel_32(sum, p, n);
+	p += n;
+	count -= n;
+
+	n = count & ~0x0f;
+#if !defined(IPCSUM_HOST_BENCH)
+	disabled = isr_save_disable();
+	cr0 = get_cr0();
+	if (cr0 & CR0_EM) {
+		set_cr0(cr0 & (~CR0_EM));
+	}
+#endif
+
+	sum = ipcsum_kernel_sse2(sum, p, n);
+
+#if !defined(IPCSUM_HOST_BENCH)
+	if (cr0 & CR0_EM) {
+		set_cr0(cr0);
+	}
+	isr_restore(disabled);
+#endif
+
+	return ipcsum_kernel_32(sum, p + n, count - n);
+}
+#endif
+
 /*
  * ipcsum_partial()
  *	Calculates a partial IP checksum over a block of data.
@@ -29,50 +248,118 @@
  *
  * This is a partial checksum because it doesn't take the 1's complement
  * of the overall sum.
+ *
+ * For some explanation of why summing the data in any word size and folding
+ * the carries back in gives the right answer, the reader is referred to
+ * RFC1071 where the maths is explained in detail.  If the block starts on an
+ * odd address then we sum it as though it were shifted by one byte and then
+ * swap the bytes of the result back again.
  */
 u16_t ipcsum_partial(u16_t partial_csum, void *buf, u16_t count)
 {
-        u32_t words;
-	void *d1;
-	u32_t d2;
-	
-        words = count >> 1;
-        d1 = buf;
-                	
-	if (words != 0) {
-		/*
-		 * This doesn't look particularly intuitive at first sight - in fact
-		 * it probably looks plain wrong.  It does work however (take my word
-		 * for it), but for some explanation the reader is referred to
-		 * RFC1071 where the maths is explained in detail.
-		 *
-		 * Note that for a 32 bit CPU this is "really bad" (TM) code.  It
-		 * needs reworking into something a lot faster!
-		 */
-		asm volatile ("\n"
-				"L_redo%=:\n\t"
-				"lodsw\n\t"
-				"addw %%ax, %0\n\t"
-				"adcw $0, %0\n\t"
-				"loop L_redo%=\n\t"
-				"\n\t"
-				: "=g" (partial_csum), "=S" (d1), "=c" (d2)
-				: "0" (partial_csum), "1" (d1), "2" (words)
-				: "ax");
+	u8_t *p;
+	u32_t sum;
+	fast_u8_t odd;
+
+	p = (u8_t *)buf;
+	sum = 0;
+	odd = ((addr_t)p & 0x01) && (count != 0);
+	if (odd) {
+		sum = ((u32_t)*p++) << 8;
+		count--;
 	}
-	
-	/*
-	 * Did we have an odd number of bytes to do?
-	 */
+
+#if defined(I686)
+	if ((count >= IPCSUM_SSE2_MIN) && ipcsum_sse2_usable()) {
+		sum = ipcsum_sse2(sum, p, count);
+	} else {
+		sum = ipcsum_kernel_32(sum, p, count);
+	}
+#else
+	sum = ipcsum_kernel_32(sum, p, count);
+#endif
+
+	if (odd) {
+		sum = ((sum & 0xff) << 8) | (sum >> 8);
+	}
+
+	return (u16_t)ipcsum_fold(sum + partial_csum);
+}
+
+/*
+ * ipcsum_copy_partial()
+ *	Copy a block of data and calculate its partial IP checksum in one pass.
+ *
+ * The result is the same as calling ipcsum_partial() on the copy, but the
+ * data is only read once.  The words are summed as they're found at "src",
+ * so neither pointer needs to be aligned.  The main loop moves 16 bytes per
+ * iteration ("mov" doesn't touch the carry flag either).
+ */
+u16_t ipcsum_copy_partial(u16_t partial_csum, void *dest, void *src, u16_t count)
+{
+	u8_t *s;
+	u8_t *d;
+	u32_t sum;
+	u32_t n;
+	u32_t w;
+
+	s = (u8_t *)src;
+	d = (u8_t *)dest;
+	sum = 0;
+
+	n = count >> 4;
+	if (n != 0) {
+		asm volatile ("clc\n"
+				"L_blk%=:\n\t"
+				"movl 0(%1), %4\n\t"
+				"adcl %4, %0\n\t"
+				"movl %4, 0(%2)\n\t"
+				"movl 4(%1), %4\n\t"
+				"adcl %4, %0\n\t"
+				"movl %4, 4(%2)\n\t"
+				"movl 8(%1), %4\n\t"
+				"adcl %4, %0\n\t"
+				"movl %4, 8(%2)\n\t"
+				"movl 12(%1), %4\n\t"
+				"adcl %4, %0\n\t"
+				"movl %4, 12(%2)\n\t"
+				"leal 16(%1), %1\n\t"
+				"leal 16(%2), %2\n\t"
+				"decl %3\n\t"
+				"jnz L_blk%=\n\t"
+				"adcl $0, %0\n\t"
+				: "=r" (sum), "=r" (s), "=r" (d), "=r" (n), "=&r" (w)
+				: "0" (sum), "1" (s), "2" (d), "3" (n)
+				: "cc", "memory");
+	}
+
+	sum = ipcsum_fold(sum);
+
+	n = (count >> 2) & 0x03;
+	while (n != 0) {
+		w = *((u32_t *)s);
+		*((u32_t *)d) = w;
+		sum += w & 0xffff;
+		sum += w >> 16;
+		s += 4;
+		d += 4;
+		n--;
+	}
+
+	sum = ipcsum_fold(sum);
+
+	if (count & 0x02) {
+		w = *((u16_t *)s);
+		*((u16_t *)d) = (u16_t)w;
+		sum += w;
+		s += 2;
+		d += 2;
+	}
+
 	if (count & 0x01) {
-		asm volatile ("movb (%%esi), %%al\n\t"
-				"xorb %%ah, %%ah\n\t"
-				"addw %%ax, %0\n\t"
-				"adcw $0, %0\n\t"
-				: "=g" (partial_csum), "=S" (d1)
-				: "0" (partial_csum), "1" (d1)
-				: "ax");
+		*d = *s;
+		sum += *s;
 	}
-	
-	return partial_csum;
+
+	return (u16_t)ipcsum_fold(sum + partial_csum);
 }
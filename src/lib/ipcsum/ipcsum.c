@@ -18,6 +18,11 @@
  * "copying-liquorice.txt" for details.
  */
 #include "types.h"
+#include "memory.h"
+#include "context.h"
+#include "atomic.h"
+#include "membuf.h"
+#include "netbuf.h"
 #include "ipcsum.h"
 
 #if defined(ATMEGA103) || defined(AT90S8515) || defined(ATMEGA644P)
@@ -77,3 +82,56 @@ u16_t ipcsum_pseudo(u32_t src_addr, u32_t dest_addr, u8_t protocol, u16_t len)
 {
 	return ipcsum_pseudo_partial(src_addr, dest_addr, protocol, len) ^ 0xffff;
 }
+
+/*
+ * ipcsum_netbuf_partial()
+ *	Calculates a partial IP checksum over a block of received packet data.
+ *
+ * If the receiver summed the packet as it read it in (see
+ * netbuf_set_rx_csum()) then we work the answer out from that sum, only
+ * rereading the bytes either side of the block.  The block then never needs
+ * to be read here at all.  Otherwise, or if that would mean reading more than
+ * the block itself, we just sum the block.
+ */
+u16_t ipcsum_netbuf_partial(u16_t partial_csum, struct netbuf *nb, void *buf, u16_t count)
+{
+	u8_t *start;
+	addr_t head, tail;
+	u16_t csum, tsum;
+
+	start = (u8_t *)nb->nb_rx_csum_start;
+	if (!start || ((u8_t *)buf < start)
+			|| (((u8_t *)buf + count) > (start + nb->nb_rx_csum_size))) {
+		return ipcsum_partial(partial_csum, buf, count);
+	}
+
+	head = (u8_t *)buf - start;
+	tail = nb->nb_rx_csum_size - head - count;
+	if ((head + tail) > count) {
+		return ipcsum_partial(partial_csum, buf, count);
+	}
+
+	/*
+	 * Take out the sums of the head and tail.  Anything that starts at an
+	 * odd offset from the start of the summed data has its bytes the other
+	 * way around in the overall sum.
+	 */
+	csum = nb->nb_rx_csum;
+	if (head) {
+		csum = ipcsum_sub(csum, ipcsum_partial(0, start, head));
+	}
+
+	if (tail) {
+		tsum = ipcsum_partial(0, (u8_t *)buf + count, tail);
+		if ((head + count) & 0x01) {
+			tsum = ipcsum_swap(tsum);
+		}
+		csum = ipcsum_sub(csum, tsum);
+	}
+
+	if (head & 0x01) {
+		csum = ipcsum_swap(csum);
+	}
+
+	return ipcsum_add(partial_csum, csum);
+}
@@ -38,20 +38,25 @@
  *
  * One thing to be aware of - don't try and statically declare a membuf; it
  * won't work!  membufs are strictly dynamically allocated.
+ *
+ * membufs of a size that's fixed at compile time, and that are allocated and
+ * released very often, can come from an object cache instead of the heap.
+ * The membuf remembers which cache it came from so that it goes back there
+ * when the last reference is dropped.
+ *
+ * Reference counts are updated with the atomic primitives from atomic.h
+ * rather than under a lock, so membuf_ref() and membuf_deref() are inline
+ * and only call in here to free the membuf.
  */
 #include "types.h"
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
 #include "heap.h"
+#include "objcache.h"
+#include "atomic.h"
 #include "membuf.h"
 
-/*
- * Lock used to ensure that we don't run into any memory corruption problems,
- * but without causing any trouble with interrupt latencies either.
- */
-static struct lock membuf_lock;
-
 /*
  * membuf_alloc()
  */
@@ -63,77 +68,56 @@ void *membuf_alloc(addr_t size, void (*mfree)(void *))
 	
 	mb->mb_refs = 1;
         mb->mb_free = mfree;
+	mb->mb_cache = NULL;
 		
 	return (void *)(mb + 1);
 }
 
 /*
- * membuf_ref()
- *	Increase the reference count on a membuf.
+ * membuf_cache_create()
+ *	Create an object cache for membufs of a fixed size.
  */
-void membuf_ref(void *buf)
+struct objcache *membuf_cache_create(addr_t size, u16_t count)
 {
-	struct membuf *mb;
-	
-	mb = ((struct membuf *)buf) - 1;
-	
-	spinlock_lock(&membuf_lock);
-	
-	mb->mb_refs++;
-	
-	spinlock_unlock(&membuf_lock);
+	return objcache_create(sizeof(struct membuf) + size, count);
 }
 
 /*
- * membuf_deref()
- *	Decrease the reference count on a membuf.  If zeroed, then free it!
+ * membuf_cache_alloc()
+ *	Allocate a membuf from an object cache rather than the heap.
  */
-ref_t membuf_deref(void *buf)
+void *membuf_cache_alloc(struct objcache *oc, void (*mfree)(void *))
 {
 	struct membuf *mb;
-        ref_t res;
-			
-	mb = ((struct membuf *)buf) - 1;
-	
-	spinlock_lock(&membuf_lock);
-	
-	mb->mb_refs--;
-	res = mb->mb_refs;
-	
-	if (mb->mb_refs != 0) {
-		spinlock_unlock(&membuf_lock);
-		return res;
-	}
 
-	spinlock_unlock(&membuf_lock);
-			
-	if (mb->mb_free) {
-		mb->mb_free(buf);
-	}
-	
-	heap_free(mb);
+	mb = (struct membuf *)objcache_alloc(oc);
+
+	mb->mb_refs = 1;
+	mb->mb_free = mfree;
+	mb->mb_cache = oc;
 
-	return 0;
+	return (void *)(mb + 1);
 }
 
 /*
- * membuf_get_refs()
- *	Get the reference count on a membuf.
+ * __membuf_free()
+ *	Release a membuf once its last reference has gone.
  */
-ref_t membuf_get_refs(void *buf)
+void __membuf_free(void *buf)
 {
-	ref_t res;
 	struct membuf *mb;
 	
 	mb = ((struct membuf *)buf) - 1;
 	
-	spinlock_lock(&membuf_lock);
+	if (mb->mb_free) {
+		mb->mb_free(buf);
+	}
 	
-	res = mb->mb_refs;
-
-	spinlock_unlock(&membuf_lock);
-
-	return res;
+	if (mb->mb_cache) {
+		objcache_free(mb->mb_cache, mb);
+	} else {
+		heap_free(mb);
+	}
 }
 
 /*
@@ -142,5 +126,4 @@ ref_t membuf_get_refs(void *buf)
  */
 void membuf_init(void)
 {
-	spinlock_init(&membuf_lock, 0x08);
 }
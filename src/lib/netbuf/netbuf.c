@@ -26,12 +26,21 @@
  * netbuf are then handled by matching layers within the appropriate protocol
  * stack.  The names of each layer may be different for different protocols,
  * but we're using the ones from ISO here.
+ *
+ * On the transmit path a netbuf may instead be allocated with "headroom": a
+ * single membuf holds the application data with spare space in front of it.
+ * Each layer then pushes its header into that space, immediately in front of
+ * the layer above, rather than allocating a membuf of its own.  The four layer
+ * pointers are still filled in, so the drivers don't need to care how the
+ * netbuf was built.
  */
 #include "types.h"
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
 #include "membuf.h"
+#include "objcache.h"
 #include "netbuf.h"
 
 /*
@@ -40,6 +49,11 @@
  */
 struct lock netbuf_lock;
 
+/*
+ * Object cache from which netbufs are allocated.
+ */
+static struct objcache *netbuf_cache;
+
 /*
  * __netbuf_free()
  *	Callback to handle cleaning up a netbuf.
@@ -63,6 +77,9 @@ void __netbuf_free(void *buf)
 	if (nb->nb_hint_membuf) {
 		membuf_deref(nb->nb_hint_membuf);
 	}
+	if (nb->nb_data_membuf && (nb->nb_data_membuf != nb)) {
+		membuf_deref(nb->nb_data_membuf);
+	}
 }
 
 /*
@@ -72,7 +89,7 @@ struct netbuf *netbuf_alloc(void)
 {
 	struct netbuf *nb;
 	
-	nb = (struct netbuf *)membuf_alloc(sizeof(struct netbuf), __netbuf_free);
+	nb = (struct netbuf *)membuf_cache_alloc(netbuf_cache, __netbuf_free);
 	
 	nb->nb_datalink_membuf = NULL;
 	nb->nb_datalink = NULL;
@@ -88,10 +105,159 @@ struct netbuf *netbuf_alloc(void)
 	nb->nb_application_size = 0;
 	nb->nb_next = NULL;
 	nb->nb_hint_membuf = NULL;
+	nb->nb_headroom = 0;
+	nb->nb_data_membuf = NULL;
+	nb->nb_data_size = 0;
+	nb->nb_dst_cache = NULL;
+	nb->nb_rx_csum_start = NULL;
+
+	return nb;
+}
+
+/*
+ * netbuf_alloc_headroom()
+ *	Allocate a netbuf with space for the application data and lower layer headers.
+ *
+ * The caller fills in "size" bytes at nb_application.
+ */
+struct netbuf *netbuf_alloc_headroom(addr_t headroom, addr_t size)
+{
+	struct netbuf *nb;
+	
+	nb = netbuf_alloc();
+	nb->nb_application_membuf = membuf_alloc(headroom + size, NULL);
+	nb->nb_application = (u8_t *)nb->nb_application_membuf + headroom;
+	nb->nb_application_size = size;
+	nb->nb_headroom = headroom;
+
+	return nb;
+}
+
+/*
+ * netbuf_alloc_with_data()
+ *	Allocate a netbuf and "size" bytes of packet storage as a single membuf.
+ *
+ * This is intended for the receive paths, where a packet buffer and a netbuf
+ * are always needed together.  The storage immediately follows the netbuf
+ * and is described as the datalink layer.  As it shares the netbuf's
+ * reference count, nb_data_membuf points back at the netbuf itself (without
+ * a reference) so that clones know what they must keep hold of.
+ */
+struct netbuf *netbuf_alloc_with_data(addr_t size)
+{
+	struct netbuf *nb;
+	
+	nb = (struct netbuf *)membuf_alloc(sizeof(struct netbuf) + size, __netbuf_free);
+	
+	nb->nb_datalink_membuf = NULL;
+	nb->nb_datalink = nb + 1;
+	nb->nb_datalink_size = size;
+	nb->nb_network_membuf = NULL;
+	nb->nb_network = NULL;
+	nb->nb_network_size = 0;
+	nb->nb_transport_membuf = NULL;
+	nb->nb_transport = NULL;
+	nb->nb_transport_size = 0;
+	nb->nb_application_membuf = NULL;
+	nb->nb_application = NULL;
+	nb->nb_application_size = 0;
+	nb->nb_next = NULL;
+	nb->nb_hint_membuf = NULL;
+	nb->nb_headroom = 0;
+	nb->nb_data_membuf = nb;
+	nb->nb_data_size = size;
+	nb->nb_dst_cache = NULL;
+	nb->nb_rx_csum_start = NULL;
 
 	return nb;
 }
 
+/*
+ * netbuf_reclaim_headroom()
+ *	Allow a received netbuf to be sent back out without allocating headers.
+ *
+ * The inline storage in front of the network layer (where the datalink
+ * header arrived) becomes headroom for the headers pushed on the way back
+ * out.  This only applies to netbufs that hold their own inline data (see
+ * netbuf_alloc_with_data()).
+ */
+void netbuf_reclaim_headroom(struct netbuf *nb)
+{
+	if (nb->nb_data_membuf == nb) {
+		nb->nb_headroom = (u8_t *)nb->nb_network - (u8_t *)(nb + 1);
+	}
+}
+
+/*
+ * netbuf_push()
+ *	Find space for a header immediately in front of another layer.
+ *
+ * If the netbuf has no headroom, or the layer above doesn't live in it, or
+ * there's not enough of it left then we allocate a membuf instead.  Any
+ * membuf left over from an earlier send of this netbuf is released first.
+ * The headroom is at the start of the application membuf, or of the inline
+ * storage for a received netbuf (see netbuf_reclaim_headroom()).
+ */
+static void *netbuf_push(struct netbuf *nb, void **membuf, void *upper, addr_t size)
+{
+	u8_t *base;
+	u8_t *p;
+	
+	if (*membuf) {
+		membuf_deref(*membuf);
+		*membuf = NULL;
+	}
+
+	if (nb->nb_data_membuf == nb) {
+		base = (u8_t *)(nb + 1);
+	} else {
+		base = (u8_t *)nb->nb_application_membuf;
+	}
+	p = (u8_t *)upper;
+	if (nb->nb_headroom && (p >= base + size) && (p <= base + nb->nb_headroom)) {
+		return p - size;
+	}
+	
+	*membuf = membuf_alloc(size, NULL);
+	return *membuf;
+}
+
+/*
+ * netbuf_push_transport()
+ *	Add a transport layer header in front of the application data.
+ */
+void *netbuf_push_transport(struct netbuf *nb, addr_t size)
+{
+	nb->nb_transport = netbuf_push(nb, &nb->nb_transport_membuf, nb->nb_application, size);
+	nb->nb_transport_size = size;
+
+	return nb->nb_transport;
+}
+
+/*
+ * netbuf_push_network()
+ *	Add a network layer header in front of the transport layer.
+ */
+void *netbuf_push_network(struct netbuf *nb, addr_t size)
+{
+	nb->nb_network = netbuf_push(nb, &nb->nb_network_membuf, nb->nb_transport, size);
+	nb->nb_network_size = size;
+
+	return nb->nb_network;
+}
+
+/*
+ * netbuf_push_datalink()
+ *	Add a datalink layer header in front of the network layer.
+ */
+void *netbuf_push_datalink(struct netbuf *nb, addr_t size)
+{
+	nb->nb_datalink = netbuf_push(nb, &nb->nb_datalink_membuf, nb->nb_network, size);
+	nb->nb_datalink_size = size;
+
+	return nb->nb_datalink;
+}
+
 /*
  * netbuf_clone()
  *	Produce a clone (copy) of a netbuf.
@@ -102,7 +268,7 @@ struct netbuf *netbuf_clone(struct netbuf *orig)
 	
 	spinlock_lock(&netbuf_lock);
 	
-	nb = (struct netbuf *)membuf_alloc(sizeof(struct netbuf), __netbuf_free);
+	nb = (struct netbuf *)membuf_cache_alloc(netbuf_cache, __netbuf_free);
 		
 	memcpy(nb, orig, sizeof(struct netbuf));
         if (nb->nb_datalink_membuf) {
@@ -121,6 +287,10 @@ struct netbuf *netbuf_clone(struct netbuf *orig)
 	if (nb->nb_hint_membuf) {
 		membuf_ref(nb->nb_hint_membuf);
 	}
+	if (nb->nb_data_membuf) {
+		membuf_ref(nb->nb_data_membuf);
+	}
+	nb->nb_data_size = 0;
 		
 	spinlock_unlock(&netbuf_lock);
 
@@ -134,4 +304,5 @@ struct netbuf *netbuf_clone(struct netbuf *orig)
 void netbuf_init(void)
 {
 	spinlock_init(&netbuf_lock, 0x08);
+	netbuf_cache = membuf_cache_create(sizeof(struct netbuf), NETBUF_CACHE_SIZE);
 }
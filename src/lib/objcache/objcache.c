@@ -0,0 +1,165 @@
+/*
+ * objcache.c
+ *	Fixed-size object cache support.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ *
+ * Many of the objects that we allocate at run-time (netbufs, timers, sockets,
+ * etc) have a size that's known at compile time and are allocated and freed
+ * very frequently.  An object cache takes a single "slab" of memory from the
+ * heap, carves it up into objects of one size and keeps the unused ones on a
+ * free list.  Allocating or releasing an object is then just a case of
+ * popping or pushing the head of that list.
+ *
+ * If a cache's slab is exhausted we don't fail the allocation - we simply pass
+ * it on to the heap.  When such an object is released it's recognized as not
+ * being part of the slab and goes back to the heap too.
+ */
+#include "types.h"
+#include "memory.h"
+#include "debug.h"
+#include "context.h"
+#include "heap.h"
+#include "objcache.h"
+
+/*
+ * List of all object caches, and a lock to protect it.
+ */
+static struct objcache *objcache_list = NULL;
+static struct lock objcache_list_lock = {0, 0x08, 0xff};
+
+/*
+ * objcache_create()
+ *	Create a new object cache.
+ *
+ * Object sizes are rounded up so that every object can hold a free list
+ * pointer and remains suitably aligned.
+ */
+struct objcache *objcache_create(addr_t size, u16_t count)
+{
+	struct objcache *oc;
+	u8_t *obj;
+	u16_t i;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	oc = (struct objcache *)heap_alloc(sizeof(struct objcache));
+	oc->oc_size = size;
+	oc->oc_count = count;
+	oc->oc_in_use = 0;
+	oc->oc_high_water = 0;
+	oc->oc_overflows = 0;
+	oc->oc_free = NULL;
+	spinlock_init(&oc->oc_lock, 0x08);
+
+	/*
+	 * Build the slab and thread each object within it onto the free list.
+	 * We work backwards so that the list ends up in address order.
+	 */
+	oc->oc_slab = heap_alloc(size * count);
+	oc->oc_slab_end = (void *)((u8_t *)oc->oc_slab + (size * count));
+
+	obj = (u8_t *)oc->oc_slab_end;
+	for (i = 0; i < count; i++) {
+		obj -= size;
+		*((void **)obj) = oc->oc_free;
+		oc->oc_free = obj;
+	}
+
+	spinlock_lock(&objcache_list_lock);
+	oc->oc_next = objcache_list;
+	objcache_list = oc;
+	spinlock_unlock(&objcache_list_lock);
+
+	return oc;
+}
+
+/*
+ * objcache_alloc()
+ *	Allocate an object from a cache.
+ */
+void *objcache_alloc(struct objcache *oc)
+{
+	void *obj;
+
+	spinlock_lock(&oc->oc_lock);
+
+	obj = oc->oc_free;
+	if (obj) {
+		oc->oc_free = *((void **)obj);
+		oc->oc_in_use++;
+		if (oc->oc_in_use > oc->oc_high_water) {
+			oc->oc_high_water = oc->oc_in_use;
+		}
+
+		spinlock_unlock(&oc->oc_lock);
+		return obj;
+	}
+
+	oc->oc_overflows++;
+
+	spinlock_unlock(&oc->oc_lock);
+
+	return heap_alloc(oc->oc_size);
+}
+
+/*
+ * objcache_free()
+ *	Release an object back to its cache.
+ */
+void objcache_free(struct objcache *oc, void *obj)
+{
+	if (((addr_t)obj < (addr_t)oc->oc_slab) || ((addr_t)obj >= (addr_t)oc->oc_slab_end)) {
+		heap_free(obj);
+		return;
+	}
+
+	spinlock_lock(&oc->oc_lock);
+
+	*((void **)obj) = oc->oc_free;
+	oc->oc_free = obj;
+	oc->oc_in_use--;
+
+	spinlock_unlock(&oc->oc_lock);
+}
+
+/*
+ * objcache_dump_stats()
+ *
+ * For each cache the address of the cache is returned in oc_next.
+ */
+int objcache_dump_stats(struct objcache *obuf, int max)
+{
+	struct objcache *oc;
+	int ct = 0;
+
+	spinlock_lock(&objcache_list_lock);
+
+	oc = objcache_list;
+	while (oc && (ct < max)) {
+		spinlock_lock(&oc->oc_lock);
+		memcpy(obuf, oc, sizeof(struct objcache));
+		spinlock_unlock(&oc->oc_lock);
+		obuf->oc_next = oc;
+		obuf++;
+		ct++;
+		oc = oc->oc_next;
+	}
+
+	spinlock_unlock(&objcache_list_lock);
+
+	return ct;
+}
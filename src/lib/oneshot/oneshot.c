@@ -25,44 +25,147 @@
 #include "debug.h"
 #include "context.h"
 #include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
+#include "objcache.h"
 #include "oneshot.h"
 
 /*
- * One-shot timer list.
+ * One-shot timer wheel.
+ *
+ * Timers are hashed into a hierarchy of timing wheels by the tick at which
+ * they expire.  Level 0 holds the timers due within the next
+ * ONESHOT_WHEEL_SLOTS ticks, one slot per tick.  Each higher level holds
+ * timers further out, with each slot covering a whole revolution of the level
+ * below.  When the level 0 index wraps we "cascade" the next slot of level 1
+ * down into level 0 (and so on up the levels), so each timer is only moved
+ * at most once per level.
  */
-static struct oneshot *volatile oneshot_list = NULL;
+static struct oneshot *oneshot_wheel[ONESHOT_WHEEL_LEVELS][ONESHOT_WHEEL_SLOTS];
+static u32_t oneshot_ticks = 0;		/* The next wheel tick to be processed */
 static struct lock oneshot_lock;
 
+/*
+ * The furthest into the future that we can hash a timer.  Anything beyond
+ * this is parked in the top level and re-hashed each time it cascades.
+ */
+#define ONESHOT_WHEEL_SPAN ((1UL << (ONESHOT_WHEEL_BITS * ONESHOT_WHEEL_LEVELS)) - 1)
+
+/*
+ * Object cache from which timers are allocated.
+ */
+static struct objcache *oneshot_cache;
+
+/*
+ * oneshot_insert()
+ *	Hash a timer into the slot that matches its expiry tick.
+ *
+ * We assume that the oneshot lock is held and that the timer does not
+ * expire before the next tick to be processed.
+ */
+static void oneshot_insert(struct oneshot *os)
+{
+	u32_t expires = os->os_expires;
+	u32_t delta = expires - oneshot_ticks;
+	struct oneshot **slot;
+	u8_t level;
+
+	if (delta > ONESHOT_WHEEL_SPAN) {
+		expires = oneshot_ticks + ONESHOT_WHEEL_SPAN;
+		delta = ONESHOT_WHEEL_SPAN;
+	}
+
+	level = 0;
+	while ((delta >> ONESHOT_WHEEL_BITS) && (level < (ONESHOT_WHEEL_LEVELS - 1))) {
+		delta >>= ONESHOT_WHEEL_BITS;
+		level++;
+	}
+
+	slot = &oneshot_wheel[level][(expires >> (level * ONESHOT_WHEEL_BITS)) & ONESHOT_WHEEL_MASK];
+	os->os_next = *slot;
+	if (os->os_next) {
+		os->os_next->os_pprev = &os->os_next;
+	}
+	os->os_pprev = slot;
+	*slot = os;
+}
+
+/*
+ * oneshot_remove()
+ *	Unhook a timer from its wheel slot.
+ */
+static void oneshot_remove(struct oneshot *os)
+{
+	*os->os_pprev = os->os_next;
+	if (os->os_next) {
+		os->os_next->os_pprev = os->os_pprev;
+	}
+	os->os_next = NULL;
+	os->os_pprev = NULL;
+}
+
+/*
+ * oneshot_cascade()
+ *	Re-hash the timers in a higher level slot down the wheel.
+ *
+ * Returns the index of the slot that was cascaded so that our caller can
+ * tell whether this level has wrapped too.
+ */
+static u8_t oneshot_cascade(u8_t level)
+{
+	u8_t idx;
+	struct oneshot *os, *next;
+
+	idx = (u8_t)((oneshot_ticks >> (level * ONESHOT_WHEEL_BITS)) & ONESHOT_WHEEL_MASK);
+
+	/*
+	 * Take the whole slot list before we start as timers that are too far
+	 * out for the wheel may be hashed straight back into this slot.
+	 */
+	os = oneshot_wheel[level][idx];
+	oneshot_wheel[level][idx] = NULL;
+	while (os) {
+		next = os->os_next;
+		oneshot_insert(os);
+		os = next;
+	}
+
+	return idx;
+}
+
 /*
  * oneshot_tick()
  */
 void oneshot_tick(u16_t ticks)
 {
-	struct oneshot *os, **osprev;
+	struct oneshot *os;
 	struct oneshot *callq = NULL;
+	u8_t level;
 	
 	spinlock_lock(&oneshot_lock);
 		
 	/*
-	 * Look at our oneshot list.  Reduce the ticks down on each one, and if
-	 * we find that any have expired, remove them from this list and put
-	 * them onto a callback queue.
+	 * Step the wheel on by each tick in turn.  Whenever the level 0 index
+	 * wraps we cascade the next slot of each higher level down, stopping at
+	 * the first level that hasn't wrapped as well.  Every timer left in the
+	 * level 0 slot has then expired and is moved onto a callback queue.
 	 */
-	os = oneshot_list;
-	osprev = (struct oneshot **)&oneshot_list;
-	while (os) {
-		if (os->os_ticks_left <= (u32_t)ticks) {
+	while (ticks) {
+		if (!(oneshot_ticks & ONESHOT_WHEEL_MASK)) {
+			level = 1;
+			while ((level < ONESHOT_WHEEL_LEVELS) && !oneshot_cascade(level)) {
+				level++;
+			}
+		}
+
+		while ((os = oneshot_wheel[0][oneshot_ticks & ONESHOT_WHEEL_MASK])) {
+			oneshot_remove(os);
 			os->os_call_queue = callq;
 			callq = os;
-			*osprev = os->os_next;
-			os->os_next = NULL;
-		} else {
-			os->os_ticks_left -= (u32_t)ticks;
-			osprev = &os->os_next;
 		}
-			
-		os = os->os_next;
+
+		oneshot_ticks++;
+		ticks--;
 	}
 				
 	/*
@@ -101,25 +204,26 @@ struct oneshot *oneshot_alloc(void)
 {
 	struct oneshot *os;
 	
-	os = (struct oneshot *)membuf_alloc(sizeof(struct oneshot), NULL);
+	os = (struct oneshot *)membuf_cache_alloc(oneshot_cache, NULL);
         os->os_ticks_left = 0;
         os->os_callback = NULL;
         os->os_arg = NULL;
         os->os_next = NULL;
+        os->os_pprev = NULL;
                         	
 	return os;
 }
 
 /*
  * oneshot_attach()
- *	Attach a timer to the list.
+ *	Attach a timer to the wheel.
  */
 void oneshot_attach(struct oneshot *timer)
 {
 	spinlock_lock(&oneshot_lock);
 
 	if (DEBUG) {
-		if (timer->os_next) {
+		if (timer->os_pprev) {
 			debug_stop();
 			while (1) {
 				debug_print_pstr("\fAttach timer: ");
@@ -130,9 +234,16 @@ void oneshot_attach(struct oneshot *timer)
 			}
 		}
 	}
-	
-	timer->os_next = oneshot_list;
-	oneshot_list = timer;
+
+	/*
+	 * A timer with "n" ticks left triggers when the n'th tick from now is
+	 * processed.  Zero ticks is treated the same as one.
+	 */
+	timer->os_expires = oneshot_ticks;
+	if (timer->os_ticks_left) {
+		timer->os_expires += timer->os_ticks_left - 1;
+	}
+	oneshot_insert(timer);
         oneshot_ref(timer);
 					
 	spinlock_unlock(&oneshot_lock);
@@ -140,33 +251,52 @@ void oneshot_attach(struct oneshot *timer)
 
 /*
  * oneshot_detach()
- *	Detach a timer from the list.
+ *	Detach a timer from the wheel.
  */
 void oneshot_detach(struct oneshot *timer)
 {
-        struct oneshot *os;
-        struct oneshot **osprev;
-        	
 	spinlock_lock(&oneshot_lock);
 
 	/*
-	 * Walk the oneshot list and find the one we're to remove.
+	 * If the timer has already expired (or was never attached) then it's
+	 * not on the wheel and there's nothing to do.
 	 */
-	os = oneshot_list;
-	osprev = (struct oneshot **)&oneshot_list;
-	while (os) {
-		if (os == timer) {
-			*osprev = os->os_next;
-		        os->os_next = NULL;
-			oneshot_deref(timer);
+	if (timer->os_pprev) {
+		oneshot_remove(timer);
+		oneshot_deref(timer);
+	}
+
+	spinlock_unlock(&oneshot_lock);
+}
+
+/*
+ * isr_oneshot_get_idle_ticks()
+ *	Find how many ticks can pass before the timers need to be looked at.
+ *
+ * This is intended to be used by the idle context with interrupts disabled,
+ * at which point no other context can be part way through changing the wheel.
+ * We return the tick count (in the same sense as os_ticks_left) of the first
+ * level 0 slot that holds a timer, or of the next level 0 wrap if that comes
+ * sooner (a cascade may bring timers down at that point), limited to "max".
+ */
+u16_t isr_oneshot_get_idle_ticks(u16_t max)
+{
+	u32_t t = oneshot_ticks;
+	u16_t ticks = 1;
+
+	while (ticks < max) {
+		if (oneshot_wheel[0][t & ONESHOT_WHEEL_MASK]) {
+			break;
+		}
+
+		t++;
+		ticks++;
+		if (!(t & ONESHOT_WHEEL_MASK)) {
 			break;
 		}
-	
-		osprev = &os->os_next;
-		os = os->os_next;
 	}
 
-	spinlock_unlock(&oneshot_lock);
+	return ticks;
 }
 
 /*
@@ -176,16 +306,23 @@ int oneshot_dump_stats(struct oneshot *obuf, int max)
 {
 	struct oneshot *os;
         int ct = 0;
+	u8_t level;
+	u8_t idx;
 		
 	spinlock_lock(&oneshot_lock);
 
-	os = oneshot_list;
-	while (os && (ct < max)) {
-		memcpy(obuf, os, sizeof(struct oneshot));
-		obuf->os_next = os;
-		obuf++;
-		ct++;
-		os = os->os_next;
+	for (level = 0; level < ONESHOT_WHEEL_LEVELS; level++) {
+		for (idx = 0; idx < ONESHOT_WHEEL_SLOTS; idx++) {
+			os = oneshot_wheel[level][idx];
+			while (os && (ct < max)) {
+				memcpy(obuf, os, sizeof(struct oneshot));
+				obuf->os_ticks_left = os->os_expires - oneshot_ticks + 1;
+				obuf->os_next = os;
+				obuf++;
+				ct++;
+				os = os->os_next;
+			}
+		}
 	}
 	
 	spinlock_unlock(&oneshot_lock);
@@ -199,4 +336,5 @@ int oneshot_dump_stats(struct oneshot *obuf, int max)
 void oneshot_init(void)
 {
 	spinlock_init(&oneshot_lock, 0x12);
+	oneshot_cache = membuf_cache_create(sizeof(struct oneshot), ONESHOT_CACHE_SIZE);
 }
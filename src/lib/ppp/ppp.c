@@ -26,6 +26,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
 #include "timer.h"
@@ -401,11 +402,7 @@ static void lcp_send_netbuf(struct ppp_instance *pi, struct netbuf *nb)
 	ppp_ahdlc_server_ref(pas);
 	spinlock_unlock(&pi->pi_lock);
 
-	nb->nb_datalink_membuf = membuf_alloc(sizeof(u16_t), NULL);
-	nb->nb_datalink = nb->nb_datalink_membuf;
-	nb->nb_datalink_size = sizeof(u16_t);
-
-	protocol = (u16_t *)nb->nb_datalink;
+	protocol = (u16_t *)netbuf_push_datalink(nb, sizeof(u16_t));
 	*protocol = hton16(0xc021);
 
 	pas->pas_send(pas, nb);
@@ -1187,11 +1184,7 @@ void ppp_send_netbuf(void *srv, struct netbuf *nb)
 	ppp_ahdlc_server_ref(pas);
 	spinlock_unlock(&pi->pi_lock);
 
-	nb->nb_datalink_membuf = membuf_alloc(sizeof(u16_t), NULL);
-	nb->nb_datalink = nb->nb_datalink_membuf;
-	nb->nb_datalink_size = sizeof(u16_t);
-
-	protocol = (u16_t *)nb->nb_datalink;
+	protocol = (u16_t *)netbuf_push_datalink(nb, sizeof(u16_t));
 	*protocol = hton16(ps->ps_protocol);
 
 	pas->pas_send(pas, nb);
@@ -21,10 +21,12 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
-#include "heap.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
+#include "crc.h"
 #include "uart.h"
 #include "ppp_ahdlc.h"
 
@@ -46,20 +48,6 @@ struct ppp_ahdlc_hint {
 	u32_t pah_accm;			/* ACCM bitmask */
 };
 
-/*
- * Table space for the PPP CRC table and a lock to protect it during initialization.
- */
-static struct lock ppp_crc_lock = {0, 0x78, 0xff};
-static u16_t *ppp_crc = NULL;
-
-/*
- * update_crc()
- */
-static u16_t update_crc(u16_t orig_crc, u8_t val)
-{
-	return ((orig_crc >> 8) ^ ppp_crc[val ^ (orig_crc & 0xff)]);
-}
-
 /*
  * ppp_ahdlc_recv_u8()
  */
@@ -88,12 +76,15 @@ void ppp_ahdlc_recv_u8(void *clnt, u8_t ch)
 				/*
 				 * When we build the netbuf to be passed upwards, we get
 				 * a case of convenient memory syndrome and forget all
-				 * about the framing.
+				 * about the framing.  The frame was received
+				 * straight into the netbuf's own storage, and
+				 * summed for the IP checksums as it was unescaped.
 				 */
-				nb = netbuf_alloc();
-				nb->nb_datalink_membuf = pai->pai_recv_packet;
+				nb = pai->pai_recv_netbuf;
 				nb->nb_datalink = pai->pai_recv_packet + 2;
 				nb->nb_datalink_size = pai->pai_recv_octets - 4;
+				netbuf_set_rx_csum(nb, pai->pai_recv_packet, pai->pai_recv_octets,
+							ipcsum_fold(pai->pai_recv_csum));
 	                			
 				pac = pai->pai_client;
 				if (pac) {
@@ -106,7 +97,8 @@ void ppp_ahdlc_recv_u8(void *clnt, u8_t ch)
 						
 				netbuf_deref(nb);
 
-				pai->pai_recv_packet = membuf_alloc(MRU, NULL);
+				pai->pai_recv_netbuf = netbuf_alloc_with_data(MRU);
+				pai->pai_recv_packet = (u8_t *)pai->pai_recv_netbuf->nb_datalink;
 			}
 		}
 
@@ -114,6 +106,7 @@ void ppp_ahdlc_recv_u8(void *clnt, u8_t ch)
 		pai->pai_recv_esc = FALSE;
 		pai->pai_recv_ignore = FALSE;
 		pai->pai_recv_crc = 0xffff;
+		pai->pai_recv_csum = 0;
 	} else {
 		if (!pai->pai_recv_ignore) {
                 	if (ch == PPP_ESC) {
@@ -128,12 +121,13 @@ void ppp_ahdlc_recv_u8(void *clnt, u8_t ch)
 					pai->pai_recv_esc = FALSE;
 				}
                 		
+				pai->pai_recv_csum += ipcsum_u8(ch, pai->pai_recv_octets);
 				pai->pai_recv_packet[pai->pai_recv_octets++] = ch;
 				if (pai->pai_recv_octets >= MRU) {
 					pai->pai_recv_ignore = TRUE;
 				}
 			
-				pai->pai_recv_crc = update_crc(pai->pai_recv_crc, ch);
+				pai->pai_recv_crc = crc16_update(pai->pai_recv_crc, ch);
 			}
 		}
 	}
@@ -146,7 +140,7 @@ void ppp_ahdlc_recv_u8(void *clnt, u8_t ch)
  */
 static u16_t send_u8(struct uart_server *us, u8_t ch, u32_t accm, u16_t crc)
 {
-	crc = update_crc(crc, ch);
+	crc = crc16_update(crc, ch);
 		
 	if ((ch == PPP_FLAG) || (ch == PPP_ESC) || ((ch < 0x20) && (accm & ((u32_t)1 << ch)))) {
 		us->us_send(us, PPP_ESC);
@@ -405,23 +399,11 @@ struct ppp_ahdlc_instance *ppp_ahdlc_instance_alloc(struct uart_instance *ui)
 	struct ppp_ahdlc_instance *pai;
         struct uart_client *uc;
 
-        /*
-         * Is this the first instance of the PPP async service?  If it is then
-         * we need to create the CRC table.
-         */
-	spinlock_lock(&ppp_crc_lock);
-	if (!ppp_crc) {
-                int i;
-				
-		ppp_crc = heap_alloc(sizeof(u16_t) * 256);
-		for (i = 0; i < 256; i++) {
-			u16_t zx;
-			
-			zx = (i ^ (i << 4)) & 0xff;
-			ppp_crc[i] = (zx << 8) ^ (zx << 3) ^ (zx >> 4);
-		}
-	}
-	spinlock_unlock(&ppp_crc_lock);
+	/*
+	 * The FCS is the 16 bit CCITT CRC.  Make sure that the CRC library is
+	 * ready to calculate it.
+	 */
+	crc16_init();
 
 	pai = (struct ppp_ahdlc_instance *)membuf_alloc(sizeof(struct ppp_ahdlc_instance), NULL);
 	spinlock_init(&pai->pai_lock, 0x10);
@@ -431,8 +413,10 @@ struct ppp_ahdlc_instance *ppp_ahdlc_instance_alloc(struct uart_instance *ui)
 	pai->pai_server = NULL;
 	pai->pai_recv_esc = FALSE;
 	pai->pai_recv_octets = 0;
+	pai->pai_recv_csum = 0;
 	pai->pai_recv_ignore = TRUE;
-	pai->pai_recv_packet = membuf_alloc(MRU, NULL);
+	pai->pai_recv_netbuf = netbuf_alloc_with_data(MRU);
+	pai->pai_recv_packet = (u8_t *)pai->pai_recv_netbuf->nb_datalink;
 	pai->pai_accm = 0xffffffff;
 	pai->pai_send_queue = NULL;
 
@@ -22,6 +22,7 @@
 #include "debug.h"
 #include "context.h"
 #include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
 #include "timer.h"
@@ -29,6 +30,7 @@
 #include "ppp_ahdlc.h"
 #include "ppp.h"
 #include "ip_datalink.h"
+#include "ip_route.h"
 #include "ppp_ip.h"
 #include "ip.h"
 
@@ -744,6 +746,17 @@ static void ipcp_check_request(struct ppp_ip_instance *pii, u8_t *buf, u16_t sz,
 				if (optsz == 6) {
 					addr = hton32(*((u32_t *)buf));
 					p = frame_ack(pii, p, opt, optsz, buf);
+
+					/*
+					 * Keep a host route to our peer so that
+					 * packets can be forwarded to it.
+					 */
+					if (addr != pii->pii_remote_ip_addr) {
+						if (pii->pii_remote_ip_addr) {
+							ip_route_delete(pii->pii_remote_ip_addr, 32);
+						}
+						ip_route_add(&pii->pii_idi, addr, 32, 0x00000000);
+					}
 					pii->pii_remote_ip_addr = addr;
 				}
 			}
@@ -1057,6 +1070,7 @@ struct ip_datalink_instance *ppp_ip_instance_alloc(struct ppp_instance *pi)
 	spinlock_init(&idi->idi_lock, 0x20);
 	idi->idi_mru = 1500;
 	idi->idi_mtu = 1500;
+	idi->idi_dst_gen = 0;
 	idi->idi_client = NULL;
 	idi->idi_client_attach = ppp_ip_client_attach;
 	idi->idi_client_detach = ip_datalink_client_detach;
@@ -1067,6 +1081,7 @@ struct ip_datalink_instance *ppp_ip_instance_alloc(struct ppp_instance *pi)
 	pii->pii_timeout_timer = oneshot_alloc();
 	pii->pii_timeout_timer->os_callback = ipcp_tick_timeout;
 	pii->pii_timeout_timer->os_arg = pi;
+	pii->pii_remote_ip_addr = 0;
 	pii->pii_local_ip_addr = 0xbe010102;
 	pii->pii_local_ip_addr_usage = PPP_USAGE_ACK;
 
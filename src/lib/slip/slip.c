@@ -22,8 +22,10 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "uart.h"
 #include "ip_datalink.h"
 #include "slip.h"
@@ -60,10 +62,18 @@ void slip_recv_u8(void *clnt, u8_t ch)
 			struct netbuf *nb;
 			struct ip_datalink_client *idc;
 
-			nb = netbuf_alloc();
-			nb->nb_network_membuf = si->si_recv_packet;
+			/*
+			 * The packet was received straight into the netbuf's
+			 * own storage.  SLIP has no datalink header so it's
+			 * all network layer.  We summed it as we unescaped
+			 * it, so the transport layers needn't read it again.
+			 */
+			nb = si->si_recv_netbuf;
+			nb->nb_datalink = NULL;
+			nb->nb_datalink_size = 0;
 			nb->nb_network = si->si_recv_packet;
 			nb->nb_network_size = si->si_recv_octets;
+			netbuf_set_rx_csum(nb, si->si_recv_packet, si->si_recv_octets, ipcsum_fold(si->si_recv_csum));
 	                			
 			idc = idi->idi_client;
 			if (idc) {
@@ -76,10 +86,12 @@ void slip_recv_u8(void *clnt, u8_t ch)
 						
 			netbuf_deref(nb);
 						
-			si->si_recv_packet = membuf_alloc(MRU, NULL);
+			si->si_recv_netbuf = netbuf_alloc_with_data(MRU);
+			si->si_recv_packet = (u8_t *)si->si_recv_netbuf->nb_datalink;
 		}
 
 		si->si_recv_octets = 0;
+		si->si_recv_csum = 0;
 		si->si_recv_esc = FALSE;
 		si->si_recv_ignore = FALSE;
 	} else {
@@ -105,6 +117,7 @@ void slip_recv_u8(void *clnt, u8_t ch)
 					si->si_recv_esc = FALSE;
 				}
 
+				si->si_recv_csum += ipcsum_u8(ch, si->si_recv_octets);
 				si->si_recv_packet[si->si_recv_octets++] = ch;
 				if (si->si_recv_octets >= MRU) {
 					si->si_recv_ignore = TRUE;
@@ -279,6 +292,7 @@ struct ip_datalink_instance *slip_instance_alloc(struct uart_instance *ui)
 	spinlock_init(&idi->idi_lock, 0x10);
 	idi->idi_mru = MRU;
 	idi->idi_mtu = MRU;
+	idi->idi_dst_gen = 0;
 	idi->idi_client = NULL;
 	idi->idi_client_attach = slip_client_attach;
 	idi->idi_client_detach = ip_datalink_client_detach;
@@ -286,8 +300,10 @@ struct ip_datalink_instance *slip_instance_alloc(struct uart_instance *ui)
 	si->si_server = NULL;
 	si->si_recv_esc = FALSE;
 	si->si_recv_octets = 0;
+	si->si_recv_csum = 0;
 	si->si_recv_ignore = TRUE;
-	si->si_recv_packet = membuf_alloc(MRU, NULL);
+	si->si_recv_netbuf = netbuf_alloc_with_data(MRU);
+	si->si_recv_packet = (u8_t *)si->si_recv_netbuf->nb_datalink;
 	si->si_send_queue = NULL;
         	
 	thread_create(slip_send_thread, idi, 0x1000, 0x89);
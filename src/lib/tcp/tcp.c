@@ -28,7 +28,9 @@
 #include "debug.h"
 #include "context.h"
 #include "condvar.h"
+#include "atomic.h"
 #include "membuf.h"
+#include "objcache.h"
 #include "netbuf.h"
 #include "ipcsum.h"
 #include "timer.h"
@@ -48,9 +50,41 @@ void tcp_tick_time_wait(void *sock);
 void tcp_send_sequence(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb);
 void tcp_build_and_send_sequence(struct tcp_instance *ti, struct tcp_socket *sock, u8_t ctrl_flags);
 void tcp_send_netbuf_now(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb);
+void tcp_send_queued(struct tcp_instance *ti, struct tcp_socket *sock);
 struct tcp_client *tcp_client_alloc(void);
 struct tcp_server *tcp_client_attach(struct tcp_instance *ti, struct tcp_client *tc);
 
+/*
+ * Object cache from which TCP sockets are allocated.  This is shared between
+ * all TCP instances.
+ */
+static struct objcache *tcp_socket_cache = NULL;
+
+/*
+ * tcp_flush_recv_queues()
+ *	Release the out-of-order segments and any segments held by our client.
+ */
+static void tcp_flush_recv_queues(struct tcp_socket *ts)
+{
+	struct netbuf *nb;
+	u8_t i;
+
+	while (ts->ts_rcv_ooo) {
+		nb = ts->ts_rcv_ooo;
+		ts->ts_rcv_ooo = nb->nb_next;
+		netbuf_deref(nb);
+	}
+	ts->ts_rcv_ooo_size = 0;
+	ts->ts_rcv_ooo_segs = 0;
+
+	for (i = 0; i < TCP_RCV_HELD_SLOTS; i++) {
+		if (ts->ts_rcv_held[i]) {
+			netbuf_deref(ts->ts_rcv_held[i]);
+			ts->ts_rcv_held[i] = NULL;
+		}
+	}
+}
+
 /*
  * __tcp_socket_free()
  */
@@ -58,6 +92,7 @@ void __tcp_socket_free(void *sock)
 {
 	struct tcp_socket *ts = (struct tcp_socket *)sock;
 
+	tcp_flush_recv_queues(ts);
 	oneshot_deref(ts->ts_wait_timer);
 	oneshot_deref(ts->ts_deferred_ack_timer);
 }
@@ -68,19 +103,47 @@ void __tcp_socket_free(void *sock)
 struct tcp_socket *tcp_socket_alloc(struct tcp_instance *ti)
 {
 	struct tcp_socket *ts;
+	u8_t i;
 	
-	ts = (struct tcp_socket *)membuf_alloc(sizeof(struct tcp_socket), __tcp_socket_free);
+	ts = (struct tcp_socket *)membuf_cache_alloc(tcp_socket_cache, __tcp_socket_free);
 	ts->ts_snd_nxt = 0x00a8393a;
 	ts->ts_snd_una = ts->ts_snd_nxt;
 	ts->ts_next = NULL;
 	ts->ts_state = TCS_CLOSED;
+	ip_dst_cache_init(&ts->ts_dst);
+	ts->ts_snd_wnd = 0;
+	ts->ts_rcv_nxt = 0;
+	ts->ts_rcv_adv = 0;
+	ts->ts_rcv_ooo = NULL;
+	ts->ts_rcv_ooo_size = 0;
+	ts->ts_rcv_ooo_segs = 0;
+	for (i = 0; i < TCP_RCV_HELD_SLOTS; i++) {
+		ts->ts_rcv_held[i] = NULL;
+	}
 	ts->ts_awaiting_send = NULL;
+	ts->ts_awaiting_ack = NULL;
 	ts->ts_awaiting_accept = NULL;
 	ts->ts_rto_next = 3 * TICK_RATE;
 	ts->ts_srtt_avg = 0;
 	ts->ts_srtt_var = 3 * TICK_RATE;
 	ts->ts_remote_mss = 536;
-	ts->ts_send_flags = 0;
+	ts->ts_send_flags = TCP_SND_ACKED;
+	ts->ts_opt_flags = 0;
+	ts->ts_snd_wscale = 0;
+	ts->ts_rcv_wscale = 0;
+	while ((TCP_RCV_BUF_SIZE >> ts->ts_rcv_wscale) > 0xffff) {
+		ts->ts_rcv_wscale++;
+	}
+	ts->ts_ts_recent = 0;
+	ts->ts_seg_tsecr = 0;
+	ts->ts_seg_sacks = 0;
+	ts->ts_sacks = 0;
+	ts->ts_rexmit_nxt = ts->ts_snd_una;
+	ts->ts_rcv_sack_last = 0;
+	ts->ts_fast_retransmits = 0;
+	ts->ts_timeouts = 0;
+	ts->ts_cong = ti->ti_cong;
+	ts->ts_cong->tco_init(ts);
 
 	ts->ts_deferred_ack_timer = oneshot_alloc();
 	ts->ts_deferred_ack_timer->os_callback = tcp_tick_deferred_ack;
@@ -99,45 +162,117 @@ struct tcp_socket *tcp_socket_alloc(struct tcp_instance *ti)
 	return ts;
 }
 
+/*
+ * tcp_conn_bucket()
+ *	Find the hash bucket for a connected socket.
+ */
+static struct tcp_socket **tcp_conn_bucket(struct tcp_instance *ti, u32_t addr, u16_t rport, u16_t lport)
+{
+	u16_t h;
+
+	h = (u16_t)(addr ^ (addr >> 16)) ^ rport ^ (lport << 3);
+	h ^= (h >> 8);
+
+	return &ti->ti_conn_hash[h & (TCP_CONN_HASH_SIZE - 1)];
+}
+
+/*
+ * tcp_listen_bucket()
+ *	Find the hash bucket for a listening socket.
+ */
+static struct tcp_socket **tcp_listen_bucket(struct tcp_instance *ti, u16_t lport)
+{
+	return &ti->ti_listen_hash[(lport ^ (lport >> 8)) & (TCP_LISTEN_HASH_SIZE - 1)];
+}
+
+/*
+ * tcp_socket_bucket()
+ *	Find the hash bucket that a socket belongs in.
+ */
+static struct tcp_socket **tcp_socket_bucket(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	if (sock->ts_state == TCS_LISTEN) {
+		return tcp_listen_bucket(ti, sock->ts_local_port);
+	}
+
+	return tcp_conn_bucket(ti, sock->ts_remote_addr, sock->ts_remote_port, sock->ts_local_port);
+}
+
+/*
+ * tcp_socket_lookup()
+ *	Find the connected socket for a remote address and port and local port.
+ *
+ * It is assumed that the tcp socket lock is held on entry to this function.
+ */
+static struct tcp_socket *tcp_socket_lookup(struct tcp_instance *ti, u32_t addr, u16_t rport, u16_t lport)
+{
+	struct tcp_socket *ts;
+
+	ts = *tcp_conn_bucket(ti, addr, rport, lport);
+	while (ts) {
+		if ((ts->ts_remote_addr == addr)
+				&& (ts->ts_remote_port == rport)
+				&& (ts->ts_local_port == lport)) {
+			break;
+		}
+		ts = ts->ts_hash_next;
+	}
+
+	return ts;
+}
+
+/*
+ * tcp_listener_lookup()
+ *	Find the listening socket for a local port.
+ *
+ * It is assumed that the tcp socket lock is held on entry to this function.
+ */
+static struct tcp_socket *tcp_listener_lookup(struct tcp_instance *ti, u16_t lport)
+{
+	struct tcp_socket *ts;
+
+	ts = *tcp_listen_bucket(ti, lport);
+	while (ts) {
+		if (ts->ts_local_port == lport) {
+			break;
+		}
+		ts = ts->ts_hash_next;
+	}
+
+	return ts;
+}
+
 /*
  * tcp_socket_attach()
  *
  * It is assumed that the tcp socket lock is held on entry to this function.
+ *
+ * The socket is hashed into the listening or connected socket table, so the
+ * clash check only needs to look at its own bucket.  A clash is either trying
+ * to attach a passive socket where one already exists, or a connected socket
+ * where the same connection already exists.
  */
 void tcp_socket_attach(struct tcp_instance *ti, struct tcp_socket *sock)
 {
-        struct tcp_socket *ts;
-	
-	ts = ti->ti_socks;
+        struct tcp_socket **bucket;
 	
-	/*
-	 * We loop until we've either run out of sockets to check, or, until we
-	 * find a socket that clashes.  A clash is either trying to attach a
-	 * passive socket where one already exists, or a connected socket where
-	 * the same connection already exists.
-	 */
-	while (ts) {
-		if (ts->ts_local_port == sock->ts_local_port) {
-			if (sock->ts_state == TCS_LISTEN) {
-				if (ts->ts_state == TCS_LISTEN) {
-					break;
-				}
-			} else {
-				if ((ts->ts_state != TCS_LISTEN)
-						&& (ts->ts_remote_addr == sock->ts_remote_addr)
-						&& (ts->ts_remote_port == sock->ts_remote_port)) {
-					break;
-				}
-			}
+	if (sock->ts_state == TCS_LISTEN) {
+		if (tcp_listener_lookup(ti, sock->ts_local_port)) {
+			return;
+		}
+	} else {
+		if (tcp_socket_lookup(ti, sock->ts_remote_addr, sock->ts_remote_port, sock->ts_local_port)) {
+			return;
 		}
-		ts = ts->ts_next;
 	}
 
-	if (!ts) {
-		sock->ts_next = ti->ti_socks;
-		ti->ti_socks = sock;
-		tcp_socket_ref(sock);
-	}
+	bucket = tcp_socket_bucket(ti, sock);
+	sock->ts_hash_next = *bucket;
+	*bucket = sock;
+
+	sock->ts_next = ti->ti_socks;
+	ti->ti_socks = sock;
+	tcp_socket_ref(sock);
 }
 
 /*
@@ -155,13 +290,216 @@ void tcp_socket_detach(struct tcp_instance *ti, struct tcp_socket *sock)
 	while (ts) {
 		if (ts == sock) {
 			*tsprev = ts->ts_next;
-			tcp_socket_deref(sock);
 			break;
 		}
 	
 		tsprev = &ts->ts_next;
 		ts = ts->ts_next;
 	}
+
+	if (!ts) {
+		return;
+	}
+
+	tsprev = tcp_socket_bucket(ti, sock);
+	ts = *tsprev;
+	while (ts) {
+		if (ts == sock) {
+			*tsprev = ts->ts_hash_next;
+			break;
+		}
+
+		tsprev = &ts->ts_hash_next;
+		ts = ts->ts_hash_next;
+	}
+
+	tcp_socket_deref(sock);
+}
+
+/*
+ * tcp_socket_template()
+ *	Prebuild the parts of our segments that don't change.
+ *
+ * The ports, and the addresses and protocol in the pseudo header, stay the
+ * same for as long as a socket talks to the same peer, so we work these out
+ * once and reuse them for every segment.  This must be called again whenever
+ * a socket's ports or remote address change.
+ */
+static void tcp_socket_template(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	struct tcp_header *tch = &sock->ts_hdr_tmpl;
+
+	tch->th_src_port = hton16(sock->ts_local_port);
+	tch->th_dest_port = hton16(sock->ts_remote_port);
+	tch->th_sequence = 0;
+	tch->th_ack = 0;
+	tch->th_res1 = 0;
+	tch->th_data_offs = sizeof(struct tcp_header) / 4;
+	tch->th_ctrl_flags = 0;
+	tch->th_window = 0;
+	tch->th_csum = 0;
+	tch->th_urgent_ptr = 0;
+
+	sock->ts_pseudo_csum = ipcsum_pseudo_partial(hton32(((struct ip_instance *)ti->ti_server->is_instance)->ii_addr),
+							hton32(sock->ts_remote_addr), 0x06, 0);
+}
+
+/*
+ * tcp_local_mss()
+ *	Find the largest segment that our datalink layer can receive.
+ */
+static u16_t tcp_local_mss(struct tcp_instance *ti)
+{
+	return ti->ti_server->is_instance->ii_server->ids_instance->idi_mru
+			- sizeof(struct tcp_header) - sizeof(struct ip_header);
+}
+
+/*
+ * tcp_rcv_held_full()
+ *	Check whether every slot for segments held by our client is in use.
+ *
+ * We release the client's segments as soon as we find that we hold the only
+ * reference to them.  If all of the slots are still in use afterwards then
+ * we couldn't charge any more segments that our client keeps against our
+ * receive window, so we mustn't accept any more data until one frees up.
+ */
+static u8_t tcp_rcv_held_full(struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+	u8_t i, full;
+
+	full = TRUE;
+	for (i = 0; i < TCP_RCV_HELD_SLOTS; i++) {
+		nb = sock->ts_rcv_held[i];
+		if (nb && (netbuf_get_refs(nb) == 1)) {
+			netbuf_deref(nb);
+			sock->ts_rcv_held[i] = NULL;
+			nb = NULL;
+		}
+
+		if (!nb) {
+			full = FALSE;
+		}
+	}
+
+	return full;
+}
+
+/*
+ * tcp_rcv_window()
+ *	Work out the receive window that we should advertise.
+ *
+ * The window is whatever is left of our receive buffer budget once the
+ * out-of-order segments and any segments that our client is still holding
+ * have been accounted for.  If our client is holding as many segments as we
+ * can keep track of then we don't open the window any further.
+ *
+ * We never move the right edge of the window backwards (RFC793 strongly
+ * discourages shrinking the window) and to avoid the "silly window syndrome"
+ * we don't move it forwards by less than the smaller of one MSS or half of
+ * our buffer (RFC1122 para 4.2.3.3).
+ */
+static u32_t tcp_rcv_window(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+	u32_t used, wnd, edge, min_step;
+	u8_t i, full;
+
+	full = tcp_rcv_held_full(sock);
+
+	used = sock->ts_rcv_ooo_size;
+	for (i = 0; i < TCP_RCV_HELD_SLOTS; i++) {
+		nb = sock->ts_rcv_held[i];
+		if (nb) {
+			used += nb->nb_application_size;
+		}
+	}
+
+	wnd = (!full && (used < TCP_RCV_BUF_SIZE)) ? (TCP_RCV_BUF_SIZE - used) : 0;
+
+	edge = 0;
+	if (SEQ_GT(sock->ts_rcv_adv, sock->ts_rcv_nxt)) {
+		edge = sock->ts_rcv_adv - sock->ts_rcv_nxt;
+	}
+
+	min_step = tcp_local_mss(ti);
+	if (min_step > (TCP_RCV_BUF_SIZE / 2)) {
+		min_step = TCP_RCV_BUF_SIZE / 2;
+	}
+
+	if ((wnd < edge) || ((wnd - edge) < min_step)) {
+		wnd = edge;
+	}
+
+	sock->ts_rcv_adv = sock->ts_rcv_nxt + wnd;
+
+	return wnd;
+}
+
+/*
+ * tcp_recv_seq()
+ *	Find the sequence number of the first byte of a received segment's data.
+ *
+ * The data may have been trimmed from the front, so we work this out from
+ * where the data now starts rather than just using the header.
+ */
+static u32_t tcp_recv_seq(struct netbuf *nb)
+{
+	struct tcp_header *tch = (struct tcp_header *)nb->nb_transport;
+
+	return hton32(tch->th_sequence)
+			+ (u32_t)((u8_t *)nb->nb_application - ((u8_t *)tch + (tch->th_data_offs * 4)));
+}
+
+/*
+ * tcp_rcv_sack_blocks()
+ *	Describe the out-of-order data that we're holding as SACK blocks.
+ *
+ * Segments that touch or overlap are merged into a single block.  The block
+ * holding the most recently received segment goes first (RFC2018) and the
+ * others follow in sequence order, up to a limit of "max" blocks.  We assume
+ * that there's at least one out-of-order segment.
+ */
+static u8_t tcp_rcv_sack_blocks(struct tcp_socket *sock, struct tcp_sack_block *blocks, u8_t max)
+{
+	struct tcp_sack_block all[TCP_RCV_OOO_SEGS];
+	struct netbuf *nb;
+	u32_t seq;
+	u8_t n, i, first, count;
+
+	n = 0;
+	for (nb = sock->ts_rcv_ooo; nb; nb = nb->nb_next) {
+		seq = tcp_recv_seq(nb);
+		if (n && SEQ_LE(seq, all[n - 1].tsb_right)) {
+			if (SEQ_GT(seq + nb->nb_application_size, all[n - 1].tsb_right)) {
+				all[n - 1].tsb_right = seq + nb->nb_application_size;
+			}
+			continue;
+		}
+
+		all[n].tsb_left = seq;
+		all[n].tsb_right = seq + nb->nb_application_size;
+		n++;
+	}
+
+	first = 0;
+	for (i = 0; i < n; i++) {
+		if (SEQ_GE(sock->ts_rcv_sack_last, all[i].tsb_left)
+				&& SEQ_LT(sock->ts_rcv_sack_last, all[i].tsb_right)) {
+			first = i;
+			break;
+		}
+	}
+
+	blocks[0] = all[first];
+	count = 1;
+	for (i = 0; (i < n) && (count < max); i++) {
+		if (i != first) {
+			blocks[count++] = all[i];
+		}
+	}
+
+	return count;
 }
 
 /*
@@ -169,7 +507,8 @@ void tcp_socket_detach(struct tcp_instance *ti, struct tcp_socket *sock)
  *	Build a TCP netbuf.
  *
  * The assumption here is that the netbuf structure has already been allocated
- * pointers to the network and transport layers.
+ * pointers to the network and transport layers.  If it was allocated with
+ * headroom then the TCP header is built in place in front of the data.
  *
  * Note that we assume that all parameters are supplied in network byte order.
  * We also assume that the instance is locked when we're called.
@@ -177,83 +516,256 @@ void tcp_socket_detach(struct tcp_instance *ti, struct tcp_socket *sock)
 static void build_netbuf(struct tcp_instance *ti, struct tcp_socket *sock, u8_t ctrl_flags, struct netbuf *nb)
 {
 	struct tcp_header *tch;
-        u8_t sz;
-        	
+	struct tcp_sack_block blocks[TCP_SACK_BLOCKS];
+	u8_t *p;
+	u8_t sz, opts, nblocks, i;
+	u32_t wnd;
+
+	/*
+	 * Work out which options we're going to send.  On a SYN we offer
+	 * everything that we support, unless we're answering our peer's SYN,
+	 * in which case we can only agree to what they offered.  After that
+	 * timestamps go in every segment and, if we're holding out-of-order
+	 * data, SACK blocks go in any segment that doesn't carry data.
+	 */
+	if (ctrl_flags & TCF_SYN) {
+		opts = (ctrl_flags & TCF_ACK) ? sock->ts_opt_flags : TCP_OPT_ALL;
+	} else {
+		opts = sock->ts_opt_flags & TCP_OPT_TSTAMP;
+	}
+
+	nblocks = 0;
+	if (!(ctrl_flags & TCF_SYN) && (sock->ts_opt_flags & TCP_OPT_SACK)
+			&& sock->ts_rcv_ooo && (nb->nb_application_size == 0)) {
+		nblocks = tcp_rcv_sack_blocks(sock, blocks, (opts & TCP_OPT_TSTAMP) ? 3 : 4);
+	}
+
 	/*
-	 * Are we building a SYN packet?  If we are then we extend the TCP
-	 * header with space for an MSS-size option.
+	 * Size the header.  Each option is padded to a multiple of 4 bytes
+	 * with NOPs in front of it.
 	 */
 	sz = sizeof(struct tcp_header);
+	if (opts & TCP_OPT_TSTAMP) {
+		sz += 12;
+	}
 	if (ctrl_flags & TCF_SYN) {
 		sz += 4;
+		if (opts & TCP_OPT_WSCALE) {
+			sz += 4;
+		}
+		if (opts & TCP_OPT_SACK) {
+			sz += 4;
+		}
+	}
+	if (nblocks) {
+		sz += 4 + (nblocks * 8);
 	}
 
-	nb->nb_transport_membuf = membuf_alloc(sz, NULL);
-	nb->nb_transport = nb->nb_transport_membuf;
-	nb->nb_transport_size = sz;
-	
-	tch = (struct tcp_header *)nb->nb_transport;
-	tch->th_dest_port = hton16(sock->ts_remote_port);
-	tch->th_src_port = hton16(sock->ts_local_port);
+	/*
+	 * The window in a SYN is never scaled.
+	 */
+	wnd = tcp_rcv_window(ti, sock);
+	if (ctrl_flags & TCF_SYN) {
+		if (wnd > 0xffff) {
+			wnd = 0xffff;
+			sock->ts_rcv_adv = sock->ts_rcv_nxt + wnd;
+		}
+	} else {
+		wnd >>= sock->ts_rcv_wscale;
+	}
+
+	tch = (struct tcp_header *)netbuf_push_transport(nb, sz);
+	*tch = sock->ts_hdr_tmpl;
 	tch->th_sequence = hton32(sock->ts_snd_nxt);
 	tch->th_data_offs = sz / 4;
 	tch->th_ctrl_flags = ctrl_flags;
-	tch->th_window = hton16(2048);
-	tch->th_urgent_ptr = 0;
+	tch->th_window = hton16((u16_t)wnd);
+
+	p = (u8_t *)(tch + 1);
+
+	if (opts & TCP_OPT_TSTAMP) {
+		/*
+		 * Timestamps option.  This always goes first so that
+		 * tcp_send_sequence() can find it and fill it in when the
+		 * segment is actually sent.
+		 */
+		*p++ = 0x01;
+		*p++ = 0x01;
+		*p++ = 0x08;
+		*p++ = 10;
+		*((u32_t *)p) = 0;
+		*((u32_t *)(p + 4)) = 0;
+		p += 8;
+	}
 
 	if (ctrl_flags & TCF_SYN) {
-	        u8_t *p;
-		
 		/*
 		 * MSS size option.  Look up the MRU for our datalink layer and
 		 * advertise our MSS as being the largest that is supportable.
 		 */
-		p = (u8_t *)(tch + 1);
 		*p++ = 0x02;
 		*p++ = 4;
-		*((u16_t *)p) = hton16(ti->ti_server->is_instance->ii_server->ids_instance->idi_mru
-					- sizeof(struct tcp_header) - sizeof(struct ip_header));
+		*((u16_t *)p) = hton16(tcp_local_mss(ti));
+		p += 2;
+
+		if (opts & TCP_OPT_WSCALE) {
+			*p++ = 0x01;
+			*p++ = 0x03;
+			*p++ = 3;
+			*p++ = sock->ts_rcv_wscale;
+		}
+
+		if (opts & TCP_OPT_SACK) {
+			*p++ = 0x01;
+			*p++ = 0x01;
+			*p++ = 0x04;
+			*p++ = 2;
+		}
+	}
+
+	if (nblocks) {
+		*p++ = 0x01;
+		*p++ = 0x01;
+		*p++ = 0x05;
+		*p++ = 2 + (nblocks * 8);
+		for (i = 0; i < nblocks; i++) {
+			*((u32_t *)p) = hton32(blocks[i].tsb_left);
+			*((u32_t *)(p + 4)) = hton32(blocks[i].tsb_right);
+			p += 8;
+		}
 	}
 }
 
 /*
- * tcp_send_close()
+ * tcp_seg_end()
+ *	Find the sequence number that follows a segment that we've built.
  */
-void tcp_send_close(struct tcp_instance *ti, struct tcp_socket *sock)
+static u32_t tcp_seg_end(struct netbuf *nb)
 {
-	struct netbuf *nb;
+	struct tcp_header *tch;
+	u32_t end;
 
-	/*
-	 * Build our close request's packet's buffers.
-	 */	
-	nb = netbuf_alloc();
-        		
-	spinlock_lock(&ti->ti_lock);
+	tch = (struct tcp_header *)nb->nb_transport;
+	end = hton32(tch->th_sequence) + nb->nb_application_size;
+	if (tch->th_ctrl_flags & TCF_SYN) {
+		end++;
+	}
+	if (tch->th_ctrl_flags & TCF_FIN) {
+		end++;
+	}
 
-	/*
-	 * If we had a previously deferred ACK then we can eliminate it now
-	 * because we're going to send the FIN, ACK instead.
-	 */
-	if (sock->ts_send_flags & TCP_SND_DEFERRED_ACK) {
-		sock->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
-		oneshot_detach(sock->ts_deferred_ack_timer);
-		tcp_socket_deref(sock);
-		netbuf_deref(sock->ts_deferred_ack);
+	return end;
+}
+
+/*
+ * tcp_queue_retransmit()
+ *	Hold a copy of a segment that we're about to send until it's ACK'd.
+ *
+ * The copy goes on the end of the retransmission queue.  If the queue was
+ * empty then we start the retransmit timer, and if we're not already timing
+ * a segment then we time this one.  We assume that the segment has been built
+ * and that SND-NXT has already been moved past it.
+ */
+static void tcp_queue_retransmit(struct tcp_socket *sock, struct netbuf *nb)
+{
+	struct netbuf *p;
+	struct netbuf **pprev;
+
+	pprev = &sock->ts_awaiting_ack;
+	p = sock->ts_awaiting_ack;
+	while (p) {
+		pprev = &p->nb_next;
+		p = p->nb_next;
 	}
-	
-	/*
-	 * Build and send our FIN, ACK packet.
-	 */
-	build_netbuf(ti, sock, TCF_ACK | TCF_FIN, nb);
+	*pprev = netbuf_clone(nb);
+
+	if (!(sock->ts_send_flags & TCP_SND_RETRANS_TIMING)) {
+		sock->ts_send_flags |= TCP_SND_RETRANS_TIMING;
+		sock->ts_retransmits = 0;
+		sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
+		tcp_socket_ref(sock);
+		oneshot_attach(sock->ts_wait_timer);
+	}
+
+	if (sock->ts_send_flags & TCP_SND_ACKED) {
+		sock->ts_send_flags &= (~TCP_SND_ACKED);
+		sock->ts_rtt_seq = sock->ts_snd_nxt;
+		sock->ts_send_jiffies = timer_get_jiffies();
+	}
+}
+
+/*
+ * tcp_stop_retransmit()
+ *	Stop the retransmit timer and discard the retransmission queue.
+ */
+static void tcp_stop_retransmit(struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+
+	if (!(sock->ts_send_flags & TCP_SND_RETRANS_TIMING)) {
+		return;
+	}
+
+	sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
+	oneshot_detach(sock->ts_wait_timer);
+	tcp_socket_deref(sock);
+
+	while (sock->ts_awaiting_ack) {
+		nb = sock->ts_awaiting_ack;
+		sock->ts_awaiting_ack = nb->nb_next;
+		netbuf_deref(nb);
+	}
+}
+
+/*
+ * tcp_flush_send_queues()
+ *	Discard everything that we've sent or were waiting to send.
+ */
+static void tcp_flush_send_queues(struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+
+	tcp_stop_retransmit(sock);
+
+	while (sock->ts_awaiting_send) {
+		nb = sock->ts_awaiting_send;
+		sock->ts_awaiting_send = nb->nb_next;
+		netbuf_deref(nb);
+	}
+}
+
+/*
+ * tcp_send_close()
+ */
+void tcp_send_close(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+
+	/*
+	 * Build our close request's packet's buffers.
+	 */	
+	nb = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 0);
+        		
+	spinlock_lock(&ti->ti_lock);
+
+	/*
+	 * If we had a previously deferred ACK then we can eliminate it now
+	 * because we're going to send the FIN, ACK instead.
+	 */
+	if (sock->ts_send_flags & TCP_SND_DEFERRED_ACK) {
+		sock->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
+		oneshot_detach(sock->ts_deferred_ack_timer);
+		tcp_socket_deref(sock);
+		netbuf_deref(sock->ts_deferred_ack);
+	}
+	
+	/*
+	 * Build and send our FIN, ACK packet.
+	 */
+	build_netbuf(ti, sock, TCF_ACK | TCF_FIN, nb);
 
 	sock->ts_snd_nxt++;
-	sock->ts_awaiting_ack = netbuf_clone(nb);
-	sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
-	sock->ts_retransmits = 0;
-        sock->ts_send_jiffies = timer_get_jiffies();
-        sock->ts_send_flags = TCP_SND_RETRANS_TIMING;
-	tcp_socket_ref(sock);
-	oneshot_attach(sock->ts_wait_timer);
+	tcp_queue_retransmit(sock, nb);
 		
 	spinlock_unlock(&ti->ti_lock);
 	
@@ -304,6 +816,210 @@ void tcp_tick_deferred_ack(void *sock)
 	spinlock_unlock(&ti->ti_lock);
 }
 
+/*
+ * tcp_resend_segment()
+ *	Retransmit a segment from the retransmission queue.
+ *
+ * It is assumed that the instance lock is held on entry to this function.  It
+ * is released while the segment is actually sent.
+ */
+static void tcp_resend_segment(struct tcp_instance *ti, struct tcp_socket *ts, struct netbuf *seg)
+{
+	struct netbuf *nb;
+	u32_t end;
+
+	end = tcp_seg_end(seg);
+	if (SEQ_GT(end, ts->ts_rexmit_nxt)) {
+		ts->ts_rexmit_nxt = end;
+	}
+
+	/*
+	 * If we had a previously deferred ACK then we can eliminate it now
+	 * because we're sending a segment and an ACK now.
+	 */
+	if (ts->ts_send_flags & TCP_SND_DEFERRED_ACK) {
+		ts->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
+		oneshot_detach(ts->ts_deferred_ack_timer);
+		tcp_socket_deref(ts);
+		netbuf_deref(ts->ts_deferred_ack);
+	}
+
+	nb = netbuf_clone(seg);
+	spinlock_unlock(&ti->ti_lock);
+	tcp_send_sequence(ti, ts, nb);
+	netbuf_deref(nb);
+	spinlock_lock(&ti->ti_lock);
+}
+
+/*
+ * tcp_resend_oldest()
+ *	Retransmit the oldest unacknowledged segment.
+ */
+static void tcp_resend_oldest(struct tcp_instance *ti, struct tcp_socket *ts)
+{
+	if (ts->ts_awaiting_ack) {
+		tcp_resend_segment(ti, ts, ts->ts_awaiting_ack);
+	}
+}
+
+/*
+ * tcp_sack_add()
+ *	Add a range that our peer has SACK'd to our scoreboard.
+ *
+ * Any ranges that the new one overlaps or touches are merged into it.  If the
+ * scoreboard is full then we keep the ranges nearest to SND-UNA since they
+ * tell us about the holes that we'll be filling first.
+ */
+static void tcp_sack_add(struct tcp_socket *ts, u32_t left, u32_t right)
+{
+	struct tcp_sack_block *sb;
+	u8_t i, j, hi;
+
+	j = 0;
+	for (i = 0; i < ts->ts_sacks; i++) {
+		sb = &ts->ts_sack[i];
+		if (SEQ_LE(left, sb->tsb_right) && SEQ_GE(right, sb->tsb_left)) {
+			if (SEQ_LT(sb->tsb_left, left)) {
+				left = sb->tsb_left;
+			}
+			if (SEQ_GT(sb->tsb_right, right)) {
+				right = sb->tsb_right;
+			}
+			continue;
+		}
+
+		ts->ts_sack[j++] = *sb;
+	}
+	ts->ts_sacks = j;
+
+	if (j == TCP_SACK_SCOREBOARD) {
+		hi = 0;
+		for (i = 1; i < j; i++) {
+			if (SEQ_GT(ts->ts_sack[i].tsb_left, ts->ts_sack[hi].tsb_left)) {
+				hi = i;
+			}
+		}
+
+		if (SEQ_GE(left, ts->ts_sack[hi].tsb_left)) {
+			return;
+		}
+
+		j = hi;
+	} else {
+		ts->ts_sacks++;
+	}
+
+	ts->ts_sack[j].tsb_left = left;
+	ts->ts_sack[j].tsb_right = right;
+}
+
+/*
+ * tcp_sack_update()
+ *	Update our SACK scoreboard from the segment that we're processing.
+ *
+ * Anything at or below SND-UNA is dropped, as are any blocks that don't make
+ * sense for the data we have outstanding.
+ */
+static void tcp_sack_update(struct tcp_socket *ts)
+{
+	u32_t left, right;
+	u8_t i, j;
+
+	j = 0;
+	for (i = 0; i < ts->ts_sacks; i++) {
+		if (SEQ_LE(ts->ts_sack[i].tsb_right, ts->ts_snd_una)) {
+			continue;
+		}
+
+		if (SEQ_LT(ts->ts_sack[i].tsb_left, ts->ts_snd_una)) {
+			ts->ts_sack[i].tsb_left = ts->ts_snd_una;
+		}
+
+		ts->ts_sack[j++] = ts->ts_sack[i];
+	}
+	ts->ts_sacks = j;
+
+	for (i = 0; i < ts->ts_seg_sacks; i++) {
+		left = ts->ts_seg_sack[i].tsb_left;
+		right = ts->ts_seg_sack[i].tsb_right;
+
+		if (SEQ_GE(left, right) || SEQ_LE(right, ts->ts_snd_una)
+				|| SEQ_GT(right, ts->ts_snd_nxt)) {
+			continue;
+		}
+
+		if (SEQ_LT(left, ts->ts_snd_una)) {
+			left = ts->ts_snd_una;
+		}
+
+		tcp_sack_add(ts, left, right);
+	}
+}
+
+/*
+ * tcp_sack_covered()
+ *	Check whether our peer has SACK'd the whole of a range.
+ */
+static u8_t tcp_sack_covered(struct tcp_socket *ts, u32_t left, u32_t right)
+{
+	u8_t i;
+
+	for (i = 0; i < ts->ts_sacks; i++) {
+		if (SEQ_LE(ts->ts_sack[i].tsb_left, left) && SEQ_GE(ts->ts_sack[i].tsb_right, right)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * tcp_resend_sack_hole()
+ *	Retransmit the next segment that our peer's SACKs show to be missing.
+ *
+ * A segment is taken to be missing if it hasn't been SACK'd but something
+ * after it has.  We work forwards from the last segment that we retransmitted
+ * during this recovery so that each hole is only filled once.
+ *
+ * It is assumed that the instance lock is held on entry to this function.  It
+ * is released while the segment is actually sent.
+ */
+static void tcp_resend_sack_hole(struct tcp_instance *ti, struct tcp_socket *ts)
+{
+	struct netbuf *nb;
+	u32_t start, end, high;
+	u8_t i;
+
+	if (!ts->ts_sacks) {
+		return;
+	}
+
+	high = ts->ts_sack[0].tsb_right;
+	for (i = 1; i < ts->ts_sacks; i++) {
+		if (SEQ_GT(ts->ts_sack[i].tsb_right, high)) {
+			high = ts->ts_sack[i].tsb_right;
+		}
+	}
+
+	for (nb = ts->ts_awaiting_ack; nb; nb = nb->nb_next) {
+		start = hton32(((struct tcp_header *)nb->nb_transport)->th_sequence);
+		end = tcp_seg_end(nb);
+
+		if (SEQ_LE(end, ts->ts_rexmit_nxt)) {
+			continue;
+		}
+
+		if (SEQ_GE(start, high)) {
+			return;
+		}
+
+		if (!tcp_sack_covered(ts, start, end)) {
+			tcp_resend_segment(ti, ts, nb);
+			return;
+		}
+	}
+}
+
 /*
  * tcp_tick_retransmit()
  *	Callback function for the retransmission timer.
@@ -332,11 +1048,19 @@ void tcp_tick_retransmit(void *sock)
 		}
 		
 		/*
-		 * When we retransmit this segment we double the timeout period that
-		 * broughts us here (exponential backoff).  Note that we don't
-		 * retransmit if the buffer is already waiting to be transmitted
-		 * (as indicated by a ref count > 1).
+		 * We retransmit the oldest unacknowledged segment and double
+		 * the timeout period that brought us here (exponential
+		 * backoff).  Any RTT measurement that was in progress is now
+		 * ambiguous so we abandon it (Karn's algorithm).  Our peer is
+		 * allowed to discard data that it has SACK'd so we forget our
+		 * SACK scoreboard too (RFC2018).  Note that we
+		 * don't retransmit if the buffer is already waiting to be
+		 * transmitted (as indicated by a ref count > 1).
 		 */
+		ts->ts_send_flags |= TCP_SND_ACKED;
+		ts->ts_sacks = 0;
+		ts->ts_timeouts++;
+		ts->ts_cong->tco_timeout(ts);
 		ts->ts_wait_timer->os_ticks_left = ts->ts_rto_next << ts->ts_retransmits;
 		if (ts->ts_wait_timer->os_ticks_left > (240 * TICK_RATE)) {
 			ts->ts_wait_timer->os_ticks_left = 240 * TICK_RATE;
@@ -345,25 +1069,8 @@ void tcp_tick_retransmit(void *sock)
 		oneshot_attach(ts->ts_wait_timer);
 						
 		if (netbuf_get_refs(ts->ts_awaiting_ack) == 1) {
-			struct netbuf *nb;
-			
-			/*
-			 * If we had a previously deferred ACK then we can eliminate it now
-			 * because we're sending a segment and an ACK now.
-			 */
-			if (ts->ts_send_flags & TCP_SND_DEFERRED_ACK) {
-				ts->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
-				oneshot_detach(ts->ts_deferred_ack_timer);
-				tcp_socket_deref(ts);
-				netbuf_deref(ts->ts_deferred_ack);
-			}
-	
-			nb = netbuf_clone(ts->ts_awaiting_ack);
 			ts->ts_retransmits++;
-			spinlock_unlock(&ti->ti_lock);
-			tcp_send_sequence(ti, ts, nb);
-			netbuf_deref(nb);
-			return;
+			tcp_resend_oldest(ti, ts);
 		}
         }
 	
@@ -371,145 +1078,511 @@ void tcp_tick_retransmit(void *sock)
 }
 
 /*
- * tcp_tick_time_wait()
- *	Callback function for the TIME-WAIT timer.
+ * tcp_tick_time_wait()
+ *	Callback function for the TIME-WAIT timer.
+ */
+void tcp_tick_time_wait(void *sock)
+{
+	struct tcp_socket *ts = (struct tcp_socket *)sock;
+	struct tcp_instance *ti;
+	
+	ti = ts->ts_instance;
+
+	spinlock_lock(&ti->ti_lock);
+	
+	ts->ts_state = TCS_CLOSED;
+	tcp_flush_recv_queues(ts);
+	tcp_socket_detach(ti, ts);
+	
+	spinlock_unlock(&ti->ti_lock);
+}
+
+/*
+ * close_socket()
+ *	Move a TCP socket to the closed state.
+ */
+static void close_socket(struct tcp_instance *ti, struct tcp_socket *ts)
+{
+	tcp_flush_send_queues(ts);
+	tcp_flush_recv_queues(ts);
+	ts->ts_state = TCS_CLOSED;
+
+	tcp_socket_detach(ti, ts);
+				
+	condvar_signal(&ts->ts_wait_cv);
+}
+
+/*
+ * send_reset_close_socket()
+ *	Send a reset to a TCP socket and then move it to the closed state.
+ */
+static void send_reset_close_socket(struct tcp_instance *ti, struct tcp_socket *ts)
+{
+	tcp_flush_send_queues(ts);
+	tcp_flush_recv_queues(ts);
+	ts->ts_state = TCS_CLOSED;
+
+	tcp_build_and_send_sequence(ti, ts, TCF_RST);
+
+	tcp_socket_detach(ti, ts);
+				
+	condvar_signal(&ts->ts_wait_cv);
+}
+
+/*
+ * calc_round_trip()
+ *	Work out the round trip time for the last packet we sent.
+ *
+ * This is *VERY* important and much cited in various RFCs and conference
+ * papers.  We implement Van Jacobson's round-trip variance estimator
+ * (originally published in "Congestion Avoidance and Control" - November 1988)
+ * and use Karn's algorithm to avoid problems caused by retransmissions
+ * (originally published in "Improving Round-Trip Time Estimates in Reliable
+ * Transport Protocols - August 1987).
+ *
+ * Note RFC1122 mandates that these algorithms MUST be used.
+ *
+ * We're called when new data is ACK'd after a retransmission, or when the
+ * segment that we're timing is ACK'd.
+ */
+static void calc_round_trip(struct tcp_socket *ts)
+{
+	s32_t ticks;
+	
+	ticks = (s32_t)(timer_get_jiffies() - ts->ts_send_jiffies);
+
+	if (ts->ts_retransmits) {
+		/*
+		 * This is Karn's algorithm - don't use retransmitted packets
+		 * to calculate new RTTs,  instead keep the last backed-off
+		 * RTO value instead.
+		 */
+		ts->ts_rto_next <<= ts->ts_retransmits;
+		ts->ts_retransmits = 0;
+	} else {
+		if (ticks == 0) {
+			ticks = 1;
+		}
+
+		/*
+		 * Here's the Van Jacobson code - almost directly extracted
+		 * from appendix A of his paper.
+		 */
+		if (ts->ts_srtt_avg == 0) {
+			ts->ts_srtt_var = ticks << 2;
+			ts->ts_srtt_avg = ts->ts_srtt_var << 1;
+		} else {
+			ticks -= (ts->ts_srtt_avg >> 3);
+			ts->ts_srtt_avg += ticks;
+			if (ticks < 0) {
+				ticks = -ticks;
+			}
+			ticks -= (ts->ts_srtt_var >> 2);
+			ts->ts_srtt_var += ticks;
+		}
+				
+		ts->ts_rto_next = (ts->ts_srtt_avg >> 3) + ts->ts_srtt_var;
+	}
+
+	/*
+	 * Don't allow a timeout that's greater than 2xMSL!
+	 */	
+	if (ts->ts_rto_next > (240L * TICK_RATE)) {
+		ts->ts_rto_next = 240L * TICK_RATE;
+	}
+
+	ts->ts_send_flags |= TCP_SND_ACKED;
+}
+
+/*
+ * tcp_recv_new_ack()
+ *	Account for an ACK that moves SND-UNA forwards.
+ *
+ * Returns the number of bytes of sequence space that have been ACK'd.
+ */
+static u32_t tcp_recv_new_ack(struct tcp_socket *sock, u32_t netack)
+{
+	struct netbuf *nb;
+	u32_t acked;
+
+	acked = netack - sock->ts_snd_una;
+
+	if (sock->ts_seg_tsecr) {
+		/*
+		 * The timestamp echoed back to us says when the segment
+		 * being ACK'd was sent, so we get a sample with every ACK
+		 * and it's valid even after a retransmission (RFC7323).
+		 */
+		sock->ts_retransmits = 0;
+		sock->ts_send_jiffies = sock->ts_seg_tsecr;
+		calc_round_trip(sock);
+	} else if (sock->ts_retransmits
+			|| (!(sock->ts_send_flags & TCP_SND_ACKED) && SEQ_GE(netack, sock->ts_rtt_seq))) {
+		calc_round_trip(sock);
+	}
+
+	sock->ts_snd_una = netack;
+
+	while ((nb = sock->ts_awaiting_ack) && SEQ_LE(tcp_seg_end(nb), netack)) {
+		sock->ts_awaiting_ack = nb->nb_next;
+		netbuf_deref(nb);
+	}
+
+	/*
+	 * If there's nothing left to be ACK'd then stop the retransmit
+	 * timer, otherwise give the oldest remaining segment a full timeout
+	 * period.
+	 */
+	if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
+		oneshot_detach(sock->ts_wait_timer);
+		tcp_socket_deref(sock);
+
+		if (sock->ts_awaiting_ack) {
+			sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
+			tcp_socket_ref(sock);
+			oneshot_attach(sock->ts_wait_timer);
+		} else {
+			sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
+		}
+	}
+
+	return acked;
+}
+
+/*
+ * tcp_recv_ack()
+ *	Process the acknowledgement and window fields of an incoming segment.
+ *
+ * Any segments that are now completely ACK'd are trimmed from the front of
+ * the retransmission queue and the retransmit timer is restarted for those
+ * that remain.  As the send window may have opened we then try to send more
+ * of anything that's waiting.
+ *
+ * Both new ACKs and duplicate ACKs are reported to the congestion control
+ * module, which may ask us to retransmit the oldest segment (fast retransmit
+ * or a NewReno partial ACK).  A duplicate ACK is one that carries no data
+ * and doesn't change the window, while we have data outstanding (RFC2581).
+ * If our peer is sending SACK blocks then these are used to pick which
+ * segments to retransmit during recovery.
+ *
+ * Returns -1 if the segment ACKs something that we've not sent, 1 if all of
+ * our data has been ACK'd or 0 otherwise.
+ */
+static s8_t tcp_recv_ack(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nbin)
+{
+	struct tcp_header *tch = (struct tcp_header *)nbin->nb_transport;
+	u32_t netack;
+	u32_t wnd;
+	u8_t resend, dup;
+
+	netack = hton32(tch->th_ack);
+
+	if (SEQ_GT(netack, sock->ts_snd_nxt)) {
+		return -1;
+	}
+
+	/*
+	 * Ignore anything older than the ACKs we've already seen - this
+	 * includes its window, which may be out of date.
+	 */
+	if (SEQ_LT(netack, sock->ts_snd_una)) {
+		return 0;
+	}
+
+	wnd = hton16(tch->th_window);
+	if (!(tch->th_ctrl_flags & TCF_SYN)) {
+		wnd <<= sock->ts_snd_wscale;
+	}
+	resend = 0;
+	dup = 0;
+
+	if (netack == sock->ts_snd_una) {
+		if (sock->ts_awaiting_ack
+				&& (nbin->nb_application_size == 0)
+				&& !(tch->th_ctrl_flags & (TCF_SYN | TCF_FIN))
+				&& (wnd == sock->ts_snd_wnd)) {
+			dup = 1;
+			if (sock->ts_cong->tco_dup_ack(sock)) {
+				sock->ts_fast_retransmits++;
+				sock->ts_send_flags |= TCP_SND_ACKED;
+				sock->ts_rexmit_nxt = sock->ts_snd_una;
+				resend = 1;
+			}
+		}
+	}
+
+	sock->ts_snd_wnd = wnd;
+
+	if (SEQ_GT(netack, sock->ts_snd_una)) {
+		resend = sock->ts_cong->tco_ack(sock, tcp_recv_new_ack(sock, netack));
+	}
+
+	/*
+	 * With SACK we don't need to retransmit anything that our peer
+	 * already holds.  A partial ACK may just be the result of a hole that
+	 * we've already filled, so we move on to the next hole instead, and
+	 * each further duplicate ACK during recovery lets us fill another.
+	 */
+	if (sock->ts_opt_flags & TCP_OPT_SACK) {
+		tcp_sack_update(sock);
+
+		if (resend && sock->ts_awaiting_ack
+				&& SEQ_LE(tcp_seg_end(sock->ts_awaiting_ack), sock->ts_rexmit_nxt)) {
+			resend = 0;
+			tcp_resend_sack_hole(ti, sock);
+		} else if (dup && !resend && (sock->ts_send_flags & TCP_SND_RECOVERY)) {
+			tcp_resend_sack_hole(ti, sock);
+		}
+	}
+
+	if (resend) {
+		tcp_resend_oldest(ti, sock);
+	}
+
+	tcp_send_queued(ti, sock);
+
+	return (sock->ts_snd_una == sock->ts_snd_nxt) ? 1 : 0;
+}
+
+/*
+ * tcp_send_ack_now()
+ *	Send an ACK immediately rather than deferring it.
+ */
+static void tcp_send_ack_now(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+
+	nb = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 0);
+
+	if (sock->ts_send_flags & TCP_SND_DEFERRED_ACK) {
+		sock->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
+		oneshot_detach(sock->ts_deferred_ack_timer);
+		tcp_socket_deref(sock);
+		netbuf_deref(sock->ts_deferred_ack);
+	}
+
+	build_netbuf(ti, sock, TCF_ACK, nb);
+
+	spinlock_unlock(&ti->ti_lock);
+	tcp_send_sequence(ti, sock, nb);
+	spinlock_lock(&ti->ti_lock);
+
+	netbuf_deref(nb);
+}
+
+/*
+ * tcp_recv_check_seq()
+ *	Check that an incoming segment falls within our receive window.
+ *
+ * Anything at the front of the segment that we've already received and
+ * anything that runs past the end of the window is trimmed off.
+ *
+ * Returns 0 if what's left starts at RCV-NXT, 1 if it's data that starts
+ * further into the window (and so can be held for reassembly) or -1 if the
+ * segment is not acceptable.
  */
-void tcp_tick_time_wait(void *sock)
+static s8_t tcp_recv_check_seq(struct tcp_socket *sock, struct netbuf *nb)
 {
-	struct tcp_socket *ts = (struct tcp_socket *)sock;
-	struct tcp_instance *ti;
-	
-	ti = ts->ts_instance;
+	struct tcp_header *tch = (struct tcp_header *)nb->nb_transport;
+	u32_t seq, wnd, d;
+	addr_t len;
 
-	spinlock_lock(&ti->ti_lock);
-	
-	ts->ts_state = TCS_CLOSED;
-	tcp_socket_detach(ti, ts);
-	
-	spinlock_unlock(&ti->ti_lock);
+	seq = tcp_recv_seq(nb);
+	len = nb->nb_application_size;
+
+	/*
+	 * While our client holds as many segments as we can track we treat
+	 * the window as closed, even if we'd already offered more.
+	 */
+	wnd = 0;
+	if (SEQ_GT(sock->ts_rcv_adv, sock->ts_rcv_nxt) && !tcp_rcv_held_full(sock)) {
+		wnd = sock->ts_rcv_adv - sock->ts_rcv_nxt;
+	}
+
+	if (SEQ_LT(seq, sock->ts_rcv_nxt)) {
+		d = sock->ts_rcv_nxt - seq;
+		if (d >= len) {
+			return -1;
+		}
+
+		nb->nb_application = (u8_t *)nb->nb_application + d;
+		nb->nb_application_size -= d;
+		seq = sock->ts_rcv_nxt;
+		len -= d;
+	}
+
+	if (SEQ_GT(seq + len, sock->ts_rcv_nxt + wnd)) {
+		if (SEQ_GE(seq, sock->ts_rcv_nxt + wnd)) {
+			return -1;
+		} else {
+			/*
+			 * If we lose the end of the segment then we lose any
+			 * FIN too.
+			 */
+			nb->nb_application_size = sock->ts_rcv_nxt + wnd - seq;
+			tch->th_ctrl_flags &= (~TCF_FIN);
+		}
+	}
+
+	if (seq != sock->ts_rcv_nxt) {
+		/*
+		 * We only hold on to plain data segments.
+		 */
+		if (tch->th_ctrl_flags & (TCF_SYN | TCF_FIN | TCF_RST)) {
+			return -1;
+		}
+
+		return 1;
+	}
+
+	return 0;
 }
 
 /*
- * close_socket()
- *	Move a TCP socket to the closed state.
+ * tcp_recv_queue_ooo()
+ *	Hold an out-of-order segment until the gap in front of it is filled.
+ *
+ * The queue is kept in sequence order.  If it's full, or we already hold a
+ * segment that starts at the same place, then we just drop the new one and
+ * leave it for our peer to retransmit.
  */
-static void close_socket(struct tcp_instance *ti, struct tcp_socket *ts)
+static void tcp_recv_queue_ooo(struct tcp_socket *sock, struct netbuf *nb)
 {
-	if (ts->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-		struct netbuf *nb;
-		
-		ts->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-		oneshot_detach(ts->ts_wait_timer);
-		tcp_socket_deref(ts);
-		netbuf_deref(ts->ts_awaiting_ack);
+	struct netbuf *p;
+	struct netbuf **pprev;
+	u32_t seq;
 
-		while (ts->ts_awaiting_send) {
-			nb = ts->ts_awaiting_send;
-			ts->ts_awaiting_send = nb->nb_next;
-			
-			netbuf_deref(nb);
+	if (sock->ts_rcv_ooo_segs >= TCP_RCV_OOO_SEGS) {
+		return;
+	}
+
+	seq = tcp_recv_seq(nb);
+
+	pprev = &sock->ts_rcv_ooo;
+	p = sock->ts_rcv_ooo;
+	while (p) {
+		u32_t pseq = tcp_recv_seq(p);
+
+		if (pseq == seq) {
+			return;
 		}
+
+		if (SEQ_GT(pseq, seq)) {
+			break;
+		}
+
+		pprev = &p->nb_next;
+		p = p->nb_next;
 	}
-	ts->ts_state = TCS_CLOSED;
 
-	tcp_socket_detach(ti, ts);
-				
-	condvar_signal(&ts->ts_wait_cv);
+	netbuf_ref(nb);
+	nb->nb_next = p;
+	*pprev = nb;
+	sock->ts_rcv_ooo_size += nb->nb_application_size;
+	sock->ts_rcv_ooo_segs++;
+	sock->ts_rcv_sack_last = seq;
 }
 
 /*
- * send_reset_close_socket()
- *	Send a reset to a TCP socket and then move it to the closed state.
+ * tcp_recv_deliver_one()
+ *	Hand a segment's data to our client.
+ *
+ * If our client takes a reference to the segment then we keep track of it
+ * so that the data it's holding is charged against our receive window.
  */
-static void send_reset_close_socket(struct tcp_instance *ti, struct tcp_socket *ts)
+static void tcp_recv_deliver_one(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb)
 {
-	if (ts->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-		struct netbuf *nb;
-		
-		ts->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-		oneshot_detach(ts->ts_wait_timer);
-		tcp_socket_deref(ts);
-		netbuf_deref(ts->ts_awaiting_ack);
+	struct tcp_client *tc;
+	ref_t refs;
+	u8_t i;
 
-		while (ts->ts_awaiting_send) {
-			nb = ts->ts_awaiting_send;
-			ts->ts_awaiting_send = nb->nb_next;
-			
-			netbuf_deref(nb);
-		}
+	tc = sock->ts_client;
+	if (!tc) {
+		return;
 	}
-	ts->ts_state = TCS_CLOSED;
 
-	tcp_build_and_send_sequence(ti, ts, TCF_RST);
+	refs = netbuf_get_refs(nb);
 
-	tcp_socket_detach(ti, ts);
-				
-	condvar_signal(&ts->ts_wait_cv);
+	tcp_client_ref(tc);
+	spinlock_unlock(&ti->ti_lock);
+	tc->tc_recv(tc, nb);
+	spinlock_lock(&ti->ti_lock);
+	tcp_client_deref(tc);
+
+	if (netbuf_get_refs(nb) > refs) {
+		for (i = 0; i < TCP_RCV_HELD_SLOTS; i++) {
+			if (!sock->ts_rcv_held[i]) {
+				netbuf_ref(nb);
+				sock->ts_rcv_held[i] = nb;
+				break;
+			}
+		}
+	}
 }
 
 /*
- * calc_round_trip()
- *	Work out the round trip time for the last packet we sent.
- *
- * This is *VERY* important and much cited in various RFCs and conference
- * papers.  We implement Van Jacobson's round-trip variance estimator
- * (originally published in "Congestion Avoidance and Control" - November 1988)
- * and use Karn's algorithm to avoid problems caused by retransmissions
- * (originally published in "Improving Round-Trip Time Estimates in Reliable
- * Transport Protocols - August 1987).
+ * tcp_recv_deliver()
+ *	Accept the in-sequence data in a segment and pass it to our client.
  *
- * Note RFC1122 mandates that these algorithms MUST be used.
+ * Any out-of-order segments that now follow on are pulled off the
+ * reassembly queue and delivered too.  We ACK everything before we make any
+ * client calls so that the ACK can be piggybacked on any reply.  If we've
+ * just filled a gap then our peer will want to know immediately (RFC2581).
  */
-static void calc_round_trip(struct tcp_socket *ts)
+static void tcp_recv_deliver(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb)
 {
-	s32_t ticks;
-	
-	if (ts->ts_send_flags & TCP_SND_ACKED) {
+	struct netbuf *ooo, *chain;
+	struct netbuf **pprev;
+	u32_t seq, d;
+
+	if (!nb->nb_application_size) {
 		return;
 	}
-	
-	ticks = (s32_t)(timer_get_jiffies() - ts->ts_send_jiffies);
 
-	if (ts->ts_retransmits) {
-		/*
-		 * This is Karn's algorithm - don't use retransmitted packets
-		 * to calculate new RTTs,  instead keep the last backed-off
-		 * RTO value instead.
-		 */
-		ts->ts_rto_next <<= ts->ts_retransmits;
-	} else {
-		if (ticks == 0) {
-			ticks = 1;
+	sock->ts_rcv_nxt += nb->nb_application_size;
+
+	chain = NULL;
+	pprev = &chain;
+	while ((ooo = sock->ts_rcv_ooo)) {
+		seq = tcp_recv_seq(ooo);
+		if (SEQ_GT(seq, sock->ts_rcv_nxt)) {
+			break;
 		}
 
-		/*
-		 * Here's the Van Jacobson code - almost directly extracted
-		 * from appendix A of his paper.
-		 */
-		if (ts->ts_srtt_avg == 0) {
-			ts->ts_srtt_var = ticks << 2;
-			ts->ts_srtt_avg = ts->ts_srtt_var << 1;
-		} else {
-			ticks -= (ts->ts_srtt_avg >> 3);
-			ts->ts_srtt_avg += ticks;
-			if (ticks < 0) {
-				ticks = -ticks;
-			}
-			ticks -= (ts->ts_srtt_var >> 2);
-			ts->ts_srtt_var += ticks;
+		sock->ts_rcv_ooo = ooo->nb_next;
+		sock->ts_rcv_ooo_size -= ooo->nb_application_size;
+		sock->ts_rcv_ooo_segs--;
+		ooo->nb_next = NULL;
+
+		d = sock->ts_rcv_nxt - seq;
+		if (d >= ooo->nb_application_size) {
+			netbuf_deref(ooo);
+			continue;
 		}
-				
-		ts->ts_rto_next = (ts->ts_srtt_avg >> 3) + ts->ts_srtt_var;
+
+		ooo->nb_application = (u8_t *)ooo->nb_application + d;
+		ooo->nb_application_size -= d;
+		sock->ts_rcv_nxt += ooo->nb_application_size;
+
+		*pprev = ooo;
+		pprev = &ooo->nb_next;
 	}
 
-	/*
-	 * Don't allow a timeout that's greater than 2xMSL!
-	 */	
-	if (ts->ts_rto_next > (240L * TICK_RATE)) {
-		ts->ts_rto_next = 240L * TICK_RATE;
+	if (chain) {
+		tcp_send_ack_now(ti, sock);
+	} else {
+		tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 	}
 
-	ts->ts_send_flags |= TCP_SND_ACKED;
+	tcp_recv_deliver_one(ti, sock, nb);
+
+	while (chain) {
+		ooo = chain;
+		chain = ooo->nb_next;
+		ooo->nb_next = NULL;
+		tcp_recv_deliver_one(ti, sock, ooo);
+		netbuf_deref(ooo);
+	}
 }
 
 /*
@@ -518,61 +1591,151 @@ static void calc_round_trip(struct tcp_socket *ts)
  *
  * When processing options we take RFC1122 at its word (para 4.2.2.5) and
  * assume that any new options have length fields.
+ *
+ * The window scale, SACK-permitted and timestamps options can only appear
+ * in the SYN that opens a connection, and each is only used if both ends
+ * included it (RFC7323 and RFC2018).  After that, timestamps give us the
+ * value that we echo back and let us reject old duplicate segments (PAWS).
+ *
+ * Returns -1 if the segment fails the PAWS test and should be dropped, or 0
+ * otherwise.
  */
-static void tcp_recv_options(struct tcp_instance *ti, struct tcp_socket *ts, struct netbuf *nb)
+static s8_t tcp_recv_options(struct tcp_instance *ti, struct tcp_socket *ts, struct netbuf *nb)
 {
 	struct tcp_header *th;
 	u8_t length;
 	u8_t *p;
-	
+	u8_t syn, seen, n, i;
+	u32_t tsval;
+
         th = (struct tcp_header *)nb->nb_transport;
         p = (u8_t *)(th + 1);
-        			
+
 	length = (th->th_data_offs << 2) - sizeof(struct tcp_header);
 
+	syn = (th->th_ctrl_flags & TCF_SYN) && (ts->ts_state < TCS_SYN_RECEIVED);
+	seen = 0;
+	tsval = 0;
+	ts->ts_seg_tsecr = 0;
+	ts->ts_seg_sacks = 0;
+
 	while (length) {
 		u8_t opt;
 		u8_t optsz;
-		
+
 		opt = *p++;
-				
+
 		switch (opt) {
 		case 0x00:
 			/*
 			 * End of options.
 			 */
-			return;
-			
+			length = 0;
+			break;
+
 		case 0x01:
 			/*
 			 * NOP (do nothing).
 			 */
 			length--;
 			break;
-			
+
 		default:
 			if (length == 1) {
-				return;
+				length = 0;
+				break;
 			}
-			
+
 			optsz = *p++;
 			if ((optsz < 2) || (optsz > length)) {
-				return;
+				length = 0;
+				break;
 			}
-		
-			if (opt == 0x02) {
+
+			switch (opt) {
+			case 0x02:
 				/*
 				 * MSS (maximum segment size).
 				 */
-				if (optsz == 0x02) {
+				if (optsz == 0x04) {
 					ts->ts_remote_mss = hton16(*((u16_t *)p));
 				}
+				break;
+
+			case 0x03:
+				/*
+				 * Window scale.  RFC7323 limits the shift to 14.
+				 */
+				if (syn && (optsz == 0x03)) {
+					seen |= TCP_OPT_WSCALE;
+					ts->ts_snd_wscale = (*p > 14) ? 14 : *p;
+				}
+				break;
+
+			case 0x04:
+				/*
+				 * SACK permitted.
+				 */
+				if (syn && (optsz == 0x02)) {
+					seen |= TCP_OPT_SACK;
+				}
+				break;
+
+			case 0x05:
+				/*
+				 * SACK blocks.
+				 */
+				n = (optsz - 2) >> 3;
+				if (n > TCP_SACK_BLOCKS) {
+					n = TCP_SACK_BLOCKS;
+				}
+				for (i = 0; i < n; i++) {
+					ts->ts_seg_sack[i].tsb_left = hton32(*((u32_t *)(p + (i << 3))));
+					ts->ts_seg_sack[i].tsb_right = hton32(*((u32_t *)(p + (i << 3) + 4)));
+				}
+				ts->ts_seg_sacks = n;
+				break;
+
+			case 0x08:
+				/*
+				 * Timestamps.
+				 */
+				if (optsz == 0x0a) {
+					seen |= TCP_OPT_TSTAMP;
+					tsval = hton32(*((u32_t *)p));
+					ts->ts_seg_tsecr = hton32(*((u32_t *)(p + 4)));
+				}
+				break;
 			}
-		
+
 			length -= optsz;
 			p += (optsz - 2);
 		}
 	}
+
+	if (syn) {
+		ts->ts_opt_flags = seen;
+		if (!(seen & TCP_OPT_WSCALE)) {
+			ts->ts_snd_wscale = 0;
+			ts->ts_rcv_wscale = 0;
+		}
+	}
+
+	if (!(seen & TCP_OPT_TSTAMP) || !(ts->ts_opt_flags & TCP_OPT_TSTAMP)) {
+		ts->ts_seg_tsecr = 0;
+		return 0;
+	}
+
+	if ((ts->ts_state >= TCS_SYN_RECEIVED) && !(th->th_ctrl_flags & (TCF_SYN | TCF_RST))
+			&& SEQ_LT(tsval, ts->ts_ts_recent)) {
+		return -1;
+	}
+
+	if (syn || SEQ_LE(hton32(th->th_sequence), ts->ts_rcv_nxt)) {
+		ts->ts_ts_recent = tsval;
+	}
+
+	return 0;
 }
 
 /*
@@ -606,6 +1769,7 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 			 */
 			sock->ts_remote_port = hton16(tch->th_src_port);
 			sock->ts_remote_addr = hton32(iph->ih_src_addr);
+			tcp_socket_template(ti, sock);
 			sock->ts_snd_nxt = hton32(tch->th_ack);
 			tcp_build_and_send_sequence(ti, sock, TCF_RST);
 			break;
@@ -620,9 +1784,13 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				consock->ts_local_port = sock->ts_local_port;
 				consock->ts_remote_port = hton16(tch->th_src_port);
 				consock->ts_remote_addr = hton32(iph->ih_src_addr);
+				tcp_socket_template(ti, consock);
 				consock->ts_snd_nxt = sock->ts_snd_nxt;
 				consock->ts_snd_una = sock->ts_snd_una;
 				consock->ts_rcv_nxt = hton32(tch->th_sequence) + 1;
+				consock->ts_rcv_adv = consock->ts_rcv_nxt;
+				consock->ts_snd_wnd = hton16(tch->th_window);
+				tcp_recv_options(ti, consock, nb);
 				sock->ts_awaiting_accept = consock;
 				        				
 				/*
@@ -649,13 +1817,7 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
         			}
        				break;
         		} else {
-        			calc_round_trip(sock);
-				if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-					sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-					oneshot_detach(sock->ts_wait_timer);
-					tcp_socket_deref(sock);
-					netbuf_deref(sock->ts_awaiting_ack);
-				}
+				tcp_recv_ack(ti, sock, nb);
         		}
         	}
         	
@@ -669,21 +1831,17 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
         	
         	if (tch->th_ctrl_flags & TCF_SYN) {
 			sock->ts_rcv_nxt = hton32(tch->th_sequence) + 1;
+			sock->ts_rcv_adv = sock->ts_rcv_nxt;
         		
         		if (tch->th_ctrl_flags & TCF_ACK) {
 				sock->ts_state = TCS_ESTABLISHED;
-				sock->ts_snd_una++;
+				sock->ts_cong->tco_init(sock);
 				
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
         		
 				condvar_signal(&sock->ts_wait_cv);
 			} else {
-				if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-					sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-					oneshot_detach(sock->ts_wait_timer);
-					tcp_socket_deref(sock);
-					netbuf_deref(sock->ts_awaiting_ack);
-				}
+				tcp_stop_retransmit(sock);
 				
 				sock->ts_state = TCS_SYN_RECEIVED;
 				
@@ -741,24 +1899,9 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 			break;
 		}
 						
-		calc_round_trip(sock);
-		if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-			struct netbuf *nbnext;
-
-			sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-			oneshot_detach(sock->ts_wait_timer);
-			tcp_socket_deref(sock);
-			netbuf_deref(sock->ts_awaiting_ack);
-
-			nbnext = sock->ts_awaiting_send;
-			if (nbnext) {
-				sock->ts_awaiting_send = nbnext->nb_next;
-				tcp_send_netbuf_now(ti, sock, nbnext);
-				netbuf_deref(nbnext);
-			}
-		}
 		sock->ts_state = TCS_ESTABLISHED;
-		sock->ts_snd_una++;
+		tcp_recv_ack(ti, sock, nb);
+		sock->ts_cong->tco_init(sock);
 			
 		condvar_signal(&sock->ts_wait_cv);
 		
@@ -789,11 +1932,22 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 	
 	case TCS_ESTABLISHED:
 		{
-			u32_t netack;
+			s8_t ack;
+			s8_t chk;
 			
-			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
+			/*
+			 * Segments that are out of order are held for
+			 * reassembly and we send a duplicate ACK straight away.
+			 */
+			chk = tcp_recv_check_seq(sock, nb);
+			if (chk != 0) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
-					tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					if (chk > 0) {
+						tcp_recv_queue_ooo(sock, nb);
+						tcp_send_ack_now(ti, sock);
+					} else {
+						tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					}
 					break;
 				}
 			}
@@ -834,64 +1988,16 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				/*
-				 * If we've just had an ACK of all of the data
-				 * that we've sent we need to check if this is the
-				 * first time we've seen such an ACK.  If we still
-				 * had a segment retransmit timer running then it's
-				 * the first time and we clear the retransmit and
-				 * signal the socket's owner.
-				 */
-				if (netack == sock->ts_snd_nxt) {
-					if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-						struct netbuf *nbnext;
-
-						sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-						oneshot_detach(sock->ts_wait_timer);
-						tcp_socket_deref(sock);
-						netbuf_deref(sock->ts_awaiting_ack);
-
-						nbnext = sock->ts_awaiting_send;				
-						if (nbnext) {
-							sock->ts_awaiting_send = nbnext->nb_next;
-							tcp_send_netbuf_now(ti, sock, nbnext);
-							netbuf_deref(nbnext);
-						}
-					}
-				}
-			}
 
 			/*
 			 * Deal with the data.
-	                 */
-	                if (nb->nb_application_size) {
-				struct tcp_client *tc;
-
-				sock->ts_rcv_nxt += nb->nb_application_size;
-
-				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
-
-				tc = sock->ts_client;
-				if (tc) {
-					tcp_client_ref(tc);
-					spinlock_unlock(&ti->ti_lock);
-					tc->tc_recv(tc, nb);
-					spinlock_lock(&ti->ti_lock);
-					tcp_client_deref(tc);
-				}
-			}
+			 */
+			tcp_recv_deliver(ti, sock, nb);
 						
 			if (tch->th_ctrl_flags & TCF_FIN) {
 				struct tcp_client *tc;
@@ -929,11 +2035,22 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				
 	case TCS_FIN_WAIT1:
 		{
-			u32_t netack;
+			s8_t ack;
+			s8_t chk;
 			
-			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
+			/*
+			 * Segments that are out of order are held for
+			 * reassembly and we send a duplicate ACK straight away.
+			 */
+			chk = tcp_recv_check_seq(sock, nb);
+			if (chk != 0) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
-					tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					if (chk > 0) {
+						tcp_recv_queue_ooo(sock, nb);
+						tcp_send_ack_now(ti, sock);
+					} else {
+						tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					}
 					break;
 				}
 			}
@@ -952,65 +2069,32 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				if (netack == sock->ts_snd_nxt) {
-					if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-						struct netbuf *nbnext;
-
-						sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-						oneshot_detach(sock->ts_wait_timer);
-						tcp_socket_deref(sock);
-						netbuf_deref(sock->ts_awaiting_ack);
-
-						nbnext = sock->ts_awaiting_send;				
-						if (nbnext) {
-							sock->ts_awaiting_send = nbnext->nb_next;
-							tcp_send_netbuf_now(ti, sock, nbnext);
-							netbuf_deref(nbnext);
-						} else if (sock->ts_send_flags & TCP_SND_DEFERRED_FIN) {
-							sock->ts_send_flags &= (~TCP_SND_DEFERRED_FIN);
-							spinlock_unlock(&ti->ti_lock);
-							tcp_send_close(ti, sock);
-							spinlock_lock(&ti->ti_lock);
-						} else {
-							sock->ts_state = TCS_FIN_WAIT2;
-						}
-					} else {
-						sock->ts_state = TCS_FIN_WAIT2;
-					}
-				}
-			}
 
 			/*
-			 * Deal with the data.
+			 * Once all of our data is ACK'd we either send our
+			 * deferred FIN or, if the FIN has been sent, it's been
+			 * ACK'd too.
 			 */
-	                if (nb->nb_application_size) {
-				struct tcp_client *tc;
-
-				sock->ts_rcv_nxt += nb->nb_application_size;
-
-				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
-
-				tc = sock->ts_client;
-				if (tc) {
-					tcp_client_ref(tc);
+			if (ack > 0) {
+				if (sock->ts_send_flags & TCP_SND_DEFERRED_FIN) {
+					sock->ts_send_flags &= (~TCP_SND_DEFERRED_FIN);
 					spinlock_unlock(&ti->ti_lock);
-					tc->tc_recv(tc, nb);
+					tcp_send_close(ti, sock);
 					spinlock_lock(&ti->ti_lock);
-					tcp_client_deref(tc);
+				} else {
+					sock->ts_state = TCS_FIN_WAIT2;
 				}
 			}
+
+			/*
+			 * Deal with the data.
+			 */
+			tcp_recv_deliver(ti, sock, nb);
 						
 			if (tch->th_ctrl_flags & TCF_FIN) {
 				sock->ts_rcv_nxt++;
@@ -1037,11 +2121,22 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				
 	case TCS_FIN_WAIT2:
 		{
-			u32_t netack;
+			s8_t ack;
+			s8_t chk;
 			
-			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
+			/*
+			 * Segments that are out of order are held for
+			 * reassembly and we send a duplicate ACK straight away.
+			 */
+			chk = tcp_recv_check_seq(sock, nb);
+			if (chk != 0) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
-					tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					if (chk > 0) {
+						tcp_recv_queue_ooo(sock, nb);
+						tcp_send_ack_now(ti, sock);
+					} else {
+						tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+					}
 					break;
 				}
 			}
@@ -1060,56 +2155,16 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				if (netack == sock->ts_snd_nxt) {
-					if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-						struct netbuf *nbnext;
-
-						sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-						oneshot_detach(sock->ts_wait_timer);
-						tcp_socket_deref(sock);
-						netbuf_deref(sock->ts_awaiting_ack);
-
-						nbnext = sock->ts_awaiting_send;				
-						if (nbnext) {
-							sock->ts_awaiting_send = nbnext->nb_next;
-							tcp_send_netbuf_now(ti, sock, nbnext);
-							netbuf_deref(nbnext);
-						}
-					}
-				}
-			}
 
 			/*
 			 * Deal with the data.
-	                 */
-	                if (nb->nb_application_size) {
-				struct tcp_client *tc;
-
-				sock->ts_rcv_nxt += nb->nb_application_size;
-
-				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
-
-				tc = sock->ts_client;
-				if (tc) {
-					tcp_client_ref(tc);
-					spinlock_unlock(&ti->ti_lock);
-					tc->tc_recv(tc, nb);
-					spinlock_lock(&ti->ti_lock);
-					tcp_client_deref(tc);
-				}
-			}
+			 */
+			tcp_recv_deliver(ti, sock, nb);
 						
 			if (tch->th_ctrl_flags & TCF_FIN) {
 				sock->ts_rcv_nxt++;
@@ -1125,7 +2180,7 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 
 	case TCS_CLOSE_WAIT:
 		{
-			u32_t netack;
+			s8_t ack;
 			
 			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
@@ -1148,67 +2203,28 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				if (netack == sock->ts_snd_nxt) {
-					if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-						struct netbuf *nbnext;
-
-						sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-						oneshot_detach(sock->ts_wait_timer);
-						tcp_socket_deref(sock);
-						netbuf_deref(sock->ts_awaiting_ack);
-
-						nbnext = sock->ts_awaiting_send;				
-						if (nbnext) {
-							sock->ts_awaiting_send = nbnext->nb_next;
-							tcp_send_netbuf_now(ti, sock, nbnext);
-							netbuf_deref(nbnext);
-							break;
-						}
-						
-						/*
-						 * We implicitly have a deferred FIN
-						 * if we're in CLOSE-WAIT, so send it!
-						 */
-						spinlock_unlock(&ti->ti_lock);
-						tcp_send_close(ti, sock);
-						spinlock_lock(&ti->ti_lock);
-						sock->ts_state = TCS_LAST_ACK;
-						break;
-					}
-				}
+
+			/*
+			 * We implicitly have a deferred FIN if we're in
+			 * CLOSE-WAIT, so send it once all of our data is ACK'd!
+			 */
+			if (ack > 0) {
+				sock->ts_state = TCS_LAST_ACK;
+				spinlock_unlock(&ti->ti_lock);
+				tcp_send_close(ti, sock);
+				spinlock_lock(&ti->ti_lock);
+				break;
 			}
 
 			/*
 			 * Deal with the data.
 			 */
-	                if (nb->nb_application_size) {
-				struct tcp_client *tc;
-
-				sock->ts_rcv_nxt += nb->nb_application_size;
-
-				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
-
-				tc = sock->ts_client;
-				if (tc) {
-					tcp_client_ref(tc);
-					spinlock_unlock(&ti->ti_lock);
-					tc->tc_recv(tc, nb);
-					spinlock_lock(&ti->ti_lock);
-					tcp_client_deref(tc);
-				}
-			}
+			tcp_recv_deliver(ti, sock, nb);
 						
 			if (tch->th_ctrl_flags & TCF_FIN) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
@@ -1218,7 +2234,7 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				
 	case TCS_CLOSING:
 		{
-			u32_t netack;
+			s8_t ack;
 			
 			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
@@ -1241,42 +2257,28 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				/*
-				 * If we've just had an ACK of all of the data
-				 * that we've sent we're finished
-				 */
-				if (netack == sock->ts_snd_nxt) {
-					if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-						sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-						oneshot_detach(sock->ts_wait_timer);
-						tcp_socket_deref(sock);
-						netbuf_deref(sock->ts_awaiting_ack);
-					}
 			
-					sock->ts_state = TCS_TIME_WAIT;
-				        sock->ts_wait_timer->os_callback = tcp_tick_time_wait;
-					sock->ts_wait_timer->os_ticks_left = 60 * TICK_RATE;
-					oneshot_attach(sock->ts_wait_timer);
-				}
+			/*
+			 * If we've just had an ACK of all of the data that
+			 * we've sent we're finished
+			 */
+			if (ack > 0) {
+				sock->ts_state = TCS_TIME_WAIT;
+			        sock->ts_wait_timer->os_callback = tcp_tick_time_wait;
+				sock->ts_wait_timer->os_ticks_left = 60 * TICK_RATE;
+				oneshot_attach(sock->ts_wait_timer);
 			}
 		}
 		break;
 				
 	case TCS_LAST_ACK:
 		{
-			u32_t netack;
+			s8_t ack;
 			
 			if (hton32(tch->th_sequence) != sock->ts_rcv_nxt) {
 				if ((tch->th_ctrl_flags & TCF_RST) == 0) {
@@ -1299,25 +2301,18 @@ static void tcp_recv_state_machine(struct tcp_instance *ti, struct tcp_socket *s
 				break;
 			}
 			
-			netack = hton32(tch->th_ack);
-
-			if (netack > sock->ts_snd_nxt) {
+			ack = tcp_recv_ack(ti, sock, nb);
+			if (ack < 0) {
 				tcp_build_and_send_sequence(ti, sock, TCF_ACK);
 				break;
 			}
-						
-			if (netack >= sock->ts_snd_una) {
-				calc_round_trip(sock);
-				
-				sock->ts_snd_una = netack;
-				
-				/*
-				 * If we've just had an ACK of all of the data
-				 * that we've sent we're finished
-				 */
-				if (netack == sock->ts_snd_nxt) {
-					close_socket(ti, sock);
-				}
+			
+			/*
+			 * If we've just had an ACK of all of the data that
+			 * we've sent we're finished
+			 */
+			if (ack > 0) {
+				close_socket(ti, sock);
 			}
 		}
 		break;
@@ -1358,56 +2353,147 @@ void tcp_recv_netbuf_icmp(void *clnt, struct netbuf *nb)
 	/*
 	 * Ignore anything other than "destination unreachable" errors.
 	 */
-	if (ich->ich_type != 0x04) {
+	if (ich->ich_type != 0x03) {
 		return;
 	}
 	
+	/*
+	 * We need the quoted IP header and at least the port numbers of the
+	 * TCP header that follows it.
+	 */
 	iph = (struct ip_header *)nb->nb_application;
+	if ((nb->nb_application_size < sizeof(struct ip_header))
+			|| (nb->nb_application_size < (iph->ih_header_len * 4) + 8)) {
+		return;
+	}
 	tch = (struct tcp_header *)(((u8_t *)iph) + (iph->ih_header_len * 4));
 
 	/*
 	 * Look up the socket details.  Note that we're only interested in
-	 * active (connected) sockets and not passive (listening) ones.
+	 * active (connected) sockets and not passive (listening) ones.  The
+	 * quoted segment is one that we sent, so its destination is the
+	 * remote end and its source is us.
 	 */
 	spinlock_lock(&ti->ti_lock);
 
-	sock = ti->ti_socks;
-	while (sock) {
-		if ((sock->ts_local_port == hton16(tch->th_dest_port))
-				&& (sock->ts_remote_addr == hton32(iph->ih_src_addr))
-				&& (sock->ts_remote_port == hton16(tch->th_src_port))) {
-			struct icmp_header *ich;
-			
+	sock = tcp_socket_lookup(ti, hton32(iph->ih_dest_addr), hton16(tch->th_dest_port), hton16(tch->th_src_port));
+	if (sock) {
+		/*
+		 * Is the ICMP type 2, 3 or 4?
+		 */
+		if ((ich->ich_code >= 2) && (ich->ich_code <= 4)) {
 			/*
-			 * Is the ICMP type 2, 3 or 4?
+			 * Send reset segments where necessary, and then close
+			 * the connection.
 			 */
-			ich = (struct icmp_header *)nb->nb_transport;
-		
-			if ((ich->ich_code >= 2) && (ich->ich_code <= 4)) {
-				/*
-				 * Send reset segments where necessary, and
-				 * then close the connection.
-				 */
-				if ((sock->ts_state == TCS_SYN_RECEIVED)
-						|| (sock->ts_state == TCS_ESTABLISHED)
-						|| (sock->ts_state == TCS_FIN_WAIT1)
-						|| (sock->ts_state == TCS_FIN_WAIT2)
-						|| (sock->ts_state == TCS_CLOSE_WAIT)) {
-					send_reset_close_socket(ti, sock);
-				} else {
-					close_socket(ti, sock);
-				}
+			if ((sock->ts_state == TCS_SYN_RECEIVED)
+					|| (sock->ts_state == TCS_ESTABLISHED)
+					|| (sock->ts_state == TCS_FIN_WAIT1)
+					|| (sock->ts_state == TCS_FIN_WAIT2)
+					|| (sock->ts_state == TCS_CLOSE_WAIT)) {
+				send_reset_close_socket(ti, sock);
+			} else {
+				close_socket(ti, sock);
 			}
-		
-			break;
 		}
-		
-		sock = sock->ts_next;
 	}
 
 	spinlock_unlock(&ti->ti_lock);
 }
 
+/*
+ * tcp_recv_predicted()
+ *	Try to handle a segment using header prediction.
+ *
+ * This is Van Jacobson's header prediction (as described in "TCP/IP Illustrated
+ * Volume 2").  Almost every segment that arrives on an established connection
+ * is either a pure ACK for new data or the next in-sequence data with nothing
+ * new ACK'd, and neither of these needs the full state machine.  If the
+ * segment has no surprises (no unusual flags or options, the same window as
+ * before, and we're not recovering from a loss) then we handle these two
+ * cases directly.
+ *
+ * Returns 1 if the segment has been dealt with or 0 if it needs to go through
+ * the full state machine.
+ */
+static u8_t tcp_recv_predicted(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb)
+{
+	struct tcp_header *tch = (struct tcp_header *)nb->nb_transport;
+	u32_t netack, tsval, tsecr;
+	u8_t *p;
+
+	if ((sock->ts_state != TCS_ESTABLISHED)
+			|| ((tch->th_ctrl_flags & (TCF_URG | TCF_ACK | TCF_RST | TCF_SYN | TCF_FIN)) != TCF_ACK)
+			|| (hton32(tch->th_sequence) != sock->ts_rcv_nxt)
+			|| (sock->ts_send_flags & TCP_SND_RECOVERY)
+			|| sock->ts_sacks) {
+		return 0;
+	}
+
+	/*
+	 * The only option we predict is the timestamps option, and only if
+	 * it's laid out the way that RFC7323 (appendix A) suggests.
+	 */
+	tsval = 0;
+	tsecr = 0;
+	if (sock->ts_opt_flags & TCP_OPT_TSTAMP) {
+		if (tch->th_data_offs != 8) {
+			return 0;
+		}
+
+		p = (u8_t *)(tch + 1);
+		if ((p[0] != 0x01) || (p[1] != 0x01) || (p[2] != 0x08) || (p[3] != 10)) {
+			return 0;
+		}
+
+		tsval = hton32(*((u32_t *)(p + 4)));
+		tsecr = hton32(*((u32_t *)(p + 8)));
+		if (SEQ_LT(tsval, sock->ts_ts_recent)) {
+			return 0;
+		}
+	} else if (tch->th_data_offs != 5) {
+		return 0;
+	}
+
+	if (((u32_t)hton16(tch->th_window) << sock->ts_snd_wscale) != sock->ts_snd_wnd) {
+		return 0;
+	}
+
+	netack = hton32(tch->th_ack);
+
+	if (nb->nb_application_size == 0) {
+		/*
+		 * A pure ACK for data that we've sent.  Free up whatever it
+		 * ACKs and send more if we can.
+		 */
+		if (SEQ_LE(netack, sock->ts_snd_una) || SEQ_GT(netack, sock->ts_snd_nxt)) {
+			return 0;
+		}
+
+		ti->ti_pred_acks++;
+		sock->ts_ts_recent = tsval;
+		sock->ts_seg_tsecr = tsecr;
+		sock->ts_cong->tco_ack(sock, tcp_recv_new_ack(sock, netack));
+		tcp_send_queued(ti, sock);
+		return 1;
+	}
+
+	/*
+	 * In-sequence data that fits our window and doesn't fill a gap in
+	 * front of any out-of-order data that we're holding.
+	 */
+	if ((netack != sock->ts_snd_una) || sock->ts_rcv_ooo
+			|| SEQ_GT(sock->ts_rcv_nxt + nb->nb_application_size, sock->ts_rcv_adv)
+			|| tcp_rcv_held_full(sock)) {
+		return 0;
+	}
+
+	ti->ti_pred_data++;
+	sock->ts_ts_recent = tsval;
+	tcp_recv_deliver(ti, sock, nb);
+	return 1;
+}
+
 /*
  * tcp_recv_netbuf()
  */
@@ -1415,7 +2501,7 @@ void tcp_recv_netbuf(void *clnt, struct netbuf *nb)
 {
 	struct ip_client *ic;
 	struct tcp_instance *ti;
-	struct tcp_socket *sock, *listener;
+	struct tcp_socket *sock;
 	u16_t csum;
 	struct ip_header *iph = (struct ip_header *)nb->nb_network;
 	struct tcp_header *tch = (struct tcp_header *)nb->nb_transport;
@@ -1437,8 +2523,8 @@ void tcp_recv_netbuf(void *clnt, struct netbuf *nb)
 	if (tch->th_csum != 0) {
 		csum = ipcsum_pseudo_partial(hton32(((struct ip_instance *)ic->ic_server->is_instance)->ii_addr),
 						iph->ih_src_addr, 0x06, hton16(nb->nb_transport_size + nb->nb_application_size));
-		csum = ipcsum_partial(csum, nb->nb_transport, nb->nb_transport_size);
-		csum = ipcsum(csum, nb->nb_application, nb->nb_application_size);
+		csum = ipcsum_netbuf_partial(csum, nb, nb->nb_transport,
+						nb->nb_transport_size + nb->nb_application_size) ^ 0xffff;
 		if (csum != 0) {
 			debug_print_pstr("\ftcprcv: csum fl: ");
 			debug_print16(csum);
@@ -1452,31 +2538,17 @@ void tcp_recv_netbuf(void *clnt, struct netbuf *nb)
 
 	/*
 	 * Look up the socket and see if we know anyone who will try and deal
-	 * with it!  If we find a listener then we need to keep looking for an
-	 * exact match before we go with it.
+	 * with it!  An exact connection match takes priority over a listener.
 	 */
 	spinlock_lock(&ti->ti_lock);
 
-	listener = NULL;
-	sock = ti->ti_socks;
-	while (sock) {
-		if (sock->ts_local_port == hton16(tch->th_dest_port)) {
-			if (sock->ts_state == TCS_LISTEN) {
-				listener = sock;
-			} else if ((sock->ts_remote_addr == hton32(iph->ih_src_addr))
-					&& (sock->ts_remote_port == hton16(tch->th_src_port))) {
-				break;
-			}
-		}
-		
-		sock = sock->ts_next;
-	}
+	sock = tcp_socket_lookup(ti, hton32(iph->ih_src_addr), hton16(tch->th_src_port), hton16(tch->th_dest_port));
 
 	/*
 	 * If we didn't get a connection match then we go for any passive match.
 	 */
 	if (!sock) {
-		sock = listener;
+		sock = tcp_listener_lookup(ti, hton16(tch->th_dest_port));
 	}
 
 	if (!sock) {
@@ -1492,10 +2564,7 @@ void tcp_recv_netbuf(void *clnt, struct netbuf *nb)
 		/*
 		 * Issue an ICMP destination unreachable message (port unreachable).
 		 */	
-		nbrep = netbuf_alloc();
-		nbrep->nb_application_membuf = membuf_alloc(nb->nb_network_size + 8, NULL);
-		nbrep->nb_application = nbrep->nb_application_membuf;
-	        nbrep->nb_application_size = nb->nb_network_size + 8;
+		nbrep = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_network_size + 8);
 
 		iphc = (struct ip_header *)nbrep->nb_application;
                 memcpy(iphc, nb->nb_network, nb->nb_network_size);
@@ -1509,11 +2578,22 @@ void tcp_recv_netbuf(void *clnt, struct netbuf *nb)
 	}
 
 	/*
-	 * Process any TCP header options and then invoke the receive state
-	 * machine.
+	 * Try the fast path first.  If that doesn't work then process any TCP
+	 * header options and invoke the receive state machine.  A segment
+	 * that fails the PAWS test is dropped, but we ACK it in case our peer
+	 * has lost track of where we are (RFC7323).
 	 */		
-	tcp_recv_options(ti, sock, nb);
-	tcp_recv_state_machine(ti, sock, nb);
+	ti->ti_segs_in++;
+	if (tcp_recv_predicted(ti, sock, nb)) {
+		spinlock_unlock(&ti->ti_lock);
+		return;
+	}
+
+	if (tcp_recv_options(ti, sock, nb) < 0) {
+		tcp_build_and_send_sequence(ti, sock, TCF_ACK);
+	} else {
+		tcp_recv_state_machine(ti, sock, nb);
+	}
 	
 	spinlock_unlock(&ti->ti_lock);
 }
@@ -1529,12 +2609,21 @@ void tcp_send_sequence(struct tcp_instance *ti, struct tcp_socket *sock, struct
 	u16_t csum;
         struct tcp_header *tch;
 	struct ip_server *is;
+	u8_t *p;
 
         /*
-         * Complete the TCP header.
+         * Complete the TCP header.  If there's a timestamps option then
+         * build_netbuf() will have put it first, and we fill it in now so
+         * that a retransmission carries the time that it was really sent.
          */
         tch = (struct tcp_header *)nb->nb_transport;
 	tch->th_ack = hton32(sock->ts_rcv_nxt);
+
+	p = (u8_t *)(tch + 1);
+	if ((tch->th_data_offs >= 8) && (p[0] == 0x01) && (p[1] == 0x01) && (p[2] == 0x08)) {
+		*((u32_t *)(p + 4)) = hton32(timer_get_jiffies());
+		*((u32_t *)(p + 8)) = hton32(sock->ts_ts_recent);
+	}
 		
 	tch->th_csum = 0;
 	
@@ -1543,11 +2632,15 @@ void tcp_send_sequence(struct tcp_instance *ti, struct tcp_socket *sock, struct
 	ip_server_ref(is);
 	spinlock_unlock(&ti->ti_lock);
 	
-	csum = ipcsum_pseudo_partial(hton32(((struct ip_instance *)is->is_instance)->ii_addr),
-					hton32(sock->ts_remote_addr), 0x06, hton16(nb->nb_transport_size + nb->nb_application_size));
+	/*
+	 * The socket's pseudo header sum just needs the segment length adding
+	 * to it.
+	 */
+	csum = ipcsum_add(sock->ts_pseudo_csum, hton16(nb->nb_transport_size + nb->nb_application_size));
 	csum = ipcsum_partial(csum, tch, nb->nb_transport_size);
 	tch->th_csum = ipcsum(csum, nb->nb_application, nb->nb_application_size);
-		
+
+	nb->nb_dst_cache = &sock->ts_dst;
 	is->is_send(is, hton32(sock->ts_remote_addr), 0x06, nb);
 
 	ip_server_deref(is);
@@ -1560,19 +2653,13 @@ void tcp_build_and_send_sequence(struct tcp_instance *ti, struct tcp_socket *soc
 {
 	struct netbuf *nb;
 	
-	nb = netbuf_alloc();
+	nb = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 0);
 	
 	build_netbuf(ti, sock, ctrl_flags, nb);
 
 	if (ctrl_flags & (TCF_SYN | TCF_FIN)) {
 		sock->ts_snd_nxt++;
-		sock->ts_awaiting_ack = netbuf_clone(nb);
-		sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
-		sock->ts_retransmits = 0;
-		sock->ts_send_jiffies = timer_get_jiffies();
-	        sock->ts_send_flags = TCP_SND_RETRANS_TIMING;
-		tcp_socket_ref(sock);
-		oneshot_attach(sock->ts_wait_timer);
+		tcp_queue_retransmit(sock, nb);
 	}
 
         /*
@@ -1797,6 +2884,7 @@ s8_t tcp_connect(void *srv, u32_t addr, u16_t port)
 	sock->ts_local_port = ti->ti_last_local_port;
 	sock->ts_remote_port = port;
 	sock->ts_remote_addr = addr;
+	tcp_socket_template(ti, sock);
 	sock->ts_state = TCS_SYN_SENT;
 	tcp_socket_attach(ti, sock);
 	tcp_socket_deref(sock);
@@ -1818,12 +2906,7 @@ s8_t tcp_connect(void *srv, u32_t addr, u16_t port)
 			 * We've been interrupted so we purge and close
 			 * this socket.
 			 */
-			if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-				sock->ts_send_flags &= (~TCP_SND_RETRANS_TIMING);
-				oneshot_detach(sock->ts_wait_timer);
-				tcp_socket_deref(sock);
-				netbuf_deref(sock->ts_awaiting_ack);
-			}
+			tcp_stop_retransmit(sock);
 			sock->ts_state = TCS_CLOSED;
 			tcp_socket_detach(ti, sock);
 		}
@@ -1890,6 +2973,10 @@ void tcp_close(void *srv)
 
 /*
  * tcp_send_netbuf_now()
+ *	Send a segment from the head of the send queue.
+ *
+ * It is assumed that the instance lock is held on entry to this function.  It
+ * is released while the segment is actually sent.
  */
 void tcp_send_netbuf_now(struct tcp_instance *ti, struct tcp_socket *sock, struct netbuf *nb)
 {
@@ -1907,13 +2994,7 @@ void tcp_send_netbuf_now(struct tcp_instance *ti, struct tcp_socket *sock, struc
         build_netbuf(ti, sock, TCF_PSH | TCF_ACK, nb);
 	
 	sock->ts_snd_nxt += nb->nb_application_size;
-	sock->ts_awaiting_ack = netbuf_clone(nb);
-	sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
-	sock->ts_retransmits = 0;
-	sock->ts_send_jiffies = timer_get_jiffies();
-        sock->ts_send_flags = TCP_SND_RETRANS_TIMING;
-	tcp_socket_ref(sock);
-	oneshot_attach(sock->ts_wait_timer);
+	tcp_queue_retransmit(sock, nb);
 
 	spinlock_unlock(&ti->ti_lock);
 
@@ -1922,14 +3003,59 @@ void tcp_send_netbuf_now(struct tcp_instance *ti, struct tcp_socket *sock, struc
 	spinlock_lock(&ti->ti_lock);
 }
 
+/*
+ * tcp_send_queued()
+ *	Send as many waiting segments as the send window will take.
+ *
+ * The send window is the smaller of the peer's advertised window and our
+ * congestion window.
+ *
+ * If there's nothing waiting to be ACK'd then we always send one segment,
+ * even if the window is closed.  The retransmit timer then keeps probing the
+ * window until it opens again.
+ *
+ * It is assumed that the instance lock is held on entry to this function.
+ */
+void tcp_send_queued(struct tcp_instance *ti, struct tcp_socket *sock)
+{
+	struct netbuf *nb;
+	u32_t wnd;
+
+	while ((nb = sock->ts_awaiting_send)) {
+		wnd = sock->ts_snd_wnd;
+		if (sock->ts_cwnd < wnd) {
+			wnd = sock->ts_cwnd;
+		}
+
+		if (sock->ts_awaiting_ack
+				&& SEQ_GT(sock->ts_snd_nxt + nb->nb_application_size,
+						sock->ts_snd_una + wnd)) {
+			break;
+		}
+
+		sock->ts_awaiting_send = nb->nb_next;
+		nb->nb_next = NULL;
+		tcp_send_netbuf_now(ti, sock, nb);
+		netbuf_deref(nb);
+	}
+}
+
 /*
  * tcp_send_netbuf()
+ *
+ * The data is cut up into segments of no more than the peer's MSS, which are
+ * added to the end of the send queue.  Apart from the first, each segment is
+ * a clone that refers to part of the original application data, so nothing
+ * is copied.
  */
 void tcp_send_netbuf(void *srv, struct netbuf *nb)
 {
 	struct tcp_server *ts;
 	struct tcp_instance *ti;
 	struct tcp_socket *sock;
+	struct netbuf *seg;
+	struct netbuf **pprev;
+	addr_t offs, sz, mss;
 	
 	ts = (struct tcp_server *)srv;
 	ti = (struct tcp_instance *)ts->ts_instance;
@@ -1942,50 +3068,47 @@ void tcp_send_netbuf(void *srv, struct netbuf *nb)
         	return;
         }
 
-	if (sock->ts_send_flags & TCP_SND_RETRANS_TIMING) {
-		struct netbuf *p;
-		struct netbuf **pprev;
-
-		netbuf_ref(nb);
-		pprev = &sock->ts_awaiting_send;
-		p = sock->ts_awaiting_send;
-		while (p) {
-			pprev = &p->nb_next;
-			p = p->nb_next;
-		}
-	
-		nb->nb_next = NULL;
-		*pprev = nb;
-
-		spinlock_unlock(&ti->ti_lock);
-        	return;
+	pprev = &sock->ts_awaiting_send;
+	seg = sock->ts_awaiting_send;
+	while (seg) {
+		pprev = &seg->nb_next;
+		seg = seg->nb_next;
 	}
-	
+
 	/*
-	 * If we had a previously deferred ACK then we can eliminate it now
-	 * because we're going to send our segment and an ACK now.
+	 * Our peer's MSS doesn't allow for TCP options, so leave room for
+	 * the timestamps that go in every segment.
 	 */
-	if (sock->ts_send_flags & TCP_SND_DEFERRED_ACK) {
-		sock->ts_send_flags &= (~TCP_SND_DEFERRED_ACK);
-		oneshot_detach(sock->ts_deferred_ack_timer);
-		tcp_socket_deref(sock);
-		netbuf_deref(sock->ts_deferred_ack);
+	mss = sock->ts_remote_mss;
+	if (sock->ts_opt_flags & TCP_OPT_TSTAMP) {
+		mss -= 12;
 	}
-	
-        build_netbuf(ti, sock, TCF_PSH | TCF_ACK, nb);
-	
-	sock->ts_snd_nxt += nb->nb_application_size;
-	sock->ts_awaiting_ack = netbuf_clone(nb);
-	sock->ts_wait_timer->os_ticks_left = sock->ts_rto_next;
-	sock->ts_retransmits = 0;
-	sock->ts_send_jiffies = timer_get_jiffies();
-        sock->ts_send_flags = TCP_SND_RETRANS_TIMING;
-	tcp_socket_ref(sock);
-	oneshot_attach(sock->ts_wait_timer);
 
-	spinlock_unlock(&ti->ti_lock);
+	offs = 0;
+	do {
+		sz = nb->nb_application_size - offs;
+		if (sz > mss) {
+			sz = mss;
+		}
 
-	tcp_send_sequence(ti, sock, nb);
+		if ((offs == 0) && (sz == nb->nb_application_size)) {
+			seg = nb;
+			netbuf_ref(seg);
+		} else {
+			seg = netbuf_clone(nb);
+			seg->nb_application = (u8_t *)nb->nb_application + offs;
+			seg->nb_application_size = sz;
+		}
+
+		seg->nb_next = NULL;
+		*pprev = seg;
+		pprev = &seg->nb_next;
+		offs += sz;
+	} while (offs < nb->nb_application_size);
+
+	tcp_send_queued(ti, sock);
+
+	spinlock_unlock(&ti->ti_lock);
 }
 
 /*
@@ -2116,6 +3239,24 @@ int tcp_dump_stats(struct tcp_instance *ti, struct tcp_socket *sbuf, int max)
 	return ct;
 }
 
+/*
+ * tcp_dump_pred_stats()
+ *	Report how often header prediction is working.
+ *
+ * We return the number of segments received for our sockets, followed by the
+ * number handled as predicted ACKs and the number handled as predicted data.
+ */
+void tcp_dump_pred_stats(struct tcp_instance *ti, u32_t *buf)
+{
+	spinlock_lock(&ti->ti_lock);
+
+	buf[0] = ti->ti_segs_in;
+	buf[1] = ti->ti_pred_acks;
+	buf[2] = ti->ti_pred_data;
+
+	spinlock_unlock(&ti->ti_lock);
+}
+
 /*
  * tcp_instance_alloc()
  */
@@ -2123,6 +3264,11 @@ struct tcp_instance *tcp_instance_alloc(struct ip_instance *ii)
 {
 	struct tcp_instance *ti;
 	struct ip_client *ic;
+	u8_t i;
+
+	if (!tcp_socket_cache) {
+		tcp_socket_cache = membuf_cache_create(sizeof(struct tcp_socket), TCP_SOCKET_CACHE_SIZE);
+	}
 
 	ti = (struct tcp_instance *)membuf_alloc(sizeof(struct tcp_instance), NULL);
 	ti->ti_client_attach = tcp_client_attach;
@@ -2130,7 +3276,17 @@ struct tcp_instance *tcp_instance_alloc(struct ip_instance *ii)
 	ti->ti_client_list = NULL;
 	spinlock_init(&ti->ti_lock, 0x20);
 	ti->ti_last_local_port = 0x1008;
+	ti->ti_cong = &tcp_cong_newreno;
+	ti->ti_segs_in = 0;
+	ti->ti_pred_acks = 0;
+	ti->ti_pred_data = 0;
 	ti->ti_socks = NULL;
+	for (i = 0; i < TCP_CONN_HASH_SIZE; i++) {
+		ti->ti_conn_hash[i] = NULL;
+	}
+	for (i = 0; i < TCP_LISTEN_HASH_SIZE; i++) {
+		ti->ti_listen_hash[i] = NULL;
+	}
 	
 	/*
 	 * Attach this protocol handler to the IP stack.
@@ -0,0 +1,179 @@
+/*
+ * tcp_newreno.c
+ *	TCP NewReno congestion control.
+ *
+ * Copyright (C) 2000 David J. Hudson <dave@humbug.demon.co.uk>
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this file and/or modify it under the terms of the GNU
+ * General Public License (GPL) as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "copying-gpl.txt" for more details.
+ *
+ * As a special exception to the GPL, permission is granted for additional
+ * uses of the text contained in this file.  See the accompanying file
+ * "copying-liquorice.txt" for details.
+ *
+ * This implements slow start and congestion avoidance as described in
+ * RFC2581, together with the NewReno modification to fast retransmit and
+ * fast recovery from RFC2582.  All window values are in bytes.
+ */
+#include "types.h"
+#include "memory.h"
+#include "context.h"
+#include "condvar.h"
+#include "atomic.h"
+#include "membuf.h"
+#include "netbuf.h"
+#include "oneshot.h"
+#include "ip.h"
+#include "tcp.h"
+
+/*
+ * newreno_flight_half()
+ *	Work out the new slow start threshold after a loss.
+ *
+ * This is half of the data in flight, but never less than two segments.
+ */
+static u32_t newreno_flight_half(struct tcp_socket *ts)
+{
+	u32_t half;
+
+	half = (ts->ts_snd_nxt - ts->ts_snd_una) >> 1;
+	if (half < (ts->ts_remote_mss << 1)) {
+		half = ts->ts_remote_mss << 1;
+	}
+
+	return half;
+}
+
+/*
+ * newreno_init()
+ *	Set up the initial window for a new connection.
+ *
+ * We start with a window of up to 4 segments (RFC2414).
+ */
+static void newreno_init(struct tcp_socket *ts)
+{
+	u32_t mss = ts->ts_remote_mss;
+
+	if (mss > 2190) {
+		ts->ts_cwnd = mss << 1;
+	} else if (mss > 1095) {
+		ts->ts_cwnd = mss * 3;
+	} else {
+		ts->ts_cwnd = mss << 2;
+	}
+
+	ts->ts_ssthresh = 0xffff;
+	ts->ts_recover = ts->ts_snd_una - 1;
+	ts->ts_dup_acks = 0;
+	ts->ts_send_flags &= (~TCP_SND_RECOVERY);
+}
+
+/*
+ * newreno_ack()
+ *	Open the window up when new data is ACK'd.
+ *
+ * Outside of recovery we grow the window by up to one segment per ACK during
+ * slow start and by about one segment per round trip during congestion
+ * avoidance.  During recovery an ACK that doesn't cover everything that was
+ * outstanding when we started is a "partial ACK", which tells us that the
+ * next segment was lost too and needs retransmitting.
+ */
+static u8_t newreno_ack(struct tcp_socket *ts, u32_t acked)
+{
+	u32_t mss = ts->ts_remote_mss;
+	u32_t inc;
+
+	ts->ts_dup_acks = 0;
+
+	if (ts->ts_send_flags & TCP_SND_RECOVERY) {
+		if (SEQ_GT(ts->ts_snd_una, ts->ts_recover)) {
+			ts->ts_send_flags &= (~TCP_SND_RECOVERY);
+			ts->ts_cwnd = ts->ts_ssthresh;
+			return 0;
+		}
+
+		/*
+		 * Deflate the window by the amount of new data ACK'd and
+		 * add back one segment for the retransmission.
+		 */
+		ts->ts_cwnd -= (acked < ts->ts_cwnd) ? acked : ts->ts_cwnd;
+		if (acked >= mss) {
+			ts->ts_cwnd += mss;
+		}
+		return 1;
+	}
+
+	if (ts->ts_cwnd < ts->ts_ssthresh) {
+		inc = (acked < mss) ? acked : mss;
+	} else {
+		inc = (mss * mss) / ts->ts_cwnd;
+		if (inc == 0) {
+			inc = 1;
+		}
+	}
+	ts->ts_cwnd += inc;
+
+	return 0;
+}
+
+/*
+ * newreno_dup_ack()
+ *	Handle a duplicate ACK.
+ *
+ * The third duplicate ACK in a row starts fast retransmit, unless it's for
+ * data that was sent before we last started recovering from a loss.  Each
+ * further duplicate ACK means that another segment has left the network so
+ * we inflate the window to let a new one in.
+ */
+static u8_t newreno_dup_ack(struct tcp_socket *ts)
+{
+	if (ts->ts_send_flags & TCP_SND_RECOVERY) {
+		ts->ts_cwnd += ts->ts_remote_mss;
+		return 0;
+	}
+
+	ts->ts_dup_acks++;
+	if (ts->ts_dup_acks != 3) {
+		return 0;
+	}
+
+	if (SEQ_LE(ts->ts_snd_una, ts->ts_recover)) {
+		return 0;
+	}
+
+	ts->ts_ssthresh = newreno_flight_half(ts);
+	ts->ts_cwnd = ts->ts_ssthresh + (ts->ts_remote_mss * 3);
+	ts->ts_recover = ts->ts_snd_nxt - 1;
+	ts->ts_send_flags |= TCP_SND_RECOVERY;
+
+	return 1;
+}
+
+/*
+ * newreno_timeout()
+ *	Collapse the window after a retransmit timeout.
+ */
+static void newreno_timeout(struct tcp_socket *ts)
+{
+	ts->ts_ssthresh = newreno_flight_half(ts);
+	ts->ts_cwnd = ts->ts_remote_mss;
+	ts->ts_recover = ts->ts_snd_nxt - 1;
+	ts->ts_dup_acks = 0;
+	ts->ts_send_flags &= (~TCP_SND_RECOVERY);
+}
+
+/*
+ * NewReno congestion control operations.
+ */
+struct tcp_cong_ops tcp_cong_newreno = {
+	newreno_init,
+	newreno_ack,
+	newreno_dup_ack,
+	newreno_timeout
+};
@@ -32,6 +32,21 @@
 struct thread *thread_list = NULL;
 struct thread *idle_free = NULL;
 
+/*
+ * Hook used by the idle thread to wait for something to happen.  By default
+ * we don't have one and the idle thread just spins, but a platform can supply
+ * its own (say, one that halts the CPU until the next interrupt).
+ */
+void thread_idle_wait(void) __attribute__ ((weak, alias ("thread_idle_spin")));
+
+/*
+ * thread_idle_spin()
+ *	Default idle wait - do nothing.
+ */
+void thread_idle_spin(void)
+{
+}
+
 /*
  * idle_thread()
  */
@@ -62,6 +77,15 @@ void idle_thread(void *arg)
 	
 		isr_disable();
 		t = idle_free;
+
+		/*
+		 * If there's nothing to tidy up then wait for something else to
+		 * do.  The wait hook is called with interrupts disabled so that
+		 * nothing can sneak in between the check and the wait.
+		 */
+		if (!t) {
+			thread_idle_wait();
+		}
 		isr_enable();
 	
 		while (t) {
@@ -21,6 +21,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "context.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
 #include "ipcsum.h"
@@ -56,8 +57,8 @@ static void udp_recv_netbuf(void *clnt, struct netbuf *nb)
 	if (udh->uh_csum != 0) {
 		csum = ipcsum_pseudo_partial(hton32(((struct ip_instance *)ic->ic_server->is_instance)->ii_addr),
 						iph->ih_src_addr, 0x11, udh->uh_len);
-		csum = ipcsum_partial(csum, nb->nb_transport, nb->nb_transport_size);
-		csum = ipcsum(csum, nb->nb_application, nb->nb_application_size);
+		csum = ipcsum_netbuf_partial(csum, nb, nb->nb_transport,
+						nb->nb_transport_size + nb->nb_application_size) ^ 0xffff;
 		if (csum != 0) {
 			debug_print_pstr("\fudp recv: csum fail: ");
 			debug_print16(csum);
@@ -94,10 +95,7 @@ static void udp_recv_netbuf(void *clnt, struct netbuf *nb)
 		/*
 		 * Issue an ICMP destination unreachable message (port unreachable).
 		 */	
-		nbrep = netbuf_alloc();
-		nbrep->nb_application_membuf = membuf_alloc(nb->nb_network_size + 8, NULL);
-		nbrep->nb_application = nbrep->nb_application_membuf;
-	        nbrep->nb_application_size = nb->nb_network_size + 8;
+		nbrep = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_network_size + 8);
 
 		iphc = (struct ip_header *)nbrep->nb_application;
                 memcpy(iphc, iph, nb->nb_network_size);
@@ -127,11 +125,7 @@ static void udp_send_netbuf(void *srv, u32_t dest_addr, u16_t dest_port, struct
 	us = (struct udp_server *)srv;
 	ui = (struct udp_instance *)us->us_instance;
         	
-	nb->nb_transport_membuf = membuf_alloc(sizeof(struct udp_header), NULL);
-	nb->nb_transport = nb->nb_transport_membuf;
-	nb->nb_transport_size = sizeof(struct udp_header);
-
-	udh = (struct udp_header *)nb->nb_transport;
+	udh = (struct udp_header *)netbuf_push_transport(nb, sizeof(struct udp_header));
 	udh->uh_dest_port = dest_port;
 	udh->uh_src_port = hton16(us->us_port);
 	udh->uh_len = hton16(nb->nb_transport_size + nb->nb_application_size);
@@ -149,8 +143,11 @@ static void udp_send_netbuf(void *srv, u32_t dest_addr, u16_t dest_port, struct
 	udh->uh_csum = ipcsum(csum, nb->nb_application, nb->nb_application_size);
 
 	/*
-	 * Pass the netbuf down to the next layer.
+	 * Pass the netbuf down to the next layer.  If we keep sending to the
+	 * same destination then our destination cache entry saves the lower
+	 * layers from having to look up the route each time.
 	 */
+	nb->nb_dst_cache = &us->us_dst;
 	is->is_send(is, dest_addr, 0x11, nb);
 
 	ip_server_deref(is);
@@ -190,6 +187,7 @@ struct udp_server *udp_server_alloc(void)
 	
 	us = (struct udp_server *)membuf_alloc(sizeof(struct udp_server), NULL);
         us->us_send = udp_send_netbuf;
+	ip_dst_cache_init(&us->us_dst);
 	
 	return us;
 }
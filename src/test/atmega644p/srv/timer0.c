@@ -29,6 +29,7 @@
 #include "context.h"
 #include "thread.h"
 #include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "timer.h"
 #include "oneshot.h"
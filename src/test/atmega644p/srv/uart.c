@@ -27,6 +27,7 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "uart.h"
 
@@ -28,7 +28,9 @@
 #include "condvar.h"
 #include "heap.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
+#include "objcache.h"
 #include "netbuf.h"
 #include "timer.h"
 #include "oneshot.h"
@@ -39,6 +41,7 @@
 #include "ne2000.h"
 #include "smc91c96.h"
 #include "ip_datalink.h"
+#include "ip_route.h"
 #include "slip.h"
 #include "ppp.h"
 #include "ethernet.h"
@@ -274,10 +277,7 @@ void test1_thread(void *arg)
 		/*
 		 * Issue an ICMP echo request.
 		 */	
-		nb = netbuf_alloc();
-		nb->nb_application_membuf = membuf_alloc(32, NULL);
-		nb->nb_application = nb->nb_application_membuf;
-	        nb->nb_application_size = 32;
+		nb = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 32);
 
 		p = (u16_t *)&empty;
                 *p++ = 0;
@@ -324,10 +324,7 @@ void test2_recv(void *clnt, struct netbuf *nb)
 	iph = (struct ip_header *)nb->nb_network;
 	udh = (struct udp_header *)nb->nb_transport;
 
-	nbrep = netbuf_alloc();
-	nbrep->nb_application_membuf = membuf_alloc(nb->nb_application_size, NULL);
-	nbrep->nb_application = nbrep->nb_application_membuf;
-        nbrep->nb_application_size = nb->nb_application_size;
+	nbrep = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_application_size);
 	        		                				
 	memcpy(nbrep->nb_application, nb->nb_application, nb->nb_application_size);
 	us->us_send(us, iph->ih_src_addr, udh->uh_src_port, nbrep);
@@ -402,10 +399,7 @@ void test3_recv(void *clnt, struct netbuf *nb)
 	/*
 	 * Package up what we've received and send it back.
 	 */		
-	nbr = netbuf_alloc();
-	nbr->nb_application_membuf = membuf_alloc(nb->nb_application_size, NULL);
-	nbr->nb_application = nbr->nb_application_membuf;
-        nbr->nb_application_size = nb->nb_application_size;
+	nbr = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_application_size);
 	
 	memcpy(nbr->nb_application, nb->nb_application, nb->nb_application_size);
 			
@@ -552,10 +546,7 @@ void test4_thread(void *arg)
                 		buf[i] = x * 0x10 + i;
                 	}
 
-			nbr = netbuf_alloc();
-			nbr->nb_application_membuf = membuf_alloc(8, NULL);
-			nbr->nb_application = nbr->nb_application_membuf;
-		        nbr->nb_application_size = 8;
+			nbr = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 8);
 	
 			memcpy(nbr->nb_application, buf, 8);
 			
@@ -784,6 +775,31 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 	p = obuf;
 
 	switch (cmd) {
+	case 'c':
+		{
+			struct objcache *cnext, *cbuf;
+
+			cbuf = heap_alloc(16 * sizeof(struct objcache));
+			p += sprintf(p, "\r\nObject caches:\r\n");
+
+			ct = objcache_dump_stats(cbuf, 16);
+			if (ct == 16) {
+				p += sprintf(p, "Note: List at maximum...\r\n");
+			}
+
+			cnext = cbuf;
+			while (ct) {
+				p += sprintf(p, "addr:%x, size:%d, in use:%d/%d, high:%d, overflows:%d\r\n",
+						(addr_t)cnext->oc_next, cnext->oc_size, cnext->oc_in_use,
+						cnext->oc_count, cnext->oc_high_water, cnext->oc_overflows);
+				cnext++;
+				ct--;
+			}
+
+			heap_free(cbuf);
+		}
+		break;
+
 	case 'f':
 		{
 			struct memory_hole *mnext, *mbuf;
@@ -809,6 +825,7 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 
 	case 'h':
 		strcpy(p, "\r\nMonitor options\r\n"
+			"c: Object caches\r\n"
 			"f: Free heap (memory) chains\r\n"
 			"h: Help\r\n"
 			"l: Load averages\r\n"
@@ -1099,6 +1116,12 @@ void init(void)
 	ipi2 = ip_instance_alloc(iei, 0xc0a800cd);
 	udpi2 = udp_instance_alloc(ipi2);
 	tcpi2 = tcp_instance_alloc(ipi2);
+
+	/*
+	 * Route to the Ethernet's network, and from there to anywhere else.
+	 */
+	ip_route_add(iei, 0xc0a80000, 24, 0x00000000);
+	ip_route_add(iei, 0x00000000, 0, 0xc0a80001);
 #endif
 
 #if defined(STK300) || defined(DJHNE) || defined(DJH300)
@@ -39,8 +39,10 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "ethdev.h"
 #include "ne2000.h"
 
@@ -351,6 +353,7 @@ struct netbuf *ns8390_recv_get_packet(void)
         u8_t nextpg;
         u8_t bnry;
         u16_t i;
+	u32_t sum;
                                  		
 	get_header(&hdr);
 	count = hdr.ph_size - sizeof(struct ns8390_pkt_header);
@@ -375,7 +378,8 @@ struct netbuf *ns8390_recv_get_packet(void)
 		return NULL;
 	}
 	
-	pkt = (u8_t *)membuf_alloc(count, NULL);
+	nb = netbuf_alloc_with_data(count);
+	pkt = (u8_t *)nb->nb_datalink;
 	buf = pkt;
 		
         bnry = ns8390_read(NS8390_PG0_BNRY) + 1;
@@ -393,12 +397,16 @@ struct netbuf *ns8390_recv_get_packet(void)
 	ns8390_write(NS8390_PG0_RSAR1, bnry);
 
 	/*
-	 * Perform the read.
+	 * Perform the read, summing the packet for the IP checksums as we go.
 	 */	
+	sum = 0;
 	ns8390_write(NS8390_CR, NS8390_CR_STA | NS8390_CR_RD0);
 	for (i = 0; i < count; i++) {
-		*buf++ = ns8390_read(NS8390_IOPORT);
+		*buf = ns8390_read(NS8390_IOPORT);
+		sum += ipcsum_u8(*buf++, i);
 	}
+
+	netbuf_set_rx_csum(nb, pkt, count, ipcsum_fold(sum));
 	
 	/*
 	 * Tidy up.
@@ -433,11 +441,6 @@ struct netbuf *ns8390_recv_get_packet(void)
         }
 	ns8390_write(NS8390_PG0_BNRY, nextpg);
 
-	nb = netbuf_alloc();
-	nb->nb_datalink_membuf = pkt;
-	nb->nb_datalink = pkt;
-	nb->nb_datalink_size = count;
-		
 	return nb;
 }
 
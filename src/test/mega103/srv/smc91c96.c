@@ -25,8 +25,10 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "ethdev.h"
 #include "smc91c96.h"
 
@@ -236,6 +238,8 @@ struct netbuf *smc91c96_recv_get_packet(void)
 	        u8_t *pkt;
 	        u16_t *buf;
 	        u16_t words;
+	        u16_t w;
+	        u32_t sum;
         	u16_t pktsz;
         	        	
         	/*
@@ -244,22 +248,23 @@ struct netbuf *smc91c96_recv_get_packet(void)
         	 */
         	pktsz = smc91c96_read16(SMC_B2_DATA) - 4;
 
-       		pkt = membuf_alloc(pktsz, NULL);
+		nb = netbuf_alloc_with_data(pktsz);
+		pkt = (u8_t *)nb->nb_datalink;
 	        buf = (u16_t *)pkt;
 	
 		/*
-		 * Read the packet.
+		 * Read the packet, summing it for the IP checksums as we go.
 		 */
 		words = pktsz >> 1;
+		sum = 0;
 		while (words) {
-			*buf++ = smc91c96_read16(SMC_B2_DATA);
+			w = smc91c96_read16(SMC_B2_DATA);
+			*buf++ = w;
+			sum += w;
 			words--;
 		}
 
-        	nb = netbuf_alloc();
-		nb->nb_datalink_membuf = pkt;
-		nb->nb_datalink = pkt;
-		nb->nb_datalink_size = pktsz;
+		netbuf_set_rx_csum(nb, pkt, pktsz & 0xfffe, ipcsum_fold(sum));
 	}
 
         /*
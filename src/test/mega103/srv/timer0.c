@@ -26,6 +26,7 @@
 #include "context.h"
 #include "thread.h"
 #include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "timer.h"
 #include "oneshot.h"
@@ -28,7 +28,9 @@
 #include "condvar.h"
 #include "heap.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
+#include "objcache.h"
 #include "netbuf.h"
 #include "pic.h"
 #include "timer.h"
@@ -40,6 +42,7 @@
 #include "i82595.h"
 #include "ppp_ahdlc.h"
 #include "ip_datalink.h"
+#include "ip_route.h"
 #include "ppp.h"
 #include "ethernet.h"
 #include "ppp_ip.h"
@@ -242,10 +245,7 @@ void test3_recv(void *clnt, struct netbuf *nb)
 	/*
 	 * Package up what we've received and send it back.
 	 */		
-	nbr = netbuf_alloc();
-	nbr->nb_application_membuf = membuf_alloc(nb->nb_application_size, NULL);
-	nbr->nb_application = nbr->nb_application_membuf;
-        nbr->nb_application_size = nb->nb_application_size;
+	nbr = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, nb->nb_application_size);
 	
 	memcpy(nbr->nb_application, nb->nb_application, nb->nb_application_size);
 			
@@ -392,10 +392,7 @@ void test4_thread(void *arg)
                 		buf[i] = x * 0x10 + i;
                 	}
 
-			nbr = netbuf_alloc();
-			nbr->nb_application_membuf = membuf_alloc(8, NULL);
-			nbr->nb_application = nbr->nb_application_membuf;
-		        nbr->nb_application_size = 8;
+			nbr = netbuf_alloc_headroom(NETBUF_TX_HEADROOM, 8);
 	
 			memcpy(nbr->nb_application, buf, 8);
 			
@@ -626,6 +623,31 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 	p = obuf;
 
 	switch (cmd) {
+	case 'c':
+		{
+			struct objcache *cnext, *cbuf;
+
+			cbuf = heap_alloc(16 * sizeof(struct objcache));
+			p += sprintf(p, "\r\nObject caches:\r\n");
+
+			ct = objcache_dump_stats(cbuf, 16);
+			if (ct == 16) {
+				p += sprintf(p, "Note: List at maximum...\r\n");
+			}
+
+			cnext = cbuf;
+			while (ct) {
+				p += sprintf(p, "addr:%x, size:%d, in use:%d/%d, high:%d, overflows:%d\r\n",
+						(addr_t)cnext->oc_next, cnext->oc_size, cnext->oc_in_use,
+						cnext->oc_count, cnext->oc_high_water, cnext->oc_overflows);
+				cnext++;
+				ct--;
+			}
+
+			heap_free(cbuf);
+		}
+		break;
+
 	case 'f':
 		{
 			struct memory_hole *mnext, *mbuf;
@@ -651,10 +673,12 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 
 	case 'h':
 		strcpy(p, "\r\nMonitor options\r\n"
+			"c: Object caches\r\n"
 			"f: Free heap (memory) chains\r\n"
 			"h: Help\r\n"
 			"l: Load averages\r\n"
 			"o: One-shot timers\r\n"
+			"p: TCP header prediction\r\n"
 			"q: Quit telnet session\r\n"
 			"s: TCP sockets\r\n"
 			"t: Threads\r\n"
@@ -665,15 +689,25 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 		{
 			long avg[3];
                         extern u8_t ldavg_runnable;
+                        extern u32_t timer_irqs;
                         u8_t r;
+                        u32_t irqs;
+                        u32_t j, wall;
 
                         isr_disable();
                         r = ldavg_runnable - 1;
+                        irqs = timer_irqs;
                         isr_enable();
 			
 			timer_dump_stats((u32_t *)avg, 3);
                         						
-			p += sprintf(p, "\r\nLoad averages: %ld, %ld, %ld (%d)\r\n\r\n", avg[0], avg[1], avg[2], r);
+			p += sprintf(p, "\r\nLoad averages: %ld, %ld, %ld (%d)\r\n", avg[0], avg[1], avg[2], r);
+			wall = timer_get_wall_seconds();
+			j = timer_get_jiffies();
+			p += sprintf(p, "Timer interrupts: %ld in %ld jiffies\r\n", (long)irqs, (long)j);
+			p += sprintf(p, "Wall-clock: %ld secs by jiffies, %ld secs by RTC (%s)\r\n\r\n",
+					(long)(j / TICK_RATE), (long)wall,
+					((j / TICK_RATE) + 1 >= wall) ? "ok" : "LOSING TICKS");
 		}
 		break;
 	
@@ -701,26 +735,41 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 		}
 		break;
 
-/*
+	case 'p':
+		{
+			u32_t pred[3];
+			u32_t hits;
+
+			tcp_dump_pred_stats((struct tcp_instance *)ts->ts_instance, pred);
+			hits = pred[1] + pred[2];
+
+			p += sprintf(p, "\r\nTCP segments received: %ld\r\n", (long)pred[0]);
+			p += sprintf(p, "Predicted ACKs: %ld, predicted data: %ld\r\n", (long)pred[1], (long)pred[2]);
+			p += sprintf(p, "Hit ratio: %ld%%\r\n\r\n", pred[0] ? (long)((hits * 100) / pred[0]) : 0L);
+		}
+		break;
+
 	case 's':
 		{
 			struct tcp_socket *snext, *sbuf;
 			
-			sbuf = heap_alloc(12 * sizeof(struct tcp_socket));
+			sbuf = heap_alloc(6 * sizeof(struct tcp_socket));
 			p += sprintf(p, "\r\nTCP socket details:\r\n");
 	
-			ct = tcp_dump_stats(NULL, sbuf, 12);
-			if (ct == 12) {
+			ct = tcp_dump_stats((struct tcp_instance *)ts->ts_instance, sbuf, 6);
+			if (ct == 6) {
 				p += sprintf(p, "Note: List at maximum...\r\n");
 			}
 			
 			snext = sbuf;
 			while (ct) {
-				p += sprintf(p, "addr:%x, local:%lx:%x, remote:%lx:%x, state:%x\r\n",
-						(addr_t)snext->ts_next,
-						snext->ts_local_addr, snext->ts_local_port,
-						snext->ts_remote_addr, snext->ts_remote_port,
+				p += sprintf(p, "addr:%x, local:%x, remote:%lx:%x, state:%x\r\n",
+						(addr_t)snext->ts_next, snext->ts_local_port,
+						(unsigned long)snext->ts_remote_addr, snext->ts_remote_port,
 						snext->ts_state);
+				p += sprintf(p, "  cwnd:%lu, ssthresh:%lu, fast retransmits:%u, timeouts:%u\r\n",
+						(unsigned long)snext->ts_cwnd, (unsigned long)snext->ts_ssthresh,
+						snext->ts_fast_retransmits, snext->ts_timeouts);
 				snext++;
 				ct--;
 			}
@@ -728,7 +777,6 @@ void test6_body(struct tcp_server *ts, u8_t cmd)
 			heap_free(sbuf);
 		}
 		break;
-*/
 
 	case 't':
 		{
@@ -887,6 +935,127 @@ void test6_init(struct tcp_instance *tcpi)
 	ts->ts_listen(ts, 1237);
 }
 
+/*
+ * Test 7 holds on to the segments that it receives so that we can check that
+ * TCP charges them against its receive window.  Everything is released a
+ * few seconds after the first segment is held.
+ */
+#define TEST7_HOLD_MAX 8
+#define TEST7_HOLD_TICKS (5 * TICK_RATE)
+
+struct lock test7_lock;
+struct netbuf *test7_held[TEST7_HOLD_MAX];
+u8_t test7_count = 0;
+struct oneshot *test7_timer;
+u8_t test7_timer_running = FALSE;
+
+/*
+ * test7_release()
+ *	Timer callback that lets go of all of the segments we're holding.
+ */
+void test7_release(void *arg)
+{
+	struct netbuf *held[TEST7_HOLD_MAX];
+	u8_t i, ct;
+
+	spinlock_lock(&test7_lock);
+	ct = test7_count;
+	for (i = 0; i < ct; i++) {
+		held[i] = test7_held[i];
+	}
+	test7_count = 0;
+	test7_timer_running = FALSE;
+	spinlock_unlock(&test7_lock);
+
+	for (i = 0; i < ct; i++) {
+		netbuf_deref(held[i]);
+	}
+}
+
+/*
+ * test7_close()
+ */
+void test7_close(void *clnt)
+{
+	struct tcp_client *tc;
+	struct tcp_instance *tcpi;
+	struct tcp_server *ts;
+
+	tc = (struct tcp_client *)clnt;
+	ts = tc->tc_server;
+	tcpi = ts->ts_instance;
+	
+	tcpi->ti_client_detach(tcpi, ts);
+}
+
+/*
+ * test7_recv()
+ *	A target for TCP messages that holds on to them.
+ */
+void test7_recv(void *clnt, struct netbuf *nb)
+{
+	spinlock_lock(&test7_lock);
+
+	if (test7_count < TEST7_HOLD_MAX) {
+		netbuf_ref(nb);
+		test7_held[test7_count++] = nb;
+
+		if (!test7_timer_running) {
+			test7_timer_running = TRUE;
+			test7_timer->os_ticks_left = TEST7_HOLD_TICKS;
+			oneshot_attach(test7_timer);
+		}
+	}
+
+	spinlock_unlock(&test7_lock);
+}
+
+/*
+ * test7_connect()
+ */
+void test7_connect(void *clnt, void *srv)
+{
+	struct tcp_client *tc;
+	struct tcp_instance *tcpi;
+	struct tcp_server *ts;
+
+	tcpi = ((struct tcp_server *)srv)->ts_instance;
+	
+	tc = tcp_client_alloc();
+	tc->tc_recv = test7_recv;
+	tc->tc_close = test7_close;
+	ts = tcpi->ti_client_attach(tcpi, tc);
+	tcp_client_deref(tc);
+	
+	ts->ts_accept(ts, srv);
+}
+
+/*
+ * test7_init()
+ */
+void test7_init(struct tcp_instance *tcpi)
+{
+	struct tcp_client *tc;
+	struct tcp_server *ts;
+	
+	spinlock_init(&test7_lock, 0x50);
+
+	test7_timer = oneshot_alloc();
+	test7_timer->os_callback = test7_release;
+	test7_timer->os_arg = NULL;
+	        		
+	/*
+	 * Hook TCP requests for our server socket.
+	 */
+	tc = tcp_client_alloc();
+	tc->tc_recv = test7_recv;
+	tc->tc_connect = test7_connect;
+	ts = tcpi->ti_client_attach(tcpi, tc);
+	tcp_client_deref(tc);
+		
+	ts->ts_listen(ts, 1238);
+}
+
 /*
  * init()
  */
@@ -937,6 +1106,18 @@ void init(void)
 	ipi2 = ip_instance_alloc(eii, 0xc0a800cd);
 	udpi2 = udp_instance_alloc(ipi2);
 	tcpi2 = tcp_instance_alloc(ipi2);
+
+	/*
+	 * Route to the Ethernet's network, and from there to anywhere else.
+	 */
+	ip_route_add(eii, 0xc0a80000, 24, 0x00000000);
+	ip_route_add(eii, 0x00000000, 0, 0xc0a80001);
+
+	/*
+	 * Route packets between the PPP and Ethernet interfaces.
+	 */
+	ip_instance_set_forward(ipi1, TRUE);
+	ip_instance_set_forward(ipi2, TRUE);
 #endif
 
 	/*
@@ -973,6 +1154,15 @@ void init(void)
 	test6_init(tcpi1);
 #endif
 
+	/*
+	 * Create the basic setup for test 7.
+	 */
+#if defined(DJHPC) || defined(DJHNE) || defined(DJHEEP)
+	test7_init(tcpi2);
+#else
+	test7_init(tcpi1);
+#endif
+
 	/*
 	 * Now tidy up!
 	 */
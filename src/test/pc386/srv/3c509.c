@@ -30,9 +30,12 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "pic.h"
+#include "timer.h"
 #include "ethdev.h"
 #include "3c509.h"
 
@@ -128,6 +131,8 @@ void trap_irq5(void)
 {
 	debug_set_lights(0x07);
 
+	isr_timer_wakeup();
+
 	isr_spinlock_lock(&dev_isr_lock);
 
 	pic_acknowledge(5);
@@ -161,24 +166,27 @@ struct netbuf *c509_recv_get_packet(void)
 	        u8_t *pkt;
 	        u16_t *buf;
 	        u16_t words;
+	        u16_t w;
+	        u32_t sum;
         	u16_t pktsz = ((stat & 0x07ff) + 1) & 0xfffe;
 		
-		pkt = (u8_t *)membuf_alloc(pktsz, NULL);
+		nb = netbuf_alloc_with_data(pktsz);
+		pkt = (u8_t *)nb->nb_datalink;
 		buf = (u16_t *)pkt;
 	
 		/*
-		 * Read the packet.
+		 * Read the packet, summing it for the IP checksums as we go.
 		 */
 		words = pktsz >> 1;
+		sum = 0;
 		while (words) {
-			*buf++ = c509_read16(C509_W1_RX_DATA);
+			w = c509_read16(C509_W1_RX_DATA);
+			*buf++ = w;
+			sum += w;
 			words--;
 		}
 
-        	nb = netbuf_alloc();
-		nb->nb_datalink_membuf = pkt;
-		nb->nb_datalink = pkt;
-		nb->nb_datalink_size = pktsz;
+		netbuf_set_rx_csum(nb, pkt, pktsz, ipcsum_fold(sum));
 	}
 
         /*
@@ -25,9 +25,12 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "pic.h"
+#include "timer.h"
 #include "ethdev.h"
 #include "i82595.h"
 
@@ -112,6 +115,8 @@ void trap_irq5(void)
 {
 	debug_set_lights(0x07);
 
+	isr_timer_wakeup();
+
 	isr_spinlock_lock(&dev_isr_lock);
 
 	pic_acknowledge(5);
@@ -170,6 +175,8 @@ static struct netbuf *i82595_recv_get_packet(void)
 	        u8_t *pkt;
 	        u16_t *buf;
 	        u16_t words;
+	        u16_t w;
+	        u32_t sum;
         	u16_t pktsz;
 		
 		/*
@@ -177,22 +184,28 @@ static struct netbuf *i82595_recv_get_packet(void)
 		 */
 		pktsz = i82595_read16(I82595_PG0_IOPORT);
 
-		pkt = (u8_t *)membuf_alloc(pktsz, NULL);
+		nb = netbuf_alloc_with_data(pktsz);
+		pkt = (u8_t *)nb->nb_datalink;
 	        buf = (u16_t *)pkt;
 	
 		/*
-		 * Read the packet.
+		 * Read the packet, summing it for the IP checksums as we go.
+		 * If the size is odd then we pick up one extra byte, so we
+		 * don't record a sum in that case.
 		 */
 		words = (pktsz + 1) >> 1;
+		sum = 0;
 		while (words) {
-			*buf++ = i82595_read16(I82595_PG0_IOPORT);
+			w = i82595_read16(I82595_PG0_IOPORT);
+			*buf++ = w;
+			sum += w;
 			words--;
 		}
+
+		if (!(pktsz & 0x01)) {
+			netbuf_set_rx_csum(nb, pkt, pktsz, ipcsum_fold(sum));
+		}
 		
-        	nb = netbuf_alloc();
-		nb->nb_datalink_membuf = pkt;
-		nb->nb_datalink = pkt;
-		nb->nb_datalink_size = pktsz;
         }
 
 	next_rxl = nextpl;
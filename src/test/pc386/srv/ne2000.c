@@ -39,9 +39,12 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "netbuf.h"
+#include "ipcsum.h"
 #include "pic.h"
+#include "timer.h"
 #include "ethdev.h"
 #include "ne2000.h"
 
@@ -247,6 +250,8 @@ static volatile u8_t tx_available = 1;
 void trap_irq5(void)
 {
 	debug_set_lights(0x2f);
+
+	isr_timer_wakeup();
 			
 	isr_spinlock_lock(&dev_isr_lock);
 
@@ -277,6 +282,8 @@ static struct netbuf *ns8390_recv_get_packet(void)
 	u8_t nextpg;
 	u16_t i;
         u8_t j;
+	u16_t w;
+	u32_t sum;
 
 	ns8390_write8(NS8390_CR, NS8390_CR_RD2 | NS8390_CR_PS0);
 	curr = ns8390_read8(NS8390_PG1_CURR);
@@ -342,7 +349,8 @@ static struct netbuf *ns8390_recv_get_packet(void)
 		return NULL;
 	}
 	
-	pkt = (u8_t *)membuf_alloc(count, NULL);
+	nb = netbuf_alloc_with_data(count);
+	pkt = (u8_t *)nb->nb_datalink;
 	buf = (u16_t *)pkt;
 		
 	/*
@@ -355,18 +363,24 @@ static struct netbuf *ns8390_recv_get_packet(void)
 	ns8390_write8(NS8390_PG0_RSAR1, bnry);
 
 	/*
-	 * Perform the read.
+	 * Perform the read, summing the packet for the IP checksums as we go.
 	 */	
 	words = count >> 1;
+	sum = 0;
 	ns8390_write8(NS8390_CR, NS8390_CR_STA | NS8390_CR_RD0);
 	for (i = 0; i < words; i++) {
-		*buf++ = ns8390_read16(NS8390_IOPORT);
+		w = ns8390_read16(NS8390_IOPORT);
+		*buf++ = w;
+		sum += w;
 	}
 
 	if (count & 0x01) {
 		*((u8_t *)buf) = ns8390_read8(NS8390_IOPORT);
+		sum += *((u8_t *)buf);
 	}
 
+	netbuf_set_rx_csum(nb, pkt, count, ipcsum_fold(sum));
+
 	/*
 	 * Tidy up.
 	 */
@@ -386,11 +400,6 @@ static struct netbuf *ns8390_recv_get_packet(void)
 	}
 	ns8390_write8(NS8390_PG0_BNRY, nextpg);
 
-	nb = netbuf_alloc();
-	nb->nb_datalink_membuf = pkt;
-	nb->nb_datalink = pkt;
-	nb->nb_datalink_size = count;
-		
 	return nb;
 }
 
@@ -26,11 +26,33 @@
 #include "context.h"
 #include "thread.h"
 #include "heap.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "pic.h"
 #include "timer.h"
 #include "oneshot.h"
 
+/*
+ * Port addresses of the CMOS RTC index and data registers
+ */
+#define RTC_INDEX 0x70
+#define RTC_DATA 0x71
+
+/*
+ * RTC registers
+ */
+#define RTC_SECONDS 0x00
+#define RTC_MINUTES 0x02
+#define RTC_HOURS 0x04
+#define RTC_STATUS_A 0x0a
+#define RTC_STATUS_B 0x0b
+
+/*
+ * RTC status bits - update in progress and binary (rather than BCD) values
+ */
+#define RTC_UIP 0x80
+#define RTC_BINARY 0x04
+
 /*
  * Port addresses of the control port and timer channels
  */
@@ -44,11 +66,26 @@
  */
 #define CMD_SQR_WAVE 0x34
 
+/*
+ * Command to set interrupt on terminal count mode
+ */
+#define CMD_ONE_SHOT 0x30
+
 /*
  * Command to latch the timer registers
  */
 #define CMD_LATCH 0x00
 
+/*
+ * Command to read back the status and count of channel 0 (8254 only)
+ */
+#define CMD_READ_BACK 0xc2
+
+/*
+ * Read back status bit that reflects the state of the channel's output pin
+ */
+#define STATUS_OUT 0x80
+
 /*
  * Number of PIT ticks per second.
  */
@@ -61,6 +98,12 @@
  */
 #define PIT_LATCH ((PIT_TICKS + (TICK_RATE / 2)) / TICK_RATE)
 
+/*
+ * The most ticks that we can let pass while idle - limited by the 16 bit
+ * counter.
+ */
+#define PIT_IDLE_MAX_TICKS (0xffff / PIT_LATCH)
+
 /*
  * Timer state values.
  */
@@ -69,6 +112,10 @@ static struct lock timer_lock;
 static struct lock timer_isr_lock;
 static struct context *timer_isr_ctx;
 static volatile u16_t isr_ticks = 0;
+static u16_t idle_count = 0;		/* PIT count programmed for idle (0 if periodic) */
+static u16_t idle_part = 0;		/* PIT counts of the current tick already run */
+u32_t timer_irqs = 0;
+static u32_t wall_base;			/* RTC time of day when ticks started */
 
 /*
  * Load average values.
@@ -77,6 +124,172 @@ u8_t ldavg_runnable = 0;
 u32_t avenrun[LDAV_VALS] = {0, 0, 0};
 u16_t ldavg_ticks = LDAV_TICKS;
 
+/*
+ * timer_set_periodic()
+ *	Program channel 0 to interrupt us once every tick.
+ *
+ * The output format is command, LSByte, MSByte.  Note that the lowest the
+ * value of HZ can be is 19 - otherwise the calculations get screwed up.
+ */
+static void timer_set_periodic(void)
+{
+	out8(PIT_CTRL, CMD_SQR_WAVE);
+	out8(PIT_CH0, (PIT_LATCH - 1) & 0x00ff);
+	out8(PIT_CH0, ((PIT_LATCH - 1) & 0xff00) >> 8);
+}
+
+/*
+ * timer_set_one_shot()
+ *	Program channel 0 to interrupt us once after a given number of counts.
+ */
+static void timer_set_one_shot(u16_t count)
+{
+	out8(PIT_CTRL, CMD_ONE_SHOT);
+	out8(PIT_CH0, count & 0x00ff);
+	out8(PIT_CH0, (count & 0xff00) >> 8);
+}
+
+/*
+ * isr_timer_idle_exit()
+ *	Return from a tickless idle period to periodic ticks.
+ *
+ * We assume that the timer ISR lock is held.  If the channel's output has
+ * gone high then the whole idle period has run, otherwise we work out how
+ * far through it we got from the count that's left.  The elapsed whole
+ * ticks are handed to the overflow thread, which steps the wall-clock and
+ * the oneshot timers on by all of them at once.  If we stopped part way
+ * through a tick then we run one more one-shot period to finish that tick
+ * before going back to periodic mode, so that no time is lost.
+ */
+static void isr_timer_idle_exit(void)
+{
+	u8_t status;
+	u16_t count;
+	u16_t ticks;
+	u32_t elapsed;
+
+	out8(PIT_CTRL, CMD_READ_BACK);
+	status = in8(PIT_CH0);
+	count = (u16_t)in8(PIT_CH0);
+	count |= ((u16_t)in8(PIT_CH0)) << 8;
+
+	elapsed = (u32_t)idle_part + idle_count;
+	if (!(status & STATUS_OUT)) {
+		elapsed -= count;
+	}
+
+	ticks = (u16_t)(elapsed / PIT_LATCH);
+	idle_part = (u16_t)(elapsed % PIT_LATCH);
+	if (idle_part) {
+		idle_count = PIT_LATCH - idle_part;
+		timer_set_one_shot(idle_count);
+	} else {
+		idle_count = 0;
+		timer_set_periodic();
+	}
+
+	if (ticks) {
+		isr_ticks += ticks;
+		isr_context_signal(timer_isr_ctx);
+	}
+}
+
+/*
+ * rtc_read()
+ *	Read one of the RTC's registers.
+ */
+static u8_t rtc_read(u8_t reg)
+{
+	u8_t val;
+
+	isr_disable();
+	out8(RTC_INDEX, reg);
+	val = in8(RTC_DATA);
+	isr_enable();
+
+	return val;
+}
+
+/*
+ * rtc_get_seconds()
+ *	Get the RTC's time of day in seconds.
+ *
+ * We read the time while no update is in progress and read it again if the
+ * seconds have moved on since.  The BIOS leaves the RTC in 24 hour mode.
+ */
+static u32_t rtc_get_seconds(void)
+{
+	u8_t sec, min, hour;
+
+	do {
+		while (rtc_read(RTC_STATUS_A) & RTC_UIP);
+		sec = rtc_read(RTC_SECONDS);
+		min = rtc_read(RTC_MINUTES);
+		hour = rtc_read(RTC_HOURS);
+	} while (sec != rtc_read(RTC_SECONDS));
+
+	if (!(rtc_read(RTC_STATUS_B) & RTC_BINARY)) {
+		sec = (sec & 0x0f) + ((sec >> 4) * 10);
+		min = (min & 0x0f) + ((min >> 4) * 10);
+		hour = (hour & 0x0f) + ((hour >> 4) * 10);
+	}
+
+	return ((u32_t)hour * 3600) + ((u32_t)min * 60) + sec;
+}
+
+/*
+ * isr_timer_wakeup()
+ *	Note that an interrupt other than the timer's has arrived.
+ *
+ * Called by other interrupt handlers so that if we were idling without ticks
+ * we go back to normal ticks before anyone else gets to run (they may want
+ * to use timers that expire before the idle period would have finished).
+ */
+void isr_timer_wakeup(void)
+{
+	isr_spinlock_lock(&timer_isr_lock);
+
+	if (idle_count) {
+		isr_timer_idle_exit();
+	}
+
+	isr_spinlock_unlock(&timer_isr_lock);
+}
+
+/*
+ * thread_idle_wait()
+ *	Halt the CPU until the next interrupt, skipping ticks if we can.
+ *
+ * This overrides the idle thread's default hook and is called with
+ * interrupts disabled.  If no oneshot timer is due for a few ticks then we
+ * stop the periodic tick and program the PIT to interrupt us once when the
+ * first one is due instead.
+ */
+void thread_idle_wait(void)
+{
+	isr_spinlock_lock(&timer_isr_lock);
+
+	/*
+	 * If the overflow thread has ticks still to process then the wheel
+	 * isn't up to date and we can't trust it.
+	 */
+	if (!isr_ticks && !idle_count) {
+		u16_t ticks;
+
+		ticks = isr_oneshot_get_idle_ticks(PIT_IDLE_MAX_TICKS);
+		if (ticks > 1) {
+			idle_count = (u16_t)(ticks * PIT_LATCH);
+			idle_part = 0;
+			timer_set_one_shot(idle_count);
+		}
+	}
+
+	isr_spinlock_unlock(&timer_isr_lock);
+
+	isr_enable_halt();
+	isr_disable();
+}
+
 /*
  * trap_irq0()
  */
@@ -88,8 +301,14 @@ void trap_irq0(void)
 	isr_spinlock_lock(&timer_isr_lock);
 
 	pic_acknowledge(IRQ_TIMER);
-				
-	isr_ticks++;
+
+	timer_irqs++;
+
+	if (idle_count) {
+		isr_timer_idle_exit();
+	} else {
+		isr_ticks++;
+	}
 
 	debug_check_stack(0x100);
 
@@ -116,19 +335,22 @@ void timer_overflow_thread(void *arg)
          */
 	timer_isr_ctx = current_context;
 
+	/*
+	 * Note the time of day that jiffies start counting from so that we
+	 * can check that they keep up with the RTC.
+	 */
+	wall_base = rtc_get_seconds();
+
 	isr_disable();
 	isr_spinlock_lock(&timer_isr_lock);
 	
 	/*
-	 * initialise 8254 (or 8253) channel 0.  We set the timer to
-	 * generate an interrupt every time we have done enough ticks.
-	 * The output format is command, LSByte, MSByte.  Note that the
-	 * lowest the value of HZ can be is 19 - otherwise the
-	 * calculations get screwed up,
+	 * initialise 8254 channel 0.  We set the timer to generate an
+	 * interrupt every time we have done enough ticks.  We need an 8254
+	 * rather than an 8253 because tickless idle uses the read back
+	 * command.
 	 */
-	out8(PIT_CTRL, CMD_SQR_WAVE);
-	out8(PIT_CH0, (PIT_LATCH - 1) & 0x00ff);
-	out8(PIT_CH0, ((PIT_LATCH - 1) & 0xff00) >> 8);
+	timer_set_periodic();
 
 	/*
 	 * Unmask timer interrupts - we don't need to worry yet though as
@@ -222,6 +444,25 @@ u32_t timer_get_jiffies(void)
 	return res;
 }
 
+/*
+ * timer_get_wall_seconds()
+ *	Get the number of seconds that the RTC has counted since ticks started.
+ *
+ * This is independent of the PIT, so comparing it with the jiffy count shows
+ * whether any ticks are being lost (good for up to a day).
+ */
+u32_t timer_get_wall_seconds(void)
+{
+	u32_t now;
+
+	now = rtc_get_seconds();
+	if (now < wall_base) {
+		now += 24L * 3600;
+	}
+
+	return now - wall_base;
+}
+
 /*
  * timer_dump_stats()
  *	Get the system load averages.
@@ -24,8 +24,10 @@
 #include "debug.h"
 #include "context.h"
 #include "thread.h"
+#include "atomic.h"
 #include "membuf.h"
 #include "pic.h"
+#include "timer.h"
 #include "uart.h"
 
 /*
@@ -175,6 +177,8 @@ void trap_irq4(void)
 	
 	debug_set_lights(0x01);
 
+	isr_timer_wakeup();
+
 	isr_spinlock_lock(&uart_isr_lock);
 
 	pic_acknowledge(4);